@@ -0,0 +1,76 @@
+# CMAKE generated file: DO NOT EDIT!
+# Generated by "Unix Makefiles" Generator, CMake Version 3.25
+
+# The generator used is:
+set(CMAKE_DEPENDS_GENERATOR "Unix Makefiles")
+
+# The top level Makefile was generated from the following files:
+set(CMAKE_MAKEFILE_DEPENDS
+  "CMakeCache.txt"
+  "/root/repo/CMakeLists.txt"
+  "CMakeFiles/3.25.1/CMakeCCompiler.cmake"
+  "CMakeFiles/3.25.1/CMakeCXXCompiler.cmake"
+  "CMakeFiles/3.25.1/CMakeSystem.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeCInformation.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeCXXInformation.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeCommonLanguageInclude.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeGenericSystem.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeInitializeConfigs.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeLanguageInformation.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeSystemSpecificInformation.cmake"
+  "/usr/share/cmake-3.25/Modules/CMakeSystemSpecificInitialize.cmake"
+  "/usr/share/cmake-3.25/Modules/CheckCSourceCompiles.cmake"
+  "/usr/share/cmake-3.25/Modules/CheckIncludeFile.cmake"
+  "/usr/share/cmake-3.25/Modules/CheckLibraryExists.cmake"
+  "/usr/share/cmake-3.25/Modules/Compiler/CMakeCommonCompilerMacros.cmake"
+  "/usr/share/cmake-3.25/Modules/Compiler/GNU-C.cmake"
+  "/usr/share/cmake-3.25/Modules/Compiler/GNU-CXX.cmake"
+  "/usr/share/cmake-3.25/Modules/Compiler/GNU.cmake"
+  "/usr/share/cmake-3.25/Modules/FindPackageHandleStandardArgs.cmake"
+  "/usr/share/cmake-3.25/Modules/FindPackageMessage.cmake"
+  "/usr/share/cmake-3.25/Modules/FindThreads.cmake"
+  "/usr/share/cmake-3.25/Modules/GNUInstallDirs.cmake"
+  "/usr/share/cmake-3.25/Modules/Internal/CheckSourceCompiles.cmake"
+  "/usr/share/cmake-3.25/Modules/Platform/Linux-GNU-C.cmake"
+  "/usr/share/cmake-3.25/Modules/Platform/Linux-GNU-CXX.cmake"
+  "/usr/share/cmake-3.25/Modules/Platform/Linux-GNU.cmake"
+  "/usr/share/cmake-3.25/Modules/Platform/Linux.cmake"
+  "/usr/share/cmake-3.25/Modules/Platform/UnixPaths.cmake"
+  )
+
+# The corresponding makefile is:
+set(CMAKE_MAKEFILE_OUTPUTS
+  "Makefile"
+  "CMakeFiles/cmake.check_cache"
+  )
+
+# Byproducts of CMake generate step:
+set(CMAKE_MAKEFILE_PRODUCTS
+  "CMakeFiles/CMakeDirectoryInformation.cmake"
+  )
+
+# Dependency information for all targets:
+set(CMAKE_DEPEND_INFO_FILES
+  "CMakeFiles/gen_size_classes.dir/DependInfo.cmake"
+  "CMakeFiles/amm_objects.dir/DependInfo.cmake"
+  "CMakeFiles/amm_static.dir/DependInfo.cmake"
+  "CMakeFiles/amm_shared.dir/DependInfo.cmake"
+  "CMakeFiles/amm_preload.dir/DependInfo.cmake"
+  "CMakeFiles/amm_example.dir/DependInfo.cmake"
+  "CMakeFiles/test_persistent_heap.dir/DependInfo.cmake"
+  "CMakeFiles/test_shared_heap.dir/DependInfo.cmake"
+  "CMakeFiles/test_stack_allocator.dir/DependInfo.cmake"
+  "CMakeFiles/test_buddy.dir/DependInfo.cmake"
+  "CMakeFiles/test_decay.dir/DependInfo.cmake"
+  "CMakeFiles/test_guarded.dir/DependInfo.cmake"
+  "CMakeFiles/test_locked_mode.dir/DependInfo.cmake"
+  "CMakeFiles/test_fork.dir/DependInfo.cmake"
+  "CMakeFiles/test_config.dir/DependInfo.cmake"
+  "CMakeFiles/test_snapshot.dir/DependInfo.cmake"
+  "CMakeFiles/test_copy.dir/DependInfo.cmake"
+  "CMakeFiles/test_cow.dir/DependInfo.cmake"
+  "CMakeFiles/test_size_classes.dir/DependInfo.cmake"
+  "CMakeFiles/test_cpp_wrapper.dir/DependInfo.cmake"
+  "CMakeFiles/test_ref_ptr.dir/DependInfo.cmake"
+  "CMakeFiles/test_malloc_shim.dir/DependInfo.cmake"
+  )
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/amm_example.dir/example.c.o"
+  "CMakeFiles/amm_example.dir/example.c.o.d"
+  "amm_example"
+  "amm_example.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/amm_example.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,10 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/amm_objects.dir/mem_manager.c.o"
+  "CMakeFiles/amm_objects.dir/mem_manager.c.o.d"
+  "generated/amm_size_classes.h"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/amm_objects.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
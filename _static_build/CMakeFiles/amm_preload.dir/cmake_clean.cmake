@@ -0,0 +1,14 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/amm_preload.dir/malloc_shim.c.o"
+  "CMakeFiles/amm_preload.dir/malloc_shim.c.o.d"
+  "CMakeFiles/amm_preload.dir/mem_manager.c.o"
+  "CMakeFiles/amm_preload.dir/mem_manager.c.o.d"
+  "generated/amm_size_classes.h"
+  "libamm_preload.pdb"
+  "libamm_preload.so"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/amm_preload.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,9 @@
+file(REMOVE_RECURSE
+  "libamm.pdb"
+  "libamm.so"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/amm_shared.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
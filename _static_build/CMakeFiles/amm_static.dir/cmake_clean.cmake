@@ -0,0 +1,9 @@
+file(REMOVE_RECURSE
+  "libamm.a"
+  "libamm.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/amm_static.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/gen_size_classes.dir/tools/gen_size_classes.c.o"
+  "CMakeFiles/gen_size_classes.dir/tools/gen_size_classes.c.o.d"
+  "gen_size_classes"
+  "gen_size_classes.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/gen_size_classes.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
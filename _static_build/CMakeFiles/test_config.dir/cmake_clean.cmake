@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_config.dir/tests/test_config.c.o"
+  "CMakeFiles/test_config.dir/tests/test_config.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_config"
+  "test_config.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_config.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
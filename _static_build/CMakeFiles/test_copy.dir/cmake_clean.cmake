@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_copy.dir/tests/test_copy.c.o"
+  "CMakeFiles/test_copy.dir/tests/test_copy.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_copy"
+  "test_copy.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_copy.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
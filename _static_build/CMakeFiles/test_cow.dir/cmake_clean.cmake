@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_cow.dir/tests/test_cow.c.o"
+  "CMakeFiles/test_cow.dir/tests/test_cow.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_cow"
+  "test_cow.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_cow.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
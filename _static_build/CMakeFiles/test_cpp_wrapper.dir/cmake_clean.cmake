@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_cpp_wrapper.dir/tests/test_cpp_wrapper.cpp.o"
+  "CMakeFiles/test_cpp_wrapper.dir/tests/test_cpp_wrapper.cpp.o.d"
+  "test_cpp_wrapper"
+  "test_cpp_wrapper.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_cpp_wrapper.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_decay.dir/tests/test_decay.c.o"
+  "CMakeFiles/test_decay.dir/tests/test_decay.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_decay"
+  "test_decay.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_decay.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_fork.dir/tests/test_fork.c.o"
+  "CMakeFiles/test_fork.dir/tests/test_fork.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_fork"
+  "test_fork.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_fork.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
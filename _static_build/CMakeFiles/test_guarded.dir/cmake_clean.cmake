@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_guarded.dir/tests/test_guarded.c.o"
+  "CMakeFiles/test_guarded.dir/tests/test_guarded.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_guarded"
+  "test_guarded.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_guarded.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_locked_mode.dir/tests/test_locked_mode.c.o"
+  "CMakeFiles/test_locked_mode.dir/tests/test_locked_mode.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_locked_mode"
+  "test_locked_mode.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_locked_mode.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_malloc_shim.dir/tests/test_malloc_shim.c.o"
+  "CMakeFiles/test_malloc_shim.dir/tests/test_malloc_shim.c.o.d"
+  "test_malloc_shim"
+  "test_malloc_shim.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_malloc_shim.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_persistent_heap.dir/tests/test_persistent_heap.c.o"
+  "CMakeFiles/test_persistent_heap.dir/tests/test_persistent_heap.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_persistent_heap"
+  "test_persistent_heap.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_persistent_heap.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
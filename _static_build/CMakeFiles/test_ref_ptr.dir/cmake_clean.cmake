@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_ref_ptr.dir/tests/test_ref_ptr.cpp.o"
+  "CMakeFiles/test_ref_ptr.dir/tests/test_ref_ptr.cpp.o.d"
+  "test_ref_ptr"
+  "test_ref_ptr.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_ref_ptr.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
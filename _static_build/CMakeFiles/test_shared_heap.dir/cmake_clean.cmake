@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_shared_heap.dir/tests/test_shared_heap.c.o"
+  "CMakeFiles/test_shared_heap.dir/tests/test_shared_heap.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_shared_heap"
+  "test_shared_heap.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_shared_heap.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_size_classes.dir/tests/test_size_classes.c.o"
+  "CMakeFiles/test_size_classes.dir/tests/test_size_classes.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_size_classes"
+  "test_size_classes.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_size_classes.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
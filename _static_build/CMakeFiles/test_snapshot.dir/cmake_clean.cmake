@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_snapshot.dir/tests/test_snapshot.c.o"
+  "CMakeFiles/test_snapshot.dir/tests/test_snapshot.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_snapshot"
+  "test_snapshot.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_snapshot.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,12 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/test_stack_allocator.dir/tests/test_stack_allocator.c.o"
+  "CMakeFiles/test_stack_allocator.dir/tests/test_stack_allocator.c.o.d"
+  "generated/amm_size_classes.h"
+  "test_stack_allocator"
+  "test_stack_allocator.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/test_stack_allocator.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,38 @@
+# CMake generated Testfile for 
+# Source directory: /root/repo
+# Build directory: /root/repo/_static_build
+# 
+# This file includes the relevant testing commands required for 
+# testing this directory and lists subdirectories to be tested as well.
+add_test(test_persistent_heap "/root/repo/_static_build/test_persistent_heap")
+set_tests_properties(test_persistent_heap PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;99;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_shared_heap "/root/repo/_static_build/test_shared_heap")
+set_tests_properties(test_shared_heap PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;100;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_stack_allocator "/root/repo/_static_build/test_stack_allocator")
+set_tests_properties(test_stack_allocator PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;101;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_buddy "/root/repo/_static_build/test_buddy")
+set_tests_properties(test_buddy PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;102;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_decay "/root/repo/_static_build/test_decay")
+set_tests_properties(test_decay PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;103;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_guarded "/root/repo/_static_build/test_guarded")
+set_tests_properties(test_guarded PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;104;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_locked_mode "/root/repo/_static_build/test_locked_mode")
+set_tests_properties(test_locked_mode PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;105;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_fork "/root/repo/_static_build/test_fork")
+set_tests_properties(test_fork PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;106;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_config "/root/repo/_static_build/test_config")
+set_tests_properties(test_config PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;107;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_snapshot "/root/repo/_static_build/test_snapshot")
+set_tests_properties(test_snapshot PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;108;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_copy "/root/repo/_static_build/test_copy")
+set_tests_properties(test_copy PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;109;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_cow "/root/repo/_static_build/test_cow")
+set_tests_properties(test_cow PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;110;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_size_classes "/root/repo/_static_build/test_size_classes")
+set_tests_properties(test_size_classes PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;87;add_test;/root/repo/CMakeLists.txt;111;amm_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_cpp_wrapper "/root/repo/_static_build/test_cpp_wrapper")
+set_tests_properties(test_cpp_wrapper PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;95;add_test;/root/repo/CMakeLists.txt;112;amm_cxx_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_ref_ptr "/root/repo/_static_build/test_ref_ptr")
+set_tests_properties(test_ref_ptr PROPERTIES  TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;95;add_test;/root/repo/CMakeLists.txt;113;amm_cxx_test;/root/repo/CMakeLists.txt;0;")
+add_test(test_malloc_shim "/root/repo/_static_build/test_malloc_shim")
+set_tests_properties(test_malloc_shim PROPERTIES  ENVIRONMENT "LD_PRELOAD=/root/repo/_static_build/libamm_preload.so" TIMEOUT "120" _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;118;add_test;/root/repo/CMakeLists.txt;0;")
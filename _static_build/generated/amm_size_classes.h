@@ -0,0 +1,26 @@
+// Generated by gen_size_classes; do not edit
+#ifndef AMM_SIZE_CLASSES_H
+#define AMM_SIZE_CLASSES_H
+
+#include <stdint.h>
+
+#define AMM_STATIC_CLASS_COUNT 24
+#define AMM_STATIC_CLASS_GRANULE_SHIFT 4
+#define AMM_STATIC_CLASS_ALIGNMENT 16
+#define AMM_STATIC_CLASS_MAX_SIZE 2048
+
+// Block size, blocks per slab and thread cache refill batch of each class
+static const uint32_t amm_class_size[AMM_STATIC_CLASS_COUNT] = {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048};
+static const uint32_t amm_class_blocks[AMM_STATIC_CLASS_COUNT] = {4096, 2048, 1365, 1024, 819, 682, 585, 512, 409, 341, 292, 256, 204, 170, 146, 128, 102, 85, 73, 64, 51, 42, 36, 32};
+static const uint16_t amm_class_batch[AMM_STATIC_CLASS_COUNT] = {64, 64, 64, 64, 64, 64, 64, 64, 51, 42, 36, 32, 25, 21, 18, 16, 12, 10, 9, 8, 6, 5, 4, 4};
+
+// Class index by size in granules, rounded up
+static const uint8_t amm_size_class[(AMM_STATIC_CLASS_MAX_SIZE >> AMM_STATIC_CLASS_GRANULE_SHIFT) + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15,
+    15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19,
+    19, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    23
+};
+
+#endif // AMM_SIZE_CLASSES_H
@@ -0,0 +1,93 @@
+// Example usage of the memory manager library
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem_manager.h"
+
+// Main function
+int main(int argc, char* argv[]) {
+    // Sweep copy sizes instead of running the example
+    if (argc > 1 && strcmp(argv[1], "bench-copy") == 0) {
+        benchmark_copy(stdout, argc > 2 ? (size_t)strtoull(argv[2], NULL, 0) : COPY_BENCHMARK_MAX_SIZE);
+        return 0;
+    }
+    // Compare allocation latency of the heap backends instead
+    if (argc > 1 && strcmp(argv[1], "bench-latency") == 0) {
+        return benchmark_heap_latency(stdout, argc > 2 ? (size_t)strtoull(argv[2], NULL, 0) : HEAP_BENCHMARK_OPERATIONS) == 0 ? 0 : 1;
+    }
+
+    // Configure the manager; AMM_CONF can still override any of this at run time
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.report_leaks = 1; // Report leaked blocks at teardown,
+    config.sample_rate = 1; // recording the allocation site of every allocation
+    config.pools[config.pool_count++] = (PoolConfig){32, 10, 8}; // Pool with 32-byte blocks, aligned to 8 bytes
+    config.pools[config.pool_count++] = (PoolConfig){64, 10, 16}; // Pool with 64-byte blocks, aligned to 16 bytes
+    MemoryManager* manager = create_memory_manager_ex(&config);
+
+    // Allocate memory
+    int* array = (int*)allocate_memory(manager, 10 * sizeof(int), sizeof(int));
+    for (int i = 0; i < 10; i++) {
+        array[i] = i + 1;
+    }
+
+    // Increment reference count
+    increment_ref_count(manager, array);
+
+    // Reallocate memory
+    array = (int*)reallocate_memory(manager, array, 20 * sizeof(int), sizeof(int));
+    for (int i = 10; i < 20; i++) {
+        array[i] = i + 1;
+    }
+
+    // Print reallocated array
+    printf("Reallocated array: ");
+    for (int i = 0; i < 20; i++) {
+        printf("%d ", array[i]);
+    }
+    printf("\n");
+
+    // Copy memory
+    int* copy = (int*)copy_memory(manager, array, 20 * sizeof(int));
+
+    // Print copied array
+    printf("Copied array: ");
+    for (int i = 0; i < 20; i++) {
+        printf("%d ", copy[i]);
+    }
+    printf("\n");
+
+    // Print memory blocks
+    print_memory_blocks(manager);
+
+    // Export a heap snapshot as JSON through a small caller-owned buffer
+    SnapshotCursor cursor;
+    char snapshot[SNAPSHOT_MIN_BUFFER];
+    begin_heap_snapshot(&cursor, SNAPSHOT_JSON);
+    while (!heap_snapshot_done(&cursor)) {
+        size_t written = write_heap_snapshot(manager, &cursor, snapshot, sizeof(snapshot));
+        fwrite(snapshot, 1, written, stdout);
+    }
+    printf("\n\n");
+
+    // Decrement reference count
+    decrement_ref_count(manager, array); // This will deallocate if ref_count drops to 0
+    decrement_ref_count(manager, array); // This should trigger deallocation
+
+    // Deallocate copied memory
+    decrement_ref_count(manager, copy);
+
+    // Print memory blocks after deallocation
+    print_memory_blocks(manager);
+
+    // Defragment memory
+    defragment_memory(manager);
+
+    // Print memory blocks after defragmentation
+    print_memory_blocks(manager);
+
+    // Free memory manager
+    free_memory_manager(manager);
+
+    return 0;
+}
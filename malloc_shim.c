@@ -0,0 +1,217 @@
+// malloc-compatible interposition shim over a process-wide MemoryManager, loaded with LD_PRELOAD
+#define _GNU_SOURCE // For RTLD_NEXT
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mem_manager.h"
+
+// glibc's allocator, used for memory requested while the shim itself is running
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+// Every shim allocation is preceded by the distance back to its manager block and by a tag
+// derived from its address, which tells it apart from the chunk header of a glibc allocation
+#define SHIM_TAG_SALT ((uintptr_t)0x9e3779b97f4a7c15ULL)
+#define SHIM_MIN_ALIGNMENT 16
+
+// Pools created for small allocations, including the SHIM_MIN_ALIGNMENT prefix, unless the
+// build generated its own size classes
+#ifndef AMM_STATIC_SIZE_CLASSES
+#define SHIM_POOL_BLOCKS 4096
+static const size_t shim_pool_sizes[] = {32, 48, 64, 96, 128, 256, 512, 1024};
+#endif
+
+static MemoryManager* shim_manager;
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static size_t (*libc_malloc_usable_size)(void* ptr);
+static int trace_fd = -1; // Allocation sizes are appended here when AMM_TRACE names a file
+
+// Nonzero while this thread is inside the shim; nested requests then go to glibc
+static __thread int shim_depth __attribute__((tls_model("initial-exec")));
+
+// Hold the manager's locks across fork, so a child that keeps allocating never finds one taken by
+// a thread it does not have
+static void shim_prepare_fork(void) {
+    lock_manager_for_fork(shim_manager);
+}
+
+static void shim_parent_after_fork(void) {
+    unlock_manager_after_fork(shim_manager);
+}
+
+static void shim_child_after_fork(void) {
+    reset_manager_after_fork(shim_manager);
+}
+
+// Create the process-wide manager and its pools
+static void shim_init(void) {
+    shim_manager = create_memory_manager();
+#ifndef AMM_STATIC_SIZE_CLASSES
+    for (size_t i = 0; i < sizeof(shim_pool_sizes) / sizeof(shim_pool_sizes[0]); i++) {
+        create_memory_pool(shim_manager, shim_pool_sizes[i], SHIM_POOL_BLOCKS, SHIM_MIN_ALIGNMENT);
+    }
+#endif
+    libc_malloc_usable_size = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+    const char* trace = getenv("AMM_TRACE");
+    if (trace != NULL && trace[0] != '\0') {
+        trace_fd = open(trace, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    pthread_atfork(shim_prepare_fork, shim_parent_after_fork, shim_child_after_fork);
+}
+
+// Append a size requested from the manager to the trace, one line per allocation, for tools/gen_size_classes
+static void trace_allocation(size_t size) {
+    char line[24];
+    size_t length = sizeof(line);
+    line[--length] = '\n';
+    do {
+        line[--length] = (char)('0' + size % 10);
+        size /= 10;
+    } while (size != 0);
+    ssize_t written = write(trace_fd, line + length, sizeof(line) - length);
+    (void)written; // A lost trace line only skews the statistics
+}
+
+// Check whether ptr came from the shim rather than from glibc
+static int shim_owns(void* ptr) {
+    return ((uintptr_t*)ptr)[-1] == ((uintptr_t)ptr ^ SHIM_TAG_SALT);
+}
+
+// Start of the manager block behind a shim allocation
+static void* shim_block(void* ptr) {
+    return (char*)ptr - ((uintptr_t*)ptr)[-2];
+}
+
+// Allocate from the manager, leaving room for the tag in front of the returned pointer
+static void* shim_allocate(size_t size, size_t alignment) {
+    if (shim_depth > 0) {
+        return alignment > SHIM_MIN_ALIGNMENT ? __libc_memalign(alignment, size) : __libc_malloc(size);
+    }
+
+    size_t offset = alignment > SHIM_MIN_ALIGNMENT ? alignment : SHIM_MIN_ALIGNMENT;
+    void* block = NULL;
+    shim_depth++;
+    pthread_once(&shim_once, shim_init);
+    if (size <= SIZE_MAX - offset) {
+        if (trace_fd >= 0) {
+            trace_allocation(offset + size);
+        }
+        block = allocate_memory(shim_manager, offset + size, offset);
+    }
+    shim_depth--;
+    if (block == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t* ptr = (uintptr_t*)((char*)block + offset);
+    ptr[-2] = offset;
+    ptr[-1] = (uintptr_t)ptr ^ SHIM_TAG_SALT;
+    return ptr;
+}
+
+// Bytes usable at a shim allocation
+static size_t shim_usable_size(void* ptr) {
+    return block_usable_size(shim_block(ptr)) - ((uintptr_t*)ptr)[-2];
+}
+
+SHIM_EXPORT void* malloc(size_t size) {
+    return shim_allocate(size, SHIM_MIN_ALIGNMENT);
+}
+
+SHIM_EXPORT void free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!shim_owns(ptr)) {
+        __libc_free(ptr);
+        return;
+    }
+    ((uintptr_t*)ptr)[-1] = 0;
+    shim_depth++;
+    deallocate_memory(shim_manager, shim_block(ptr));
+    shim_depth--;
+}
+
+SHIM_EXPORT void* calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (shim_depth > 0) {
+        return __libc_calloc(count, size);
+    }
+    void* ptr = shim_allocate(count * size, SHIM_MIN_ALIGNMENT);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size); // Pool blocks are reused without clearing
+    }
+    return ptr;
+}
+
+SHIM_EXPORT void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (!shim_owns(ptr)) {
+        return __libc_realloc(ptr, size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    size_t usable = shim_usable_size(ptr);
+    if (size <= usable) {
+        return ptr;
+    }
+    void* moved = shim_allocate(size, SHIM_MIN_ALIGNMENT);
+    if (moved != NULL) {
+        memcpy(moved, ptr, usable);
+        free(ptr);
+    }
+    return moved;
+}
+
+SHIM_EXPORT int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = shim_allocate(size, alignment);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return shim_allocate(size, alignment);
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (shim_owns(ptr)) {
+        return shim_usable_size(ptr);
+    }
+    return libc_malloc_usable_size != NULL ? libc_malloc_usable_size(ptr) : 0;
+}
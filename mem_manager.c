@@ -1,388 +1,5331 @@
+#define _GNU_SOURCE // For sched_getcpu
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // Include for uintptr_t
+#include <stdatomic.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include "mem_manager.h"
+
+// Size classes baked in by the build, see tools/gen_size_classes.c
+#ifdef AMM_STATIC_SIZE_CLASSES
+#include "amm_size_classes.h"
+#endif
+
+// Restartable sequences need the rseq area glibc 2.35+ registers for every thread, and asm goto with
+// output operands (GCC 11, Clang 11) so the sequences can declare their store to rseq_cs
+#if defined(__linux__) && defined(__x86_64__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35)) && \
+    ((defined(__clang__) && __clang_major__ >= 11) || (!defined(__clang__) && __GNUC__ >= 11))
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#else
+#define HAVE_RSEQ 0
+#endif
+
+// Vector copy kernels are chosen at run time on x86-64 with GCC or Clang
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define COPY_ENGINE_X86 1
+#else
+#define COPY_ENGINE_X86 0
+#endif
+
+// Built into the malloc shim, the manager takes its own memory from glibc instead of from itself
+#ifdef AMM_LIBC_MALLOC
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+#define malloc __libc_malloc
+#define calloc __libc_calloc
+#define realloc __libc_realloc
+#define free __libc_free
+#define posix_memalign(out, alignment, size) ((*(out) = __libc_memalign((alignment), (size))) == NULL)
+#endif
+
+// Address of the function that called the current one, used as the allocation site
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#define HAVE_BACKTRACE 1
+#else
+#define HAVE_BACKTRACE 0
+#endif
+
+#if defined(__GNUC__)
+#define CALLER_ADDRESS() __builtin_extract_return_addr(__builtin_return_address(0))
+#else
+#define CALLER_ADDRESS() NULL
+#endif
+
+// Hint that memory will be read soon
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+// Copy engine tuning
+#define COPY_STREAM_DEFAULT_THRESHOLD ((size_t)8 << 20) // Streaming stores above this, when the cache size is unknown
+#define COPY_BATCH_PREFETCH_DISTANCE 4 // Sources prefetched ahead of the one being copied
+
+// Heap latency benchmark workload
+#define HEAP_BENCHMARK_LIVE_BLOCKS 4096
+#define HEAP_BENCHMARK_POOL_BLOCKS 64
+#define HEAP_BENCHMARK_MAX_SIZE ((size_t)256 << 10)
+#define HEAP_BENCHMARK_TAIL_BOUND 1.5 // Most the TLSF p99.99 latency may exceed the malloc backend's by
+
+// Snapshot tuning
+#define SNAPSHOT_RECORDS_PER_LOCK 64 // Records emitted before the manager lock is dropped
+
+// Thread cache tuning
+#define THREAD_CACHE_INITIAL_LIMIT 16 // Blocks a thread may cache per size class at first
+#define THREAD_CACHE_MIN_LIMIT 4
+#define THREAD_CACHE_MAX_LIMIT 1024
+#define THREAD_CACHE_ADAPT_WINDOW 64 // Allocations between limit adjustments
+#define THREAD_CACHE_GROW_MISS_RATIO 32 // Grow a limit when more than 1 in N allocations miss
+#define THREAD_CACHE_GC_INTERVAL 64 // Refills and flushes between idle scans
+#define THREAD_CACHE_DEFAULT_CAP ((size_t)8 << 20) // Bytes cached across all threads
+#define THREAD_CACHE_SYNC_BYTES ((size_t)16 << 10) // Cached bytes a thread adds before publishing them to the cap
+#define DEFERRED_LOG_SIZE 256 // Deferred decrements a thread logs before applying them
+#define EPOCH_RECLAIM_INTERVAL 64 // Retirements between attempts to advance the epoch
+#define HAZARD_SCAN_THRESHOLD 64 // Retirements between scans of the hazard pointers
+#define HAZARD_RETIRED_MAX 256 // Bound on a thread's retired blocks awaiting a scan
+
+// NUMA placement, without depending on libnuma
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define NUMA_MAX_NODES 1024
+
+// Persistent heap file format
+#define PERSISTENT_MAGIC 0x50414548504d4d41ULL // "AMMPHEAP"
+#define PERSISTENT_VERSION 3
+#define PERSISTENT_ALIGNMENT 16
+#define PERSISTENT_MIN_CLASS 5 // Smallest block: 32 bytes, 16 of them usable
+#define PERSISTENT_CLASSES 48
+#define PERSISTENT_FREE 1
+#define PERSISTENT_ALLOCATED 2
+#define PERSISTENT_BLOCK_TAG 0x9e3779b97f4a7c15ULL // Allocated blocks hold offset ^ tag, telling a block start from user data
+#define SHARED_HEAP_ATTACH_SPINS 100000 // Yields an attacher waits for the creator to finish
+
+// Buddy region tuning; heap blocks from BUDDY_MIN_BLOCK / 2 to BUDDY_MAX_BLOCK bytes, header included,
+// that stay below the mmap threshold come from an arena's buddy region
+#define BUDDY_MIN_ORDER 12
+#define BUDDY_MAX_ORDER 20
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_MIN_BLOCK ((size_t)1 << BUDDY_MIN_ORDER) // 4 KiB
+#define BUDDY_MAX_BLOCK ((size_t)1 << BUDDY_MAX_ORDER) // 1 MiB
+#define BUDDY_REGION_SIZE ((size_t)64 << 20) // Address space each arena reserves; must be a multiple of BUDDY_MAX_BLOCK
+
+// TLSF heap tuning
+#define TLSF_ALIGNMENT_LOG2 4
+#define TLSF_ALIGNMENT ((size_t)1 << TLSF_ALIGNMENT_LOG2) // Alignment of every block and of every size
+#define TLSF_SL_LOG2 5 // Second-level lists per power of two
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_ALIGNMENT_LOG2)
+#define TLSF_SMALL_BLOCK ((size_t)1 << TLSF_FL_SHIFT) // Below this, one first-level list in TLSF_ALIGNMENT steps
+#define TLSF_FL_MAX 40 // Blocks stay below 1 << TLSF_FL_MAX bytes
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+#define TLSF_REGION_SIZE ((size_t)64 << 20) // Address space mapped each time the heap grows
+#define TLSF_FREE ((size_t)1)
+#define TLSF_PREV_FREE ((size_t)2)
+#define TLSF_FLAGS (TLSF_FREE | TLSF_PREV_FREE)
+
+// Page return tuning
+#define DECAY_PAGES_PER_FREE 64 // Pages a heap free may return with decay_ms set, each block stepped over counting as one
+
+// Guarded sampling
+#define GUARD_MAX_POOLS 16 // Managers with guarded sampling enabled at once
+#define GUARD_TRACE_DEPTH 16 // Frames recorded for the allocation and the free of a guarded block
+#define GUARD_SLOT_UNUSED 0
+#define GUARD_SLOT_ALLOCATED 1
+#define GUARD_SLOT_FREED 2
+#define GUARD_SLOT_RESERVED 3 // Taken by an allocation still filling in the block
+#define GUARD_LINE_SIZE 256 // Longest fault report line
+
+// Stack allocator tuning
+#define STACK_ALIGNMENT 16 // Smallest alignment of a stack allocation, which also aligns its header
+#define STACK_DEBUG_POISON 0xdd // Byte written over released stack memory in debug mode
+
+// Per-CPU cache tuning
+#define PERCPU_CACHE_SLOTS 32 // Blocks each CPU may cache per pool
+
+struct MemPool;
+struct MemArena;
 
 // Custom memory block structure
 typedef struct MemBlock {
     size_t size;
+    size_t alignment; // Alignment ptr was allocated with; the pool's alignment for pool blocks
     void* ptr;
-    int ref_count; // Reference count for the block
-    struct MemBlock* next;
+    void* raw; // Pointer returned by malloc or mmap, before alignment (heap blocks only)
+    size_t map_size; // Length of the mapping for mmap-backed heap blocks, 0 for malloc'd ones
+    int fd; // memfd behind a shared mapping that copy_memory_cow can still share, -1 otherwise
+    atomic_int ref_count; // Reference count for the block
+    const void* site; // Allocation site, recorded only for sampled allocations
+    struct MemPool* pool; // Owning pool, or NULL for heap blocks
+    struct MemArena* arena; // Owning arena
+    size_t index; // Position in the manager's block table while in use (heap blocks only)
+    struct MemBlock* next; // Next free block in the owning pool or thread cache
 } MemBlock;
 
+// Every block is preceded by a pointer back to its MemBlock
+#define BLOCK_HEADER_SIZE sizeof(MemBlock*)
+
 // Memory pool structure
-typedef struct MemPool {
+struct MemPool {
     size_t block_size;
     size_t block_count;
+    size_t alignment;
+    size_t class_index; // Position in the arena's pool table and in thread and CPU caches
+    struct MemArena* arena; // Owning arena
+    void* slab; // Single allocation holding every block of the pool
+    MemBlock* blocks; // Metadata for every block, indexed like the slab
+    size_t slab_size; // Mapped length when the slab was placed on a NUMA node, 0 when it came from malloc
+    pthread_mutex_t lock; // Protects free_list and free_count
+    size_t free_count; // Length of free_list
     MemBlock* free_list;
-    struct MemPool* next;
-} MemPool;
+    MemBlock* _Atomic remote_frees; // Blocks freed on other NUMA nodes, spliced into free_list when it runs dry
+    int typed; // Typed object pool: left out of the size-ordered list, so only allocate_object uses it
+    ObjectHook reset; // Called on every object freed back to a typed pool
+    void* hook_context;
+    struct MemPool* _Atomic next; // Next larger pool
+};
+
+struct ThreadCache;
+
+// Free blocks cached by one CPU for one pool; the rseq sequences depend on this layout
+typedef struct {
+    size_t current; // Number of slots in use
+    MemBlock* slots[PERCPU_CACHE_SLOTS];
+} CpuCacheClass;
+
+// Per-CPU caches, one per possible CPU
+typedef struct {
+    pthread_mutex_t lock; // Only used when restartable sequences are unavailable
+    CpuCacheClass classes[MAX_SIZE_CLASSES];
+} CpuCache;
+
+// Links at the start of a free buddy block
+typedef struct BuddyFree {
+    struct BuddyFree* prev;
+    struct BuddyFree* next;
+} BuddyFree;
+
+// Buddy allocator over one contiguous region of address space
+typedef struct {
+    char* base; // Aligned to BUDDY_MAX_BLOCK
+    size_t carved; // Top blocks below this offset have been handed out or split at least once
+    BuddyFree* free_lists[BUDDY_ORDERS]; // By order, smallest first
+    uint64_t free_bits[BUDDY_ORDERS][(BUDDY_REGION_SIZE >> BUDDY_MIN_ORDER) / 64]; // Set for the first page of each free block, by order
+    uint8_t orders[BUDDY_REGION_SIZE >> BUDDY_MIN_ORDER]; // Order of each allocated block, indexed by its first page
+    size_t decay_offset; // Where a page return under way goes on, walking the region in address order
+} BuddyRegion;
+
+// Header of a TLSF block; the free-list links overlap the payload, which starts at next_free
+typedef struct TlsfBlock {
+    struct TlsfBlock* prev_phys; // Block just below this one, valid only while TLSF_PREV_FREE is set
+    size_t size; // Payload bytes, a multiple of TLSF_ALIGNMENT, with TLSF_FREE and TLSF_PREV_FREE in the low bits
+    struct TlsfBlock* next_free;
+    struct TlsfBlock* prev_free;
+} TlsfBlock;
+
+#define TLSF_HEADER_SIZE offsetof(TlsfBlock, next_free)
+#define TLSF_MIN_BLOCK (sizeof(TlsfBlock) - TLSF_HEADER_SIZE)
+
+// Start of a mapping added to a TLSF heap
+typedef struct TlsfRegion {
+    struct TlsfRegion* next;
+    size_t length;
+} TlsfRegion;
+
+#define TLSF_REGION_HEADER (((sizeof(TlsfRegion) + TLSF_ALIGNMENT - 1) / TLSF_ALIGNMENT) * TLSF_ALIGNMENT)
+
+// Two-level segregated fit heap: a bitmap of non-empty first-level ranges (powers of two), and for each
+// a bitmap of non-empty second-level lists, so a fitting list is found in constant time
+typedef struct {
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    TlsfBlock* free_lists[TLSF_FL_COUNT][1 << TLSF_SL_LOG2];
+    TlsfRegion* regions;
+    TlsfRegion* decay_region; // Region a page return under way is walking, NULL once every region is done
+    TlsfBlock* decay_block; // Block of decay_region the return goes on at, moved down when it merges into the one below
+    uintptr_t decay_address; // Pages below this address have already been returned
+} TlsfHeap;
+
+// Page holding one sampled allocation; the MemBlock comes first, so a block pointer is also a slot pointer
+typedef struct {
+    MemBlock block;
+    _Atomic int state; // GUARD_SLOT_UNUSED, GUARD_SLOT_RESERVED, GUARD_SLOT_ALLOCATED or GUARD_SLOT_FREED
+    pid_t alloc_thread;
+    pid_t free_thread;
+    int alloc_depth; // Frames in alloc_trace
+    int free_depth;
+    void* alloc_trace[GUARD_TRACE_DEPTH];
+    void* free_trace[GUARD_TRACE_DEPTH];
+} GuardSlot;
+
+// Slot pages separated by PROT_NONE guard pages: guard, slot 0, guard, slot 1, ..., guard
+typedef struct {
+    char* base;
+    size_t length;
+    size_t page_size;
+    size_t slot_count;
+    size_t next_slot; // Where the round-robin search for a free slot starts
+    pthread_mutex_t lock; // Protects slot states and next_slot
+    GuardSlot* slots;
+} GuardPool;
+
+// Independent set of pools and heap blocks; threads in different arenas never share free lists
+typedef struct MemArena {
+    size_t index; // Position in the manager's arena table
+    int dedicated; // Left out of round-robin thread assignment
+    int node; // NUMA node the arena's slabs are placed on, or -1 for no preference
+    pthread_mutex_t lock; // Protects the block table and pool creation
+    MemBlock** blocks; // Heap blocks in use, in allocation order except where removals swapped entries
+    size_t block_count;
+    size_t block_capacity;
+    MemPool* _Atomic pools; // Sorted by block size, smallest first
+    MemPool* pool_table[MAX_SIZE_CLASSES]; // Pools in creation order
+    size_t pool_count;
+    _Atomic size_t largest_pool; // Block size of the largest pool in the list, 0 while it is empty
+#ifdef AMM_STATIC_SIZE_CLASSES
+    _Atomic size_t custom_class_limit; // Largest user pool within the generated classes' range, 0 for none
+#endif
+    CpuCache* cpu_caches; // Per-CPU caches when the manager's cache_mode is CACHE_PER_CPU
+    pthread_mutex_t backend_lock; // Protects the buddy region or the TLSF heap
+    BuddyRegion* _Atomic buddy; // Reserved by the first medium-sized heap block, NULL before
+    TlsfHeap* _Atomic tlsf; // Holds every heap block below the mmap threshold with HEAP_BACKEND_TLSF
+    HugePagePolicy huge_pages; // Advice for the arena's slabs, regions and mapped blocks
+    size_t decay_ms; // Least time between returns of free backend pages to the system (0 = never on free)
+    atomic_uint_least64_t last_decay; // Monotonic milliseconds the last page return finished
+    atomic_int decaying; // A page return is under way, spread over the next heap frees
+} MemArena;
 
 // Memory manager structure
+struct MemoryManager {
+    MemArena* arenas[MAX_ARENAS]; // Arena 0 always exists
+    size_t arena_count;
+    size_t next_arena; // Round-robin position for threads without a binding
+    int numa_nodes; // Nodes with their own arena once enable_numa_arenas was called, 0 before
+    MemStats stats;
+    pthread_mutex_t lock;
+    pthread_key_t cache_key; // Calling thread's ThreadCache
+    struct ThreadCache* caches; // Every live thread cache
+    size_t cache_bytes_cap; // Upper bound on bytes held by all thread caches (0 = no caching)
+    atomic_size_t cached_bytes; // Bytes held by all thread caches, as last reported
+    size_t mmap_threshold; // Heap blocks from this size up are mmap-backed (0 = never)
+    int cow_blocks; // Mapped heap blocks come from a memfd each, so copy_memory_cow can share them
+    CacheMode cache_mode;
+    size_t cpu_count; // Per-CPU cache entries in every arena
+    int use_rseq; // Per-CPU caches run as restartable sequences rather than under a lock
+    int defer_decrements; // decrement_ref_count only logs the decrement in the thread cache
+    HeapBackend heap_backend; // Source of heap blocks below the mmap threshold, fixed at creation
+    HugePagePolicy huge_pages; // Copied into every arena
+    size_t decay_ms; // Copied into every arena
+    atomic_size_t global_epoch; // Advances once every thread in a critical section has seen it
+    MemBlock* orphans; // Retired blocks of exited threads, chained through next
+    size_t orphan_epoch; // Latest retirement epoch among the orphans
+    MemBlock* hazard_orphans; // Blocks retired through hazard_retire by exited threads, chained through next
+    int report_leaks_on_free; // Print a leak report from free_memory_manager
+    GuardPool* _Atomic guard; // Slots for guarded sampling once enabled, NULL before
+    size_t guard_sample_rate; // Guard one in N allocations (0 = never)
+    size_t leak_sample_rate; // Record the allocation site of one in N allocations (0 = never)
+};
+
+// Per-thread cache of free blocks for one pool
 typedef struct {
     MemBlock* head;
-    MemPool* pools;
-} MemoryManager;
-
-// Function prototypes
-MemoryManager* create_memory_manager();
-void* allocate_memory(MemoryManager* manager, size_t size, size_t alignment);
-void increment_ref_count(MemoryManager* manager, void* ptr);
-void decrement_ref_count(MemoryManager* manager, void* ptr);
-void deallocate_memory(MemoryManager* manager, void* ptr);
-void* reallocate_memory(MemoryManager* manager, void* ptr, size_t new_size, size_t alignment);
-void* copy_memory(MemoryManager* manager, void* src, size_t size);
-void free_memory_manager(MemoryManager* manager);
-void print_memory_blocks(MemoryManager* manager);
-void defragment_memory(MemoryManager* manager);
-void create_memory_pool(MemoryManager* manager, size_t block_size, size_t block_count, size_t alignment);
-void* allocate_from_pool(MemoryManager* manager, size_t size, size_t alignment);
-
-// Main function
-int main() {
-    MemoryManager* manager = create_memory_manager();
-
-    // Create memory pools with alignment
-    create_memory_pool(manager, 32, 10, 8); // Pool with 32-byte blocks, aligned to 8 bytes
-    create_memory_pool(manager, 64, 10, 16); // Pool with 64-byte blocks, aligned to 16 bytes
-
-    // Allocate memory
-    int* array = (int*)allocate_memory(manager, 10 * sizeof(int), sizeof(int));
-    for (int i = 0; i < 10; i++) {
-        array[i] = i + 1;
-    }
-
-    // Increment reference count
-    increment_ref_count(manager, array);
-
-    // Reallocate memory
-    array = (int*)reallocate_memory(manager, array, 20 * sizeof(int), sizeof(int));
-    for (int i = 10; i < 20; i++) {
-        array[i] = i + 1;
-    }
-
-    // Print reallocated array
-    printf("Reallocated array: ");
-    for (int i = 0; i < 20; i++) {
-        printf("%d ", array[i]);
-    }
-    printf("\n");
+    size_t count;
+    size_t limit; // Blocks this thread may cache, adapted to its miss rate
+    size_t requests; // Allocations since the limit was last adjusted
+    size_t misses; // Refills since the limit was last adjusted
+    size_t last_used; // Thread cache tick of the last allocation or free
+} ThreadCacheBin;
 
-    // Copy memory
-    int* copy = (int*)copy_memory(manager, array, 20 * sizeof(int));
+// Per-thread front end in front of the pools
+typedef struct ThreadCache {
+    MemoryManager* manager;
+    MemArena* arena; // Arena this thread allocates from; the bins belong to its pools
+    size_t tick; // Counts refills and flushes, drives the idle scan
+    size_t last_gc_tick;
+    size_t cached_bytes; // Bytes held in the bins
+    size_t reported_bytes; // Part of cached_bytes already added to manager->cached_bytes
+    size_t sample_countdown;
+    size_t guard_count; // Allocations since the last guarded one
+    MemStats stats; // Counts not yet merged into manager->stats; in-use counters wrap when negative
+    size_t deferred_count; // Entries in deferred
+    void* deferred[DEFERRED_LOG_SIZE]; // Pointers whose reference count still has to be decremented
+    atomic_size_t epoch; // Global epoch * 2 + 1 while inside an epoch critical section, 0 outside
+    size_t epoch_depth; // Nesting of epoch_enter calls
+    MemBlock* limbo[3]; // Retired blocks, chained through next, by retirement epoch modulo 3
+    size_t limbo_epoch[3]; // Epoch each limbo list was retired in
+    size_t retired_since_reclaim;
+    void* _Atomic hazards[HAZARD_SLOTS]; // Pointers this thread is reading and must not be freed
+    size_t hazard_retired_count; // Entries in hazard_retired
+    size_t hazard_next_scan; // hazard_retired_count that triggers the next scan
+    MemBlock* hazard_retired[HAZARD_RETIRED_MAX];
+    struct ThreadCache* next;
+    struct ThreadCache* prev;
+    ThreadCacheBin bins[MAX_SIZE_CLASSES];
+} ThreadCache;
 
-    // Print copied array
-    printf("Copied array: ");
-    for (int i = 0; i < 20; i++) {
-        printf("%d ", copy[i]);
-    }
-    printf("\n");
+// Internal function prototypes
+static MemBlock* allocate_in_pool(MemoryManager* manager, ThreadCache* cache, MemPool* pool, size_t size);
+static MemBlock* allocate_from_pools(MemoryManager* manager, MemArena* arena, ThreadCache* cache, size_t size, size_t alignment);
+static MemBlock* allocate_from_heap(MemoryManager* manager, MemArena* arena, ThreadCache* cache, size_t size, size_t alignment);
+static void deallocate_block(MemoryManager* manager, MemBlock* block);
+static void apply_deferred_decrements(ThreadCache* cache);
+static void orphan_retired_blocks(ThreadCache* cache);
+static void orphan_hazard_blocks(ThreadCache* cache);
+static void* allocate_guarded(MemoryManager* manager, ThreadCache* cache, size_t size, size_t alignment, const void* site);
+static GuardSlot* guarded_slot(MemoryManager* manager, MemBlock* block);
+static void free_guarded(MemoryManager* manager, GuardSlot* slot);
+static void free_guard_pool(MemoryManager* manager);
+static int add_arena(MemoryManager* manager, int dedicated, int node);
+static MemPool* add_pool(MemArena* arena, size_t block_size, size_t block_count, size_t alignment, const ObjectPoolConfig* objects);
+static void take_remote_frees_locked(MemPool* pool);
+static void destroy_thread_cache(void* arg);
+static MemBlock* take_cpu_block(MemoryManager* manager, MemPool* pool);
+static int init_cpu_caches(MemoryManager* manager, MemArena* arena);
+static void release_cpu_block(MemoryManager* manager, MemBlock* block);
+
+// Create memory manager
+MemoryManager* create_memory_manager() {
+    return create_memory_manager_ex(NULL);
+}
+
+// Create memory manager whose heap blocks come from the given backend
+MemoryManager* create_memory_manager_backend(HeapBackend backend) {
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.backend = backend;
+    return create_memory_manager_ex(&config);
+}
 
-    // Print memory blocks
-    print_memory_blocks(manager);
+// Fill a config with the settings create_memory_manager uses
+void init_memory_manager_config(MemoryManagerConfig* config) {
+    memset(config, 0, sizeof(MemoryManagerConfig));
+    config->backend = HEAP_BACKEND_BUDDY;
+    config->threads = THREAD_MODE_CACHED;
+    config->arenas = 1;
+    config->mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+    config->huge_pages = HUGE_PAGES_DEFAULT;
+    config->thread_cache_bytes = THREAD_CACHE_DEFAULT_CAP;
+    config->guard_slots = GUARD_DEFAULT_SLOTS;
+}
 
-    // Decrement reference count
-    decrement_ref_count(manager, array); // This will deallocate if ref_count drops to 0
-    decrement_ref_count(manager, array); // This should trigger deallocation
+// Parse a decimal size with an optional k, m or g suffix; returns 0 on success. A leading zero does
+// not make the number octal, so "010" is ten
+static int parse_config_size(const char* value, size_t* out) {
+    if (value[0] < '0' || value[0] > '9') {
+        return -1; // strtoull would also take a sign or leading spaces
+    }
+    char* end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0) {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || number > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *out = (size_t)number << shift;
+    return 0;
+}
 
-    // Deallocate copied memory
-    decrement_ref_count(manager, copy);
+// Find a name in a table of choices; returns its index, or -1
+static int parse_config_choice(const char* value, const char* const* names, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(value, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    // Print memory blocks after deallocation
-    print_memory_blocks(manager);
+// Parse pools as SIZExCOUNT or SIZExCOUNT@ALIGNMENT, separated by '/'; returns 0 on success
+static int parse_config_pools(MemoryManagerConfig* config, char* value) {
+    config->pool_count = 0;
+    for (char* pool = value; *pool != '\0';) {
+        char* next = strchr(pool, '/');
+        if (next != NULL) {
+            *next = '\0';
+        }
+        char* alignment = strchr(pool, '@');
+        if (alignment != NULL) {
+            *alignment++ = '\0';
+        }
+        if (config->pool_count == MAX_CONFIG_POOLS) {
+            return -1;
+        }
+        PoolConfig* entry = &config->pools[config->pool_count];
+        char* count = strchr(pool, 'x');
+        if (count != NULL) {
+            *count++ = '\0';
+        }
+        entry->alignment = 16;
+        if (count == NULL || parse_config_size(pool, &entry->block_size) != 0 ||
+            parse_config_size(count, &entry->block_count) != 0 || (alignment != NULL && parse_config_size(alignment, &entry->alignment) != 0) ||
+            entry->block_size == 0 || entry->block_count == 0 || entry->alignment == 0 ||
+            (entry->alignment & (entry->alignment - 1)) != 0) {
+            return -1;
+        }
+        config->pool_count++;
+        if (next == NULL) {
+            break;
+        }
+        pool = next + 1;
+    }
+    return 0;
+}
 
-    // Defragment memory
-    defragment_memory(manager);
+// Apply "key=value,key=value" options to a config, naming each applied one on stderr when
+// log_overrides is set; returns 0 when all of them were valid, -1 otherwise
+static int parse_config_options(MemoryManagerConfig* config, const char* options, int log_overrides) {
+    static const char* const backends[] = {"buddy", "tlsf", "malloc"};
+    static const char* const thread_modes[] = {"cached", "percpu", "locked"};
+    static const char* const huge_page_policies[] = {"default", "always", "never"};
+    int result = 0;
 
-    // Print memory blocks after defragmentation
-    print_memory_blocks(manager);
+    while (*options != '\0') {
+        const char* text = options;
+        size_t length = strcspn(options, ",");
+        char option[256];
+        if (length >= sizeof(option)) {
+            result = -1;
+            options += length + (options[length] == ',');
+            continue;
+        }
+        memcpy(option, options, length);
+        option[length] = '\0';
+        options += length + (options[length] == ',');
+        if (length == 0) {
+            continue;
+        }
 
-    // Free memory manager
-    free_memory_manager(manager);
+        char* value = strchr(option, '=');
+        if (value == NULL) {
+            result = -1;
+            continue;
+        }
+        *value++ = '\0';
+        size_t number;
+        int choice;
+        int valid = 1;
+        if (strcmp(option, "backend") == 0) {
+            valid = (choice = parse_config_choice(value, backends, 3)) >= 0;
+            if (valid) {
+                config->backend = (HeapBackend)choice;
+            }
+        } else if (strcmp(option, "threads") == 0) {
+            valid = (choice = parse_config_choice(value, thread_modes, 3)) >= 0;
+            if (valid) {
+                config->threads = (ThreadMode)choice;
+            }
+        } else if (strcmp(option, "huge_pages") == 0) {
+            valid = (choice = parse_config_choice(value, huge_page_policies, 3)) >= 0;
+            if (valid) {
+                config->huge_pages = (HugePagePolicy)choice;
+            }
+        } else if (strcmp(option, "pools") == 0) {
+            MemoryManagerConfig parsed = *config;
+            valid = parse_config_pools(&parsed, value) == 0;
+            if (valid) {
+                *config = parsed;
+            }
+        } else if (parse_config_size(value, &number) != 0) {
+            valid = 0;
+        } else if (strcmp(option, "arenas") == 0) {
+            valid = number >= 1 && number <= MAX_ARENAS;
+            config->arenas = valid ? number : config->arenas;
+        } else if (strcmp(option, "numa") == 0) {
+            config->numa = number != 0;
+        } else if (strcmp(option, "mmap_threshold") == 0) {
+            config->mmap_threshold = number;
+        } else if (strcmp(option, "cow_blocks") == 0) {
+            config->cow_blocks = number != 0;
+        } else if (strcmp(option, "thread_cache") == 0) {
+            config->thread_cache_bytes = number;
+        } else if (strcmp(option, "sample_rate") == 0) {
+            config->sample_rate = number;
+        } else if (strcmp(option, "report_leaks") == 0) {
+            config->report_leaks = number != 0;
+        } else if (strcmp(option, "defer_decrements") == 0) {
+            config->defer_decrements = number != 0;
+        } else if (strcmp(option, "decay_ms") == 0) {
+            config->decay_ms = number;
+        } else if (strcmp(option, "guard_sample_rate") == 0) {
+            config->guard_sample_rate = number;
+        } else if (strcmp(option, "guard_slots") == 0) {
+            valid = number != 0;
+            config->guard_slots = valid ? number : config->guard_slots;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            result = -1;
+        } else if (log_overrides) {
+            fprintf(stderr, "AMM_CONF: %.*s overrides the configured value\n", (int)length, text);
+        }
+    }
+    return result;
+}
 
-    return 0;
+// Apply "key=value,key=value" options to a config, the format of AMM_CONF. Valid options are
+// applied even when others are not; returns 0 when all of them were valid, -1 otherwise
+int parse_memory_manager_config(MemoryManagerConfig* config, const char* options) {
+    return parse_config_options(config, options, 0);
 }
 
-// Create memory manager
-MemoryManager* create_memory_manager() {
+// Create memory manager from a config (NULL for the defaults); options in the AMM_CONF
+// environment variable take precedence over the config, and each one applied is logged
+MemoryManager* create_memory_manager_ex(const MemoryManagerConfig* config) {
+    MemoryManagerConfig settings;
+    if (config != NULL) {
+        settings = *config;
+    } else {
+        init_memory_manager_config(&settings);
+    }
+    const char* options = getenv("AMM_CONF");
+    if (options != NULL && parse_config_options(&settings, options, 1) != 0) {
+        fprintf(stderr, "AMM_CONF: ignoring invalid options in \"%s\"\n", options);
+    }
+
     MemoryManager* manager = (MemoryManager*)malloc(sizeof(MemoryManager));
     if (manager == NULL) {
         perror("Failed to create memory manager");
         exit(EXIT_FAILURE);
     }
-    manager->head = NULL;
-    manager->pools = NULL;
-    return manager;
-}
+    manager->arena_count = 0;
+    manager->next_arena = 0;
+    manager->numa_nodes = 0;
+    memset(&manager->stats, 0, sizeof(MemStats));
+    pthread_mutex_init(&manager->lock, NULL);
+    if (pthread_key_create(&manager->cache_key, destroy_thread_cache) != 0) {
+        perror("Failed to create thread cache key");
+        exit(EXIT_FAILURE);
+    }
+    manager->caches = NULL;
+    manager->cache_bytes_cap = settings.threads == THREAD_MODE_LOCKED ? 0 : settings.thread_cache_bytes;
+    atomic_init(&manager->cached_bytes, 0);
+    manager->mmap_threshold = settings.mmap_threshold;
+    manager->cow_blocks = settings.cow_blocks;
+    manager->cache_mode = CACHE_PER_THREAD;
+    manager->cpu_count = 0;
+    manager->use_rseq = 0;
+    manager->defer_decrements = settings.defer_decrements;
+    manager->heap_backend = settings.backend;
+    manager->huge_pages = settings.huge_pages;
+    manager->decay_ms = settings.decay_ms;
+    atomic_init(&manager->global_epoch, 1);
+    manager->orphans = NULL;
+    manager->orphan_epoch = 0;
+    manager->hazard_orphans = NULL;
+    manager->report_leaks_on_free = settings.report_leaks;
+    manager->leak_sample_rate = settings.sample_rate;
+    atomic_init(&manager->guard, NULL);
+    manager->guard_sample_rate = 0;
+    add_arena(manager, 0, -1);
 
-// Allocate memory
-void* allocate_memory(MemoryManager* manager, size_t size, size_t alignment) {
-    void* ptr = allocate_from_pool(manager, size, alignment);
-    if (ptr != NULL) {
-        return ptr;
+    // Arenas first, so that the pools and per-CPU caches reach all of them
+    if (settings.numa) {
+        enable_numa_arenas(manager);
+    } else {
+        for (size_t i = 1; i < settings.arenas; i++) {
+            add_arena(manager, 0, -1);
+        }
     }
-    
-    MemBlock* block = (MemBlock*)malloc(sizeof(MemBlock));
-    if (block == NULL) {
-        return NULL; // Allocation failed
+    if (settings.threads == THREAD_MODE_PER_CPU && set_cache_mode(manager, CACHE_PER_CPU) != 0) {
+        perror("Failed to create per-CPU caches");
+        exit(EXIT_FAILURE);
     }
-
-    // Allocate memory with alignment
-    void* raw_ptr = malloc(size + alignment - 1);
-    if (raw_ptr == NULL) {
-        free(block);
-        return NULL; // Allocation failed
+    for (size_t i = 0; i < settings.pool_count && i < MAX_CONFIG_POOLS; i++) {
+        const PoolConfig* pool = &settings.pools[i];
+        create_memory_pool(manager, pool->block_size, pool->block_count, pool->alignment);
+    }
+    if (settings.guard_sample_rate != 0 && enable_guarded_sampling(manager, settings.guard_sample_rate, settings.guard_slots) != 0) {
+        perror("Failed to enable guarded sampling");
+        exit(EXIT_FAILURE);
     }
+    return manager;
+}
 
-    uintptr_t aligned_ptr = (uintptr_t)raw_ptr;
-    aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1); // Align the pointer
+// Read the monotonic clock in milliseconds
+static uint_least64_t monotonic_milliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint_least64_t)now.tv_sec * 1000 + (uint_least64_t)now.tv_nsec / 1000000;
+}
 
-    block->size = size;
-    block->ptr = (void*)aligned_ptr;
-    block->ref_count = 1; // Initial reference count is 1
-    block->next = manager->head;
-    manager->head = block;
-    return block->ptr;
+// Add an arena whose slabs prefer the given NUMA node (-1 for none)
+static int add_arena(MemoryManager* manager, int dedicated, int node) {
+    MemArena* arena = (MemArena*)malloc(sizeof(MemArena));
+    if (arena == NULL) {
+        perror("Failed to create arena");
+        exit(EXIT_FAILURE);
+    }
+    arena->dedicated = dedicated;
+    arena->node = node;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->blocks = NULL;
+    arena->block_count = 0;
+    arena->block_capacity = 0;
+    atomic_init(&arena->pools, NULL);
+    arena->pool_count = 0;
+    atomic_init(&arena->largest_pool, 0);
+#ifdef AMM_STATIC_SIZE_CLASSES
+    atomic_init(&arena->custom_class_limit, 0);
+#endif
+    arena->cpu_caches = NULL;
+    pthread_mutex_init(&arena->backend_lock, NULL);
+    atomic_init(&arena->buddy, NULL);
+    atomic_init(&arena->tlsf, NULL);
+    arena->huge_pages = manager->huge_pages;
+    arena->decay_ms = manager->decay_ms;
+    atomic_init(&arena->last_decay, monotonic_milliseconds());
+    atomic_init(&arena->decaying, 0);
+
+    pthread_mutex_lock(&manager->lock);
+    if (manager->arena_count == MAX_ARENAS ||
+        (manager->cache_mode == CACHE_PER_CPU && init_cpu_caches(manager, arena) != 0)) {
+        pthread_mutex_unlock(&manager->lock);
+        pthread_mutex_destroy(&arena->lock);
+        pthread_mutex_destroy(&arena->backend_lock);
+        free(arena);
+        return -1;
+    }
+#ifdef AMM_STATIC_SIZE_CLASSES
+    // The generated classes are the arena's first pools, so a class number is also a pool table index
+    for (size_t i = 0; i < AMM_STATIC_CLASS_COUNT; i++) {
+        add_pool(arena, amm_class_size[i], amm_class_blocks[i], AMM_STATIC_CLASS_ALIGNMENT, NULL);
+    }
+#endif
+    arena->index = manager->arena_count;
+    manager->arenas[manager->arena_count++] = arena;
+    pthread_mutex_unlock(&manager->lock);
+    return (int)arena->index;
 }
 
-// Allocate memory from pool with alignment
-void* allocate_from_pool(MemoryManager* manager, size_t size, size_t alignment) {
-    MemPool* pool = manager->pools;
+// Create an arena; dedicated arenas are only used by bound threads and allocate_in_arena
+int create_arena(MemoryManager* manager, int dedicated) {
+    return add_arena(manager, dedicated, -1);
+}
 
-    while (pool != NULL) {
-        if (pool->block_size >= size && pool->free_list != NULL) {
-            MemBlock* block = pool->free_list;
-            pool->free_list = block->next;
+// Create a shared arena whose pool slabs are placed on a NUMA node
+int create_node_arena(MemoryManager* manager, int node) {
+    if (node < 0 || node >= NUMA_MAX_NODES) {
+        return -1;
+    }
+    return add_arena(manager, 0, node);
+}
 
-            // Align the pointer
-            uintptr_t aligned_ptr = (uintptr_t)block->ptr;
-            aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1);
-            block->ptr = (void*)aligned_ptr;
+// Count the NUMA nodes the kernel has online, 1 when it does not say
+static int count_numa_nodes(void) {
+    FILE* file = fopen("/sys/devices/system/node/online", "r");
+    if (file == NULL) {
+        return 1;
+    }
 
-            block->next = manager->head;
-            manager->head = block;
-            block->ref_count = 1; // Initial reference count is 1
-            return block->ptr;
+    // The list looks like "0" or "0-1,3"; the highest node number bounds the count
+    int nodes = 1;
+    int first, last;
+    char separator;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            fscanf(file, "%c", &separator);
+        }
+        if (last + 1 > nodes) {
+            nodes = last + 1;
         }
-        pool = pool->next;
     }
+    fclose(file);
+    return nodes < NUMA_MAX_NODES ? nodes : NUMA_MAX_NODES;
+}
 
-    return NULL;
+// Get the NUMA node of the CPU the calling thread runs on
+static int current_numa_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return (int)node;
 }
 
-// Create memory pool
-void create_memory_pool(MemoryManager* manager, size_t block_size, size_t block_count, size_t alignment) {
-    MemPool* pool = (MemPool*)malloc(sizeof(MemPool));
-    if (pool == NULL) {
-        perror("Failed to create memory pool");
-        exit(EXIT_FAILURE);
+// Give every NUMA node its own arena and route threads to their node's arena; call before creating pools
+int enable_numa_arenas(MemoryManager* manager) {
+    int nodes = count_numa_nodes();
+    manager->arenas[0]->node = 0;
+    for (int node = 1; node < nodes; node++) {
+        if (create_node_arena(manager, node) < 0) {
+            nodes = node;
+            break;
+        }
     }
 
-    pool->block_size = block_size;
-    pool->block_count = block_count;
-    pool->free_list = NULL;
-    pool->next = manager->pools;
-    manager->pools = pool;
+    pthread_mutex_lock(&manager->lock);
+    manager->numa_nodes = nodes;
+    pthread_mutex_unlock(&manager->lock);
+    return nodes;
+}
 
-    for (size_t i = 0; i < block_count; i++) {
-        MemBlock* block = (MemBlock*)malloc(sizeof(MemBlock));
-        if (block == NULL) {
-            perror("Failed to create memory block");
-            exit(EXIT_FAILURE);
+// Pick the arena for a thread that has not been bound to one
+static MemArena* assign_arena_locked(MemoryManager* manager) {
+    // Prefer the arena of the node the thread starts on
+    if (manager->numa_nodes > 0) {
+        int node = current_numa_node();
+        for (size_t i = 0; i < manager->arena_count; i++) {
+            MemArena* arena = manager->arenas[i];
+            if (!arena->dedicated && arena->node == node) {
+                return arena;
+            }
         }
+    }
 
-        // Allocate memory with alignment
-        void* raw_ptr = malloc(block_size + alignment - 1);
-        if (raw_ptr == NULL) {
-            free(block);
-            perror("Failed to allocate memory block");
-            exit(EXIT_FAILURE);
+    for (size_t tries = 0; tries < manager->arena_count; tries++) {
+        MemArena* arena = manager->arenas[manager->next_arena++ % manager->arena_count];
+        if (!arena->dedicated) {
+            return arena;
         }
+    }
+    return manager->arenas[0];
+}
 
-        uintptr_t aligned_ptr = (uintptr_t)raw_ptr;
-        aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1); // Align the pointer
-
-        block->size = block_size;
-        block->ptr = (void*)aligned_ptr;
-        block->ref_count = 0; // Initial reference count is 0
-        block->next = pool->free_list;
-        pool->free_list = block;
+// Find the block that starts at ptr through the header in front of it
+static MemBlock* find_block(void* ptr) {
+    if (ptr == NULL) {
+        return NULL;
     }
+    MemBlock* block = ((MemBlock**)ptr)[-1];
+    return block != NULL && block->ptr == ptr ? block : NULL;
 }
 
-// Increment reference count
-void increment_ref_count(MemoryManager* manager, void* ptr) {
-    MemBlock* current = manager->head;
+// Add counters from one set of statistics to another
+static void merge_stats(MemStats* into, MemStats* from) {
+    into->allocations += from->allocations;
+    into->deallocations += from->deallocations;
+    into->pool_hits += from->pool_hits;
+    into->pool_misses += from->pool_misses;
+    into->blocks_in_use += from->blocks_in_use;
+    into->bytes_in_use += from->bytes_in_use;
+    if (into->bytes_in_use > into->peak_bytes_in_use) {
+        into->peak_bytes_in_use = into->bytes_in_use;
+    }
+}
 
-    while (current != NULL) {
-        if (current->ptr == ptr) {
-            current->ref_count++;
-            return;
+// Count an allocation in the thread's statistics, or in the manager's when the thread has no cache
+static void count_allocation(MemoryManager* manager, ThreadCache* cache, size_t size, int pooled) {
+    MemStats* stats = cache != NULL ? &cache->stats : &manager->stats;
+    if (cache == NULL) {
+        pthread_mutex_lock(&manager->lock);
+    }
+    stats->allocations++;
+    if (pooled) {
+        stats->pool_hits++;
+    } else {
+        stats->pool_misses++;
+    }
+    stats->blocks_in_use++;
+    stats->bytes_in_use += size;
+    if (cache == NULL) {
+        if (stats->bytes_in_use > stats->peak_bytes_in_use) {
+            stats->peak_bytes_in_use = stats->bytes_in_use;
         }
-        current = current->next;
+        pthread_mutex_unlock(&manager->lock);
     }
 }
 
-// Decrement reference count
-void decrement_ref_count(MemoryManager* manager, void* ptr) {
-    MemBlock* current = manager->head;
-    MemBlock* prev = NULL;
-
-    while (current != NULL) {
-        if (current->ptr == ptr) {
-            current->ref_count--;
-            if (current->ref_count == 0) {
-                if (prev != NULL) {
-                    prev->next = current->next;
-                } else {
-                    manager->head = current->next;
-                }
-                deallocate_memory(manager, current->ptr);
-                free(current);
-            }
-            return;
+// Count a deallocation the same way
+static void count_deallocation(MemoryManager* manager, ThreadCache* cache, size_t size) {
+    MemStats* stats = cache != NULL ? &cache->stats : &manager->stats;
+    if (cache == NULL) {
+        pthread_mutex_lock(&manager->lock);
+    }
+    stats->deallocations++;
+    stats->blocks_in_use--;
+    stats->bytes_in_use -= size;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&manager->lock);
+    }
+}
+
+// Add a heap block to its arena's table of blocks in use
+static int register_block_locked(MemArena* arena, MemBlock* block) {
+    if (arena->block_count == arena->block_capacity) {
+        size_t new_capacity = arena->block_capacity == 0 ? 64 : arena->block_capacity * 2;
+        MemBlock** new_blocks = (MemBlock**)realloc(arena->blocks, new_capacity * sizeof(MemBlock*));
+        if (new_blocks == NULL) {
+            return -1;
         }
-        prev = current;
-        current = current->next;
+        arena->blocks = new_blocks;
+        arena->block_capacity = new_capacity;
     }
+
+    block->index = arena->block_count;
+    arena->blocks[arena->block_count++] = block;
+    return 0;
 }
 
-// Deallocate memory
-void deallocate_memory(MemoryManager* manager, void* ptr) {
-    MemBlock* current = manager->head;
-    MemPool* pool = manager->pools;
+// Remove a heap block from the table by moving the last entry into its slot
+static void unregister_block_locked(MemArena* arena, MemBlock* block) {
+    MemBlock* last = arena->blocks[--arena->block_count];
+    arena->blocks[block->index] = last;
+    last->index = block->index;
+}
 
-    while (current != NULL) {
-        if (current->ptr == ptr) {
-            while (pool != NULL) {
-                if (pool->block_size >= current->size) {
-                    current->next = pool->free_list;
-                    pool->free_list = current;
-                    return;
-                }
-                pool = pool->next;
-            }
+// Get the calling thread's cache, creating it on first use
+static ThreadCache* get_thread_cache(MemoryManager* manager) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache != NULL) {
+        return cache;
+    }
 
-            free(current->ptr);
-            return;
-        }
-        current = current->next;
+    cache = (ThreadCache*)calloc(1, sizeof(ThreadCache));
+    if (cache == NULL) {
+        return NULL; // Callers fall back to the pools directly
+    }
+    cache->manager = manager;
+    for (size_t i = 0; i < MAX_SIZE_CLASSES; i++) {
+        cache->bins[i].limit = THREAD_CACHE_INITIAL_LIMIT;
     }
+#ifdef AMM_STATIC_SIZE_CLASSES
+    // Refills take half the limit, so start from twice the generated batch
+    for (size_t i = 0; i < AMM_STATIC_CLASS_COUNT; i++) {
+        cache->bins[i].limit = 2 * (size_t)amm_class_batch[i];
+    }
+#endif
+    cache->hazard_next_scan = HAZARD_SCAN_THRESHOLD;
+
+    pthread_mutex_lock(&manager->lock);
+    cache->arena = assign_arena_locked(manager);
+    cache->next = manager->caches;
+    if (manager->caches != NULL) {
+        manager->caches->prev = cache;
+    }
+    manager->caches = cache;
+    pthread_mutex_unlock(&manager->lock);
+
+    pthread_setspecific(manager->cache_key, cache);
+    return cache;
 }
 
-// Reallocate memory
-void* reallocate_memory(MemoryManager* manager, void* ptr, size_t new_size, size_t alignment) {
-    MemBlock* current = manager->head;
+// Publish this thread's cached byte count to the global total
+static size_t sync_cached_bytes(ThreadCache* cache) {
+    MemoryManager* manager = cache->manager;
+    size_t total;
+    if (cache->cached_bytes >= cache->reported_bytes) {
+        total = atomic_fetch_add_explicit(&manager->cached_bytes, cache->cached_bytes - cache->reported_bytes, memory_order_relaxed);
+        total += cache->cached_bytes - cache->reported_bytes;
+    } else {
+        total = atomic_fetch_sub_explicit(&manager->cached_bytes, cache->reported_bytes - cache->cached_bytes, memory_order_relaxed);
+        total -= cache->reported_bytes - cache->cached_bytes;
+    }
+    cache->reported_bytes = cache->cached_bytes;
+    return total;
+}
 
-    while (current != NULL) {
-        if (current->ptr == ptr) {
-            void* new_ptr = realloc(current->ptr, new_size + alignment - 1);
-            if (new_ptr == NULL) {
-                return NULL; // realloc failed
-            }
+// Bytes held by all thread caches, counting this thread's change not yet published
+static size_t cached_bytes_total(ThreadCache* cache) {
+    size_t total = atomic_load_explicit(&cache->manager->cached_bytes, memory_order_relaxed);
+    return total + cache->cached_bytes - cache->reported_bytes; // Wraps back into range when this thread gave bytes back
+}
 
-            uintptr_t aligned_ptr = (uintptr_t)new_ptr;
-            aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1); // Align the pointer
+// Return cached blocks to their pool until at most keep remain
+static void flush_cache_bin(ThreadCache* cache, MemPool* pool, ThreadCacheBin* bin, size_t keep) {
+    if (bin->count <= keep) {
+        return;
+    }
 
-            current->ptr = (void*)aligned_ptr;
-            current->size = new_size;
-            return current->ptr;
-        }
-        current = current->next;
+    MemBlock* first = bin->head;
+    MemBlock* last = first;
+    size_t released = bin->count - keep;
+    for (size_t i = 1; i < released; i++) {
+        last = last->next;
     }
+    bin->head = last->next;
+    bin->count = keep;
+    cache->cached_bytes -= released * pool->block_size;
 
-    return NULL; // ptr not found
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->free_list;
+    pool->free_list = first;
+    pool->free_count += released;
+    pthread_mutex_unlock(&pool->lock);
 }
 
-// Copy memory
-void* copy_memory(MemoryManager* manager, void* src, size_t size) {
-    void* dest = allocate_memory(manager, size, sizeof(char)); // Align to char (byte) alignment
-    if (dest == NULL) {
-        return NULL; // Allocation failed
+// Merge this thread's statistics into the manager
+static void merge_thread_stats(ThreadCache* cache) {
+    MemoryManager* manager = cache->manager;
+    pthread_mutex_lock(&manager->lock);
+    merge_stats(&manager->stats, &cache->stats);
+    pthread_mutex_unlock(&manager->lock);
+    memset(&cache->stats, 0, sizeof(MemStats));
+}
+
+// Count a refill or flush; every few, shrink and empty bins that went unused since the last scan
+static void tick_thread_cache(ThreadCache* cache) {
+    MemArena* arena = cache->arena;
+    cache->tick++;
+    if (cache->tick - cache->last_gc_tick < THREAD_CACHE_GC_INTERVAL) {
+        return;
     }
 
-    memcpy(dest, src, size);
-    return dest;
+    for (size_t i = 0; i < arena->pool_count; i++) {
+        ThreadCacheBin* bin = &cache->bins[i];
+        if (bin->count > 0 && bin->last_used < cache->last_gc_tick) {
+            if (bin->limit / 2 >= THREAD_CACHE_MIN_LIMIT) {
+                bin->limit /= 2;
+            }
+            flush_cache_bin(cache, arena->pool_table[i], bin, 0);
+        }
+    }
+    cache->last_gc_tick = cache->tick;
+    merge_thread_stats(cache);
 }
 
-// Free memory manager
-void free_memory_manager(MemoryManager* manager) {
-    MemBlock* current = manager->head;
+// Refill an empty bin from its pool and return one block for the caller
+static MemBlock* refill_cache_bin(ThreadCache* cache, MemPool* pool, ThreadCacheBin* bin) {
+    MemoryManager* manager = cache->manager;
+    size_t total = sync_cached_bytes(cache);
 
-    while (current != NULL) {
-        MemBlock* next = current->next;
-        free(current->ptr);
-        free(current);
-        current = next;
+    // Grow the limit for classes this thread allocates from faster than the cache can hold
+    bin->misses++;
+    if (bin->requests >= THREAD_CACHE_ADAPT_WINDOW) {
+        if (bin->misses * THREAD_CACHE_GROW_MISS_RATIO > bin->requests &&
+            bin->limit < THREAD_CACHE_MAX_LIMIT && total < manager->cache_bytes_cap / 2) {
+            bin->limit *= 2;
+        }
+        bin->requests = 0;
+        bin->misses = 0;
     }
 
-    MemPool* pool = manager->pools;
-    while (pool != NULL) {
-        MemPool* next_pool = pool->next;
-        MemBlock* block = pool->free_list;
-        while (block != NULL) {
-            MemBlock* next_block = block->next;
-            free(block->ptr);
-            free(block);
-            block = next_block;
+    // Take half the limit, bounded by what the global cap leaves room for
+    size_t batch = bin->limit / 2;
+    size_t room = total < manager->cache_bytes_cap ? (manager->cache_bytes_cap - total) / pool->block_size : 0;
+    if (batch > room) {
+        batch = room;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list == NULL) {
+        take_remote_frees_locked(pool);
+    }
+    MemBlock* block = pool->free_list;
+    if (block != NULL) {
+        pool->free_list = block->next;
+        pool->free_count--;
+        while (batch > 0 && pool->free_list != NULL) {
+            MemBlock* cached = pool->free_list;
+            pool->free_list = cached->next;
+            pool->free_count--;
+            cached->next = bin->head;
+            bin->head = cached;
+            bin->count++;
+            cache->cached_bytes += pool->block_size;
+            batch--;
         }
-        free(pool);
-        pool = next_pool;
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    free(manager);
+    tick_thread_cache(cache);
+    return block;
 }
 
-// Print memory blocks
-void print_memory_blocks(MemoryManager* manager) {
-    MemBlock* current = manager->head;
-
-    printf("Current Memory Blocks:\n");
-    if (current == NULL) {
-        printf("No memory blocks in use.\n");
-    } else {
-        while (current != NULL) {
-            printf("Block at %p, size: %zu bytes, ref_count: %d\n", current->ptr, current->size, current->ref_count);
-            current = current->next;
+// Take a free block from a pool, through the thread or CPU cache when there is one
+static MemBlock* take_pool_block(MemoryManager* manager, ThreadCache* cache, MemPool* pool) {
+    if (pool->arena->cpu_caches != NULL) {
+        return take_cpu_block(manager, pool);
+    }
+    // Without caching (THREAD_MODE_LOCKED or a cap of 0) the pool lock is taken once the bin is empty,
+    // which it stays, as frees then skip it too
+    if (cache == NULL || cache->arena != pool->arena ||
+        (manager->cache_bytes_cap == 0 && cache->bins[pool->class_index].head == NULL)) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_list == NULL) {
+            take_remote_frees_locked(pool);
         }
+        MemBlock* block = pool->free_list;
+        if (block != NULL) {
+            pool->free_list = block->next;
+            pool->free_count--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return block;
     }
 
-    if (manager->pools == NULL) {
-        printf("No memory pools created.\n");
-    } else {
-        MemPool* pool = manager->pools;
-        printf("\nMemory Pools:\n");
-        while (pool != NULL) {
-            printf("Pool with block size: %zu bytes, block count: %zu\n", pool->block_size, pool->block_count);
-            pool = pool->next;
-        }
+    ThreadCacheBin* bin = &cache->bins[pool->class_index];
+    bin->requests++;
+    bin->last_used = cache->tick;
+    MemBlock* block = bin->head;
+    if (block == NULL) {
+        return refill_cache_bin(cache, pool, bin);
     }
+    bin->head = block->next;
+    bin->count--;
+    cache->cached_bytes -= pool->block_size;
+    return block;
+}
 
-    printf("\n");
+// Queue a chain of blocks freed on another NUMA node without touching the pool lock
+static void push_remote_frees(MemPool* pool, MemBlock* first, MemBlock* last) {
+    MemBlock* head = atomic_load_explicit(&pool->remote_frees, memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->remote_frees, &head, first,
+                                                    memory_order_release, memory_order_relaxed));
 }
 
-// Defragment memory
-void defragment_memory(MemoryManager* manager) {
-    MemBlock* current = manager->head;
+// Check whether a thread frees into a pool on another NUMA node
+static int frees_remotely(ThreadCache* cache, MemPool* pool) {
+    return pool->arena->node >= 0 && cache != NULL && cache->arena->node != pool->arena->node;
+}
 
-    while (current != NULL && current->next != NULL) {
-        MemBlock* next = current->next;
+// Move blocks queued by other NUMA nodes onto the free list
+static void take_remote_frees_locked(MemPool* pool) {
+    MemBlock* block = atomic_exchange_explicit(&pool->remote_frees, NULL, memory_order_acquire);
+    while (block != NULL) {
+        MemBlock* next = block->next;
+        block->next = pool->free_list;
+        pool->free_list = block;
+        pool->free_count++;
+        block = next;
+    }
+}
 
-        // Check if the current block can be merged with the next one
-        if ((char*)current->ptr + current->size == next->ptr && next->ref_count == 0) {
-            void* new_ptr = realloc(current->ptr, current->size + next->size);
-            if (new_ptr == NULL) {
-                printf("Defragmentation failed\n");
-                return;
-            }
+// Give a free block back to its pool, through the thread or CPU cache when there is one
+static void release_pool_block(MemoryManager* manager, MemBlock* block) {
+    MemPool* pool = block->pool;
+    ThreadCache* cache = get_thread_cache(manager);
 
-            current->ptr = new_ptr;
-            current->size += next->size;
-            current->next = next->next;
-            free(next);
-        } else {
-            current = current->next;
-        }
+    // Frees from another node queue up for the home node instead of bouncing the pool lock across sockets
+    if (frees_remotely(cache, pool)) {
+        push_remote_frees(pool, block, block);
+        return;
+    }
+
+    if (pool->arena->cpu_caches != NULL) {
+        release_cpu_block(manager, block);
+        return;
+    }
+
+    // Blocks from another arena go straight back, so this thread's bins only hold its own arena's blocks.
+    // So does a block that would take the caches past the global cap, and with a cap of 0 nothing is cached.
+    if (cache == NULL || cache->arena != pool->arena || cached_bytes_total(cache) + pool->block_size > manager->cache_bytes_cap) {
+        pthread_mutex_lock(&pool->lock);
+        block->next = pool->free_list;
+        pool->free_list = block;
+        pool->free_count++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
     }
+
+    ThreadCacheBin* bin = &cache->bins[pool->class_index];
+    bin->last_used = cache->tick;
+    block->next = bin->head;
+    bin->head = block;
+    bin->count++;
+    cache->cached_bytes += pool->block_size;
+    // Publish growth in batches, so the cap checks of other threads see most of this thread's bytes
+    if (cache->cached_bytes > cache->reported_bytes + THREAD_CACHE_SYNC_BYTES) {
+        sync_cached_bytes(cache);
+    }
+
+    // Keep half the limit after an overflow, and nothing when other threads' bins or a lowered cap leave no room
+    if (bin->count > bin->limit) {
+        flush_cache_bin(cache, pool, bin, bin->limit / 2);
+        if (sync_cached_bytes(cache) > manager->cache_bytes_cap) {
+            flush_cache_bin(cache, pool, bin, 0);
+            sync_cached_bytes(cache);
+        }
+        tick_thread_cache(cache);
+    }
+}
+
+// Return every block cached by a thread to the pools
+static void drain_thread_cache(ThreadCache* cache) {
+    MemArena* arena = cache->arena;
+    for (size_t i = 0; i < arena->pool_count; i++) {
+        flush_cache_bin(cache, arena->pool_table[i], &cache->bins[i], 0);
+    }
+    sync_cached_bytes(cache);
+    merge_thread_stats(cache);
+}
+
+// Release a thread's cache when the thread exits
+static void destroy_thread_cache(void* arg) {
+    ThreadCache* cache = (ThreadCache*)arg;
+    MemoryManager* manager = cache->manager;
+
+    // Frees reach this cache again through get_thread_cache, so make it current while applying the log
+    if (cache->deferred_count > 0) {
+        pthread_setspecific(manager->cache_key, cache);
+        apply_deferred_decrements(cache);
+        pthread_setspecific(manager->cache_key, NULL);
+    }
+    orphan_retired_blocks(cache);
+    orphan_hazard_blocks(cache);
+    drain_thread_cache(cache);
+
+    pthread_mutex_lock(&manager->lock);
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        manager->caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&manager->lock);
+    free(cache);
+}
+
+// Return the calling thread's cached blocks to the pools
+void flush_thread_cache(MemoryManager* manager) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache != NULL) {
+        drain_thread_cache(cache);
+    }
+}
+
+// Limit the bytes all thread caches may hold together (0 disables caching)
+void set_thread_cache_cap(MemoryManager* manager, size_t max_cached_bytes) {
+    pthread_mutex_lock(&manager->lock);
+    manager->cache_bytes_cap = max_cached_bytes;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Pin the calling thread to an arena, returning its cached blocks to the old one
+void bind_thread_to_arena(MemoryManager* manager, int arena) {
+    if (arena < 0 || (size_t)arena >= manager->arena_count) {
+        return;
+    }
+    ThreadCache* cache = get_thread_cache(manager);
+    if (cache == NULL || cache->arena == manager->arenas[arena]) {
+        return;
+    }
+    drain_thread_cache(cache);
+    cache->arena = manager->arenas[arena];
+}
+
+// Get the arena the calling thread allocates from
+int thread_arena(MemoryManager* manager) {
+    ThreadCache* cache = get_thread_cache(manager);
+    return cache != NULL ? (int)cache->arena->index : 0;
+}
+
+#if HAVE_RSEQ
+#define RSEQ_STRINGIFY(x) #x
+#define RSEQ_SIG_STRING(x) RSEQ_STRINGIFY(x)
+
+// The calling thread's rseq area, registered by glibc
+static struct rseq* current_rseq(void) {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Pop from the current CPU's slots as a restartable sequence; returns 0, 1 when empty, -1 when aborted
+static int rseq_pop_block(char* class_base, size_t cpu_stride, MemBlock** out) {
+    struct rseq* rs = current_rseq();
+    __asm__ __volatile__ goto (
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "imulq %[cpu_stride], %%rax\n\t"
+        "addq %[class_base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rax, %%rcx, 8), %%rdx\n\t" // slots[current - 1]
+        "movq %%rdx, (%[out])\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t" // Commit
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " RSEQ_SIG_STRING(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        : [rseq_cs] "+m" (rs->rseq_cs)
+        : [cpu_id] "m" (rs->cpu_id), [cpu_stride] "r" (cpu_stride), [class_base] "r" (class_base), [out] "r" (out)
+        : "rax", "rcx", "rdx", "memory", "cc"
+        : empty, aborted);
+    return 0;
+empty:
+    return 1;
+aborted:
+    return -1;
+}
+
+// Push onto the current CPU's slots as a restartable sequence; returns 0, 1 when full, -1 when aborted
+static int rseq_push_block(char* class_base, size_t cpu_stride, MemBlock* block) {
+    struct rseq* rs = current_rseq();
+    __asm__ __volatile__ goto (
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "imulq %[cpu_stride], %%rax\n\t"
+        "addq %[class_base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[limit], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[block], 8(%%rax, %%rcx, 8)\n\t" // slots[current]
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t" // Commit
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " RSEQ_SIG_STRING(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        : [rseq_cs] "+m" (rs->rseq_cs)
+        : [cpu_id] "m" (rs->cpu_id), [cpu_stride] "r" (cpu_stride), [class_base] "r" (class_base),
+          [block] "r" (block), [limit] "r" ((size_t)PERCPU_CACHE_SLOTS)
+        : "rax", "rcx", "memory", "cc"
+        : full, aborted);
+    return 0;
+full:
+    return 1;
+aborted:
+    return -1;
+}
+#endif
+
+// The calling thread's CPU, for the locked fallback
+static CpuCache* current_cpu_cache(MemoryManager* manager, CpuCache* cpu_caches) {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= manager->cpu_count) {
+        cpu = 0;
+    }
+    return &cpu_caches[cpu];
+}
+
+// Pop a block cached by the current CPU, or return NULL when it has none
+static MemBlock* pop_cpu_block(MemoryManager* manager, CpuCache* cpu_caches, size_t class_index) {
+#if HAVE_RSEQ
+    if (manager->use_rseq) {
+        char* class_base = (char*)&cpu_caches[0].classes[class_index];
+        MemBlock* block;
+        int result;
+        while ((result = rseq_pop_block(class_base, sizeof(CpuCache), &block)) < 0) {
+            // Preempted or migrated; retry on whichever CPU we are on now
+        }
+        return result == 0 ? block : NULL;
+    }
+#endif
+    CpuCache* cpu = current_cpu_cache(manager, cpu_caches);
+    CpuCacheClass* slots = &cpu->classes[class_index];
+    MemBlock* block = NULL;
+    pthread_mutex_lock(&cpu->lock);
+    if (slots->current > 0) {
+        block = slots->slots[--slots->current];
+    }
+    pthread_mutex_unlock(&cpu->lock);
+    return block;
+}
+
+// Cache a block on the current CPU; returns 0, or -1 when that CPU's slots are full
+static int push_cpu_block(MemoryManager* manager, CpuCache* cpu_caches, size_t class_index, MemBlock* block) {
+#if HAVE_RSEQ
+    if (manager->use_rseq) {
+        char* class_base = (char*)&cpu_caches[0].classes[class_index];
+        int result;
+        while ((result = rseq_push_block(class_base, sizeof(CpuCache), block)) < 0) {
+            // Preempted or migrated; retry on whichever CPU we are on now
+        }
+        return result == 0 ? 0 : -1;
+    }
+#endif
+    CpuCache* cpu = current_cpu_cache(manager, cpu_caches);
+    CpuCacheClass* slots = &cpu->classes[class_index];
+    int result = -1;
+    pthread_mutex_lock(&cpu->lock);
+    if (slots->current < PERCPU_CACHE_SLOTS) {
+        slots->slots[slots->current++] = block;
+        result = 0;
+    }
+    pthread_mutex_unlock(&cpu->lock);
+    return result;
+}
+
+// Take a free block through the current CPU's cache, refilling half its slots from the pool when empty
+static MemBlock* take_cpu_block(MemoryManager* manager, MemPool* pool) {
+    MemBlock* block = pop_cpu_block(manager, pool->arena->cpu_caches, pool->class_index);
+    if (block != NULL) {
+        return block;
+    }
+
+    MemBlock* batch = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list == NULL) {
+        take_remote_frees_locked(pool);
+    }
+    for (size_t i = 0; i < PERCPU_CACHE_SLOTS / 2 + 1 && pool->free_list != NULL; i++) {
+        MemBlock* free_block = pool->free_list;
+        pool->free_list = free_block->next;
+        pool->free_count--;
+        free_block->next = batch;
+        batch = free_block;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    // Keep one for the caller; if the thread migrated and the new CPU fills up, the rest go back
+    block = batch;
+    batch = batch->next;
+    while (batch != NULL) {
+        MemBlock* next = batch->next;
+        if (push_cpu_block(manager, pool->arena->cpu_caches, pool->class_index, batch) != 0) {
+            MemBlock* last = batch;
+            size_t returned = 1;
+            while (last->next != NULL) {
+                last = last->next;
+                returned++;
+            }
+            pthread_mutex_lock(&pool->lock);
+            last->next = pool->free_list;
+            pool->free_list = batch;
+            pool->free_count += returned;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        batch = next;
+    }
+    return block;
+}
+
+// Cache a freed block on the current CPU, moving half its slots back to the pool when full
+static void release_cpu_block(MemoryManager* manager, MemBlock* block) {
+    MemPool* pool = block->pool;
+    if (push_cpu_block(manager, pool->arena->cpu_caches, pool->class_index, block) == 0) {
+        return;
+    }
+
+    MemBlock* first = block;
+    MemBlock* last = block;
+    size_t released = 1;
+    first->next = NULL;
+    for (size_t i = 0; i < PERCPU_CACHE_SLOTS / 2; i++) {
+        MemBlock* cached = pop_cpu_block(manager, pool->arena->cpu_caches, pool->class_index);
+        if (cached == NULL) {
+            break;
+        }
+        cached->next = first;
+        first = cached;
+        released++;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->free_list;
+    pool->free_list = first;
+    pool->free_count += released;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Give an arena one cache entry per possible CPU
+static int init_cpu_caches(MemoryManager* manager, MemArena* arena) {
+    CpuCache* cpu_caches = (CpuCache*)calloc(manager->cpu_count, sizeof(CpuCache));
+    if (cpu_caches == NULL) {
+        return -1;
+    }
+    for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+        pthread_mutex_init(&cpu_caches[cpu].lock, NULL);
+    }
+    arena->cpu_caches = cpu_caches;
+    return 0;
+}
+
+// Return every block cached by an arena's CPUs to its pools and release the caches
+static void free_cpu_caches(MemoryManager* manager, MemArena* arena) {
+    CpuCache* cpu_caches = arena->cpu_caches;
+    arena->cpu_caches = NULL;
+    if (cpu_caches == NULL) {
+        return;
+    }
+
+    for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+        for (size_t i = 0; i < arena->pool_count; i++) {
+            CpuCacheClass* slots = &cpu_caches[cpu].classes[i];
+            MemPool* pool = arena->pool_table[i];
+            pthread_mutex_lock(&pool->lock);
+            while (slots->current > 0) {
+                MemBlock* cached = slots->slots[--slots->current];
+                cached->next = pool->free_list;
+                pool->free_list = cached;
+                pool->free_count++;
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+        pthread_mutex_destroy(&cpu_caches[cpu].lock);
+    }
+    free(cpu_caches);
+}
+
+// Choose between per-thread and per-CPU caching; call before allocating from pools
+int set_cache_mode(MemoryManager* manager, CacheMode mode) {
+    if (mode == manager->cache_mode) {
+        return 0;
+    }
+    flush_thread_cache(manager);
+
+    pthread_mutex_lock(&manager->lock);
+    if (mode == CACHE_PER_THREAD) {
+        // Nothing runs on the per-CPU caches once the mode changes, so they can be emptied from any CPU
+        manager->cache_mode = mode;
+        for (size_t i = 0; i < manager->arena_count; i++) {
+            free_cpu_caches(manager, manager->arenas[i]);
+        }
+        manager->cpu_count = 0;
+        pthread_mutex_unlock(&manager->lock);
+        return 0;
+    }
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    manager->cpu_count = cpu_count < 1 ? 1 : (size_t)cpu_count;
+    for (size_t i = 0; i < manager->arena_count; i++) {
+        if (init_cpu_caches(manager, manager->arenas[i]) != 0) {
+            for (size_t j = 0; j < i; j++) {
+                free_cpu_caches(manager, manager->arenas[j]);
+            }
+            manager->cpu_count = 0;
+            pthread_mutex_unlock(&manager->lock);
+            return -1;
+        }
+    }
+#if HAVE_RSEQ
+    // glibc leaves __rseq_size at 0 when the kernel refused the registration
+    manager->use_rseq = __rseq_size > 0 && (int32_t)current_rseq()->cpu_id >= 0;
+#endif
+    manager->cache_mode = mode;
+    pthread_mutex_unlock(&manager->lock);
+    return 0;
+}
+
+// Check whether per-CPU caches run as restartable sequences
+int cache_uses_rseq(MemoryManager* manager) {
+    return manager->cache_mode == CACHE_PER_CPU && manager->use_rseq;
+}
+
+// Record the allocation site of one in leak_sample_rate allocations
+static void sample_allocation_site(MemoryManager* manager, ThreadCache* cache, MemBlock* block, const void* site) {
+    if (cache != NULL && manager->leak_sample_rate != 0 &&
+        (cache->sample_countdown == 0 || --cache->sample_countdown == 0)) {
+        cache->sample_countdown = manager->leak_sample_rate;
+        block->site = site;
+    }
+}
+
+// Allocate memory in an arena, recording the caller as the allocation site when sampled
+static void* allocate_memory_at(MemoryManager* manager, MemArena* arena, size_t size, size_t alignment, const void* site) {
+    ThreadCache* cache = get_thread_cache(manager);
+    if (cache != NULL && manager->guard_sample_rate != 0 && ++cache->guard_count >= manager->guard_sample_rate) {
+        cache->guard_count = 0;
+        void* ptr = allocate_guarded(manager, cache, size, alignment, site);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    if (arena == NULL) {
+        arena = cache != NULL ? cache->arena : manager->arenas[0];
+    }
+    MemBlock* block = allocate_from_pools(manager, arena, cache, size, alignment);
+    if (block == NULL) {
+        block = allocate_from_heap(manager, arena, cache, size, alignment);
+    }
+    if (block == NULL) {
+        return NULL;
+    }
+
+    sample_allocation_site(manager, cache, block, site);
+    return block->ptr;
+}
+
+// Allocate memory
+void* allocate_memory(MemoryManager* manager, size_t size, size_t alignment) {
+    return allocate_memory_at(manager, NULL, size, alignment, CALLER_ADDRESS());
+}
+
+// Allocate memory from a specific arena, whichever arena the calling thread uses
+void* allocate_in_arena(MemoryManager* manager, int arena, size_t size, size_t alignment) {
+    if (arena < 0 || (size_t)arena >= manager->arena_count) {
+        return NULL;
+    }
+    return allocate_memory_at(manager, manager->arenas[arena], size, alignment, CALLER_ADDRESS());
+}
+
+// Apply the arena's transparent huge page policy to a new mapping
+static void advise_huge_pages(MemArena* arena, void* addr, size_t length) {
+#ifdef MADV_HUGEPAGE
+    if (arena->huge_pages == HUGE_PAGES_ALWAYS) {
+        madvise(addr, length, MADV_HUGEPAGE);
+    } else if (arena->huge_pages == HUGE_PAGES_NEVER) {
+        madvise(addr, length, MADV_NOHUGEPAGE);
+    }
+#else
+    (void)arena;
+    (void)addr;
+    (void)length;
+#endif
+}
+
+// Find the smallest order whose blocks hold bytes
+static int buddy_order(size_t bytes) {
+    int order = BUDDY_MIN_ORDER;
+    while (((size_t)1 << order) < bytes) {
+        order++;
+    }
+    return order;
+}
+
+// Free-block bit of the block at offset in the bitmap of its order
+static uint64_t* buddy_bit_word(BuddyRegion* region, size_t offset, int order, uint64_t* mask) {
+    size_t bit = offset >> order;
+    *mask = (uint64_t)1 << (bit % 64);
+    return &region->free_bits[order - BUDDY_MIN_ORDER][bit / 64];
+}
+
+// Put a free block on the list and in the bitmap of its order
+static void buddy_push_locked(BuddyRegion* region, size_t offset, int order) {
+    BuddyFree* node = (BuddyFree*)(region->base + offset);
+    BuddyFree** head = &region->free_lists[order - BUDDY_MIN_ORDER];
+    node->prev = NULL;
+    node->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = node;
+    }
+    *head = node;
+    uint64_t mask;
+    *buddy_bit_word(region, offset, order, &mask) |= mask;
+}
+
+// Take a free block off the list and out of the bitmap of its order
+static void buddy_remove_locked(BuddyRegion* region, size_t offset, int order) {
+    BuddyFree* node = (BuddyFree*)(region->base + offset);
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        region->free_lists[order - BUDDY_MIN_ORDER] = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    uint64_t mask;
+    *buddy_bit_word(region, offset, order, &mask) &= ~mask;
+}
+
+// Reserve the arena's buddy region on first use; NULL when it cannot be mapped
+static BuddyRegion* get_buddy_region_locked(MemArena* arena) {
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_relaxed);
+    if (region != NULL) {
+        return region;
+    }
+    region = (BuddyRegion*)calloc(1, sizeof(BuddyRegion));
+    if (region == NULL) {
+        return NULL;
+    }
+
+    // Over-map by one top block so the region can start on a top-block boundary; pages are only
+    // committed as blocks are used
+    size_t length = BUDDY_REGION_SIZE + BUDDY_MAX_BLOCK;
+    char* map = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        free(region);
+        return NULL;
+    }
+    char* base = (char*)(((uintptr_t)map + BUDDY_MAX_BLOCK - 1) & ~(uintptr_t)(BUDDY_MAX_BLOCK - 1));
+    if (base > map) {
+        munmap(map, (size_t)(base - map));
+    }
+    munmap(base + BUDDY_REGION_SIZE, (size_t)(map + length - (base + BUDDY_REGION_SIZE)));
+    advise_huge_pages(arena, base, BUDDY_REGION_SIZE);
+    region->base = base;
+    atomic_store_explicit(&arena->buddy, region, memory_order_release);
+    return region;
+}
+
+// Check whether raw came from the arena's buddy region
+static int buddy_owns(MemArena* arena, const void* raw) {
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_acquire);
+    return region != NULL && (const char*)raw >= region->base && (const char*)raw < region->base + BUDDY_REGION_SIZE;
+}
+
+// Bytes of the buddy block at raw
+static size_t buddy_block_size(MemArena* arena, const void* raw) {
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_acquire);
+    return (size_t)1 << region->orders[((const char*)raw - region->base) >> BUDDY_MIN_ORDER];
+}
+
+// Allocate a block of at least bytes from the arena's buddy region, splitting a larger free block
+// when no block of the right order is free; NULL when the region is full
+static void* buddy_allocate(MemArena* arena, size_t bytes) {
+    int order = buddy_order(bytes);
+    pthread_mutex_lock(&arena->backend_lock);
+    BuddyRegion* region = get_buddy_region_locked(arena);
+    if (region == NULL) {
+        pthread_mutex_unlock(&arena->backend_lock);
+        return NULL;
+    }
+
+    int found = order;
+    while (found <= BUDDY_MAX_ORDER && region->free_lists[found - BUDDY_MIN_ORDER] == NULL) {
+        found++;
+    }
+    size_t offset;
+    if (found <= BUDDY_MAX_ORDER) {
+        offset = (size_t)((char*)region->free_lists[found - BUDDY_MIN_ORDER] - region->base);
+        buddy_remove_locked(region, offset, found);
+    } else if (region->carved < BUDDY_REGION_SIZE) {
+        // Top blocks are carved in address order, so untouched ones commit no memory
+        offset = region->carved;
+        region->carved += BUDDY_MAX_BLOCK;
+        found = BUDDY_MAX_ORDER;
+    } else {
+        pthread_mutex_unlock(&arena->backend_lock);
+        return NULL;
+    }
+
+    // Keep the lower half of each split and free the upper one
+    while (found > order) {
+        found--;
+        buddy_push_locked(region, offset + ((size_t)1 << found), found);
+    }
+    region->orders[offset >> BUDDY_MIN_ORDER] = (uint8_t)order;
+    pthread_mutex_unlock(&arena->backend_lock);
+    return region->base + offset;
+}
+
+// Return a block to the buddy region, merging it with its buddy for as long as the buddy is free
+static void buddy_free(MemArena* arena, void* raw) {
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_acquire);
+    size_t offset = (size_t)((char*)raw - region->base);
+    pthread_mutex_lock(&arena->backend_lock);
+    int order = region->orders[offset >> BUDDY_MIN_ORDER];
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy = offset ^ ((size_t)1 << order);
+        uint64_t mask;
+        if ((*buddy_bit_word(region, buddy, order, &mask) & mask) == 0) {
+            break;
+        }
+        buddy_remove_locked(region, buddy, order);
+        offset &= ~((size_t)1 << order);
+        order++;
+    }
+    buddy_push_locked(region, offset, order);
+    pthread_mutex_unlock(&arena->backend_lock);
+}
+
+
+// Check whether a heap block of size bytes at alignment is medium-sized, and served by the buddy region
+static int fits_buddy(size_t size, size_t alignment) {
+    if (alignment < BLOCK_HEADER_SIZE) {
+        alignment = BLOCK_HEADER_SIZE;
+    }
+    // Buddy blocks are aligned to their size, so at least to BUDDY_MIN_BLOCK
+    return alignment <= BUDDY_MIN_BLOCK && size <= BUDDY_MAX_BLOCK - alignment &&
+           size + alignment > BUDDY_MIN_BLOCK / 2;
+}
+
+// Find the highest set bit of a non-zero size
+static int tlsf_fls(size_t size) {
+    return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)size);
+}
+
+// First- and second-level list of a free block of size bytes
+static void tlsf_mapping(size_t size, int* fl, int* sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size >> TLSF_ALIGNMENT_LOG2);
+    } else {
+        int bit = tlsf_fls(size);
+        *fl = bit - TLSF_FL_SHIFT + 1;
+        *sl = (int)((size >> (bit - TLSF_SL_LOG2)) ^ ((size_t)1 << TLSF_SL_LOG2));
+    }
+}
+
+// Payload of the block that follows block in its region
+static TlsfBlock* tlsf_next_block(TlsfBlock* block) {
+    return (TlsfBlock*)((char*)block + TLSF_HEADER_SIZE + (block->size & ~TLSF_FLAGS));
+}
+
+// Put a free block at the head of its list and set its bitmap bits
+static void tlsf_insert_locked(TlsfHeap* heap, TlsfBlock* block) {
+    int fl;
+    int sl;
+    tlsf_mapping(block->size & ~TLSF_FLAGS, &fl, &sl);
+    TlsfBlock* head = heap->free_lists[fl][sl];
+    block->next_free = head;
+    block->prev_free = NULL;
+    if (head != NULL) {
+        head->prev_free = block;
+    }
+    heap->free_lists[fl][sl] = block;
+    heap->fl_bitmap |= (uint64_t)1 << fl;
+    heap->sl_bitmap[fl] |= (uint32_t)1 << sl;
+}
+
+// Take a free block off its list, clearing the bitmap bits of a list it leaves empty
+static void tlsf_remove_locked(TlsfHeap* heap, TlsfBlock* block) {
+    int fl;
+    int sl;
+    tlsf_mapping(block->size & ~TLSF_FLAGS, &fl, &sl);
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap->free_lists[fl][sl] = block->next_free;
+        if (block->next_free == NULL) {
+            heap->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+            if (heap->sl_bitmap[fl] == 0) {
+                heap->fl_bitmap &= ~((uint64_t)1 << fl);
+            }
+        }
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+}
+
+// Round a size up to the start of the next list, so every block on the list it maps to fits it
+static size_t tlsf_round_up(size_t size) {
+    if (size >= TLSF_SMALL_BLOCK) {
+        size += ((size_t)1 << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+// Find a free block of at least size bytes with two bitmap scans; NULL when there is none
+static TlsfBlock* tlsf_find_locked(TlsfHeap* heap, size_t size) {
+    size = tlsf_round_up(size);
+    int fl;
+    int sl;
+    tlsf_mapping(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+
+    uint32_t sl_map = heap->sl_bitmap[fl] & (~(uint32_t)0 << sl);
+    if (sl_map == 0) {
+        uint64_t fl_map = fl + 1 < 64 ? heap->fl_bitmap & (~(uint64_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = heap->sl_bitmap[fl];
+    }
+    return heap->free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// Map a new region of at least size payload bytes and add it to the heap as one free block
+static int tlsf_add_region_locked(MemArena* arena, TlsfHeap* heap, size_t size) {
+    size_t overhead = TLSF_REGION_HEADER + 2 * TLSF_HEADER_SIZE; // First block and end sentinel
+    size_t length = TLSF_REGION_SIZE;
+    if (size > length - overhead) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        length = (size + overhead + page_size - 1) & ~(page_size - 1);
+    }
+    char* map = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    advise_huge_pages(arena, map, length);
+    TlsfRegion* region = (TlsfRegion*)map;
+    region->next = heap->regions;
+    region->length = length;
+    heap->regions = region;
+
+    TlsfBlock* block = (TlsfBlock*)(map + TLSF_REGION_HEADER);
+    block->size = (length - overhead) | TLSF_FREE;
+    TlsfBlock* sentinel = tlsf_next_block(block);
+    sentinel->prev_phys = block;
+    sentinel->size = TLSF_PREV_FREE; // Size 0 and in use, so no merge crosses the end of the region
+    tlsf_insert_locked(heap, block);
+    return 0;
+}
+
+// Create the arena's TLSF heap on first use; NULL when it cannot be created
+static TlsfHeap* get_tlsf_heap_locked(MemArena* arena) {
+    TlsfHeap* heap = atomic_load_explicit(&arena->tlsf, memory_order_relaxed);
+    if (heap == NULL) {
+        heap = (TlsfHeap*)calloc(1, sizeof(TlsfHeap));
+        if (heap != NULL) {
+            atomic_store_explicit(&arena->tlsf, heap, memory_order_release);
+        }
+    }
+    return heap;
+}
+
+// Allocate bytes from the arena's TLSF heap in bounded time, mapping a new region only when every
+// free block is too small; NULL when out of memory
+static void* tlsf_allocate(MemArena* arena, size_t bytes) {
+    if (bytes > ((size_t)1 << (TLSF_FL_MAX - 1))) {
+        return NULL;
+    }
+    size_t size = (bytes + TLSF_ALIGNMENT - 1) & ~(size_t)(TLSF_ALIGNMENT - 1);
+    if (size < TLSF_MIN_BLOCK) {
+        size = TLSF_MIN_BLOCK;
+    }
+
+    pthread_mutex_lock(&arena->backend_lock);
+    TlsfHeap* heap = get_tlsf_heap_locked(arena);
+    TlsfBlock* block = heap != NULL ? tlsf_find_locked(heap, size) : NULL;
+    if (block == NULL && heap != NULL && tlsf_add_region_locked(arena, heap, tlsf_round_up(size)) == 0) {
+        block = tlsf_find_locked(heap, size);
+    }
+    if (block == NULL) {
+        pthread_mutex_unlock(&arena->backend_lock);
+        return NULL;
+    }
+    tlsf_remove_locked(heap, block);
+
+    // Split off the tail when it can hold a free block of its own
+    size_t block_size = block->size & ~TLSF_FLAGS;
+    TlsfBlock* next = tlsf_next_block(block);
+    if (block_size >= size + TLSF_HEADER_SIZE + TLSF_MIN_BLOCK) {
+        block->size = size | (block->size & TLSF_PREV_FREE);
+        TlsfBlock* rest = tlsf_next_block(block);
+        rest->size = (block_size - size - TLSF_HEADER_SIZE) | TLSF_FREE;
+        next->prev_phys = rest;
+        tlsf_insert_locked(heap, rest);
+    } else {
+        block->size &= ~TLSF_FREE;
+        next->size &= ~TLSF_PREV_FREE;
+    }
+    pthread_mutex_unlock(&arena->backend_lock);
+    return (char*)block + TLSF_HEADER_SIZE;
+}
+
+// Return a block to the arena's TLSF heap, merging it with free neighbours right away
+static void tlsf_free(MemArena* arena, void* ptr) {
+    TlsfHeap* heap = atomic_load_explicit(&arena->tlsf, memory_order_acquire);
+    TlsfBlock* block = (TlsfBlock*)((char*)ptr - TLSF_HEADER_SIZE);
+    pthread_mutex_lock(&arena->backend_lock);
+    if (block->size & TLSF_PREV_FREE) {
+        TlsfBlock* prev = block->prev_phys;
+        tlsf_remove_locked(heap, prev);
+        prev->size += TLSF_HEADER_SIZE + (block->size & ~TLSF_FLAGS);
+        if (heap->decay_block == block) {
+            heap->decay_block = prev;
+        }
+        block = prev;
+    }
+    TlsfBlock* next = tlsf_next_block(block);
+    if (next->size & TLSF_FREE) {
+        tlsf_remove_locked(heap, next);
+        block->size += TLSF_HEADER_SIZE + (next->size & ~TLSF_FLAGS);
+        if (heap->decay_block == next) {
+            heap->decay_block = block;
+        }
+        next = tlsf_next_block(block);
+    }
+    block->size |= TLSF_FREE;
+    next->prev_phys = block;
+    next->size |= TLSF_PREV_FREE;
+    tlsf_insert_locked(heap, block);
+    pthread_mutex_unlock(&arena->backend_lock);
+}
+
+// Unmap every region of the arena's TLSF heap
+static void free_tlsf_heap(MemArena* arena) {
+    TlsfHeap* heap = atomic_load(&arena->tlsf);
+    if (heap == NULL) {
+        return;
+    }
+    TlsfRegion* region = heap->regions;
+    while (region != NULL) {
+        TlsfRegion* next = region->next;
+        munmap(region, region->length);
+        region = next;
+    }
+    free(heap);
+}
+
+// Give the pages of free buddy and TLSF blocks back to the system, keeping the page of each
+// block that holds its free-list links
+static void release_free_pages(MemArena* arena) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&arena->backend_lock);
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_relaxed);
+    for (int order = BUDDY_MIN_ORDER; region != NULL && order <= BUDDY_MAX_ORDER; order++) {
+        size_t block_size = (size_t)1 << order;
+        if (block_size <= page_size) {
+            continue;
+        }
+        for (BuddyFree* node = region->free_lists[order - BUDDY_MIN_ORDER]; node != NULL; node = node->next) {
+            madvise((char*)node + page_size, block_size - page_size, MADV_DONTNEED);
+        }
+    }
+
+    // A TLSF block's whole pages lie between its links and the next block's header
+    TlsfHeap* heap = atomic_load_explicit(&arena->tlsf, memory_order_relaxed);
+    for (int fl = 0; heap != NULL && fl < TLSF_FL_COUNT; fl++) {
+        for (int sl = 0; sl < (1 << TLSF_SL_LOG2); sl++) {
+            for (TlsfBlock* block = heap->free_lists[fl][sl]; block != NULL; block = block->next_free) {
+                uintptr_t start = ((uintptr_t)(block + 1) + page_size - 1) & ~(uintptr_t)(page_size - 1);
+                uintptr_t end = (uintptr_t)tlsf_next_block(block) & ~(uintptr_t)(page_size - 1);
+                if (end > start) {
+                    madvise((void*)start, end - start, MADV_DONTNEED);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&arena->backend_lock);
+}
+
+// Return the pages of [start, end) within the budget; returns the end of what was returned
+static uintptr_t decay_range(uintptr_t start, uintptr_t end, size_t page_size, size_t* budget) {
+    size_t length = end - start;
+    if (length > *budget * page_size) {
+        length = *budget * page_size;
+    }
+    madvise((void*)start, length, MADV_DONTNEED);
+    *budget -= length / page_size;
+    return start + length;
+}
+
+// Continue a page return over the buddy region in address order; returns 1 once it reaches the
+// carved end. Free blocks are found from the bitmaps, so splits and merges never strand the walk.
+static int buddy_decay_locked(BuddyRegion* region, size_t page_size, size_t* budget) {
+    while (*budget > 0) {
+        size_t offset = region->decay_offset;
+        if (offset >= region->carved) {
+            return 1;
+        }
+        (*budget)--;
+        int order = BUDDY_MIN_ORDER;
+        uint64_t mask;
+        while (order <= BUDDY_MAX_ORDER &&
+               (*buddy_bit_word(region, offset & ~(((size_t)1 << order) - 1), order, &mask) & mask) == 0) {
+            order++;
+        }
+        if (order > BUDDY_MAX_ORDER) {
+            region->decay_offset = (offset | (BUDDY_MIN_BLOCK - 1)) + 1; // Allocated
+            continue;
+        }
+
+        // Keep the page of the free block that holds its links
+        size_t start = offset & ~(((size_t)1 << order) - 1);
+        size_t end = start + ((size_t)1 << order);
+        if (offset < start + page_size) {
+            offset = start + page_size < end ? start + page_size : end;
+        }
+        if (offset < end) {
+            offset = (size_t)(decay_range((uintptr_t)region->base + offset, (uintptr_t)region->base + end, page_size, budget) -
+                              (uintptr_t)region->base);
+        }
+        region->decay_offset = offset;
+    }
+    return 0;
+}
+
+// Continue a page return over the TLSF regions in address order; returns 1 once every region is done
+static int tlsf_decay_locked(TlsfHeap* heap, size_t page_size, size_t* budget) {
+    while (*budget > 0) {
+        if (heap->decay_region == NULL) {
+            return 1;
+        }
+        (*budget)--;
+        TlsfBlock* block = heap->decay_block;
+        if ((block->size & ~TLSF_FLAGS) == 0) {
+            // End sentinel
+            heap->decay_region = heap->decay_region->next;
+            if (heap->decay_region != NULL) {
+                heap->decay_block = (TlsfBlock*)((char*)heap->decay_region + TLSF_REGION_HEADER);
+            }
+            heap->decay_address = 0;
+            continue;
+        }
+
+        // A TLSF block's whole pages lie between its links and the next block's header
+        TlsfBlock* next = tlsf_next_block(block);
+        if (block->size & TLSF_FREE) {
+            uintptr_t start = ((uintptr_t)(block + 1) + page_size - 1) & ~(uintptr_t)(page_size - 1);
+            uintptr_t end = (uintptr_t)next & ~(uintptr_t)(page_size - 1);
+            if (start < heap->decay_address) {
+                start = heap->decay_address;
+            }
+            if (start < end) {
+                heap->decay_address = decay_range(start, end, page_size, budget);
+                if (heap->decay_address < end) {
+                    continue;
+                }
+            }
+        }
+        heap->decay_block = next;
+    }
+    return 0;
+}
+
+// Return free backend pages to the system once decay_ms has passed since the last return finished.
+// The return is spread over heap frees, DECAY_PAGES_PER_FREE pages at a time, so no free walks every list.
+static void decay_free_pages(MemArena* arena) {
+    if (arena->decay_ms == 0) {
+        return;
+    }
+    int starting = 0;
+    if (!atomic_load_explicit(&arena->decaying, memory_order_relaxed)) {
+        uint_least64_t last = atomic_load_explicit(&arena->last_decay, memory_order_relaxed);
+        if (last == UINT_LEAST64_MAX) {
+            return; // Another thread is starting the return
+        }
+        if (monotonic_milliseconds() - last < arena->decay_ms ||
+            !atomic_compare_exchange_strong_explicit(&arena->last_decay, &last, UINT_LEAST64_MAX, memory_order_relaxed, memory_order_relaxed)) {
+            return; // Too early, or another thread got here first
+        }
+        starting = 1;
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t budget = DECAY_PAGES_PER_FREE;
+    pthread_mutex_lock(&arena->backend_lock);
+    BuddyRegion* region = atomic_load_explicit(&arena->buddy, memory_order_relaxed);
+    TlsfHeap* heap = atomic_load_explicit(&arena->tlsf, memory_order_relaxed);
+    if (starting) {
+        if (region != NULL) {
+            region->decay_offset = 0;
+        }
+        if (heap != NULL) {
+            heap->decay_region = heap->regions;
+            heap->decay_block = heap->regions != NULL ? (TlsfBlock*)((char*)heap->regions + TLSF_REGION_HEADER) : NULL;
+            heap->decay_address = 0;
+        }
+        atomic_store_explicit(&arena->decaying, 1, memory_order_relaxed);
+    }
+    if (atomic_load_explicit(&arena->decaying, memory_order_relaxed) &&
+        (region == NULL || buddy_decay_locked(region, page_size, &budget)) &&
+        (heap == NULL || tlsf_decay_locked(heap, page_size, &budget))) {
+        atomic_store_explicit(&arena->decaying, 0, memory_order_relaxed);
+        atomic_store_explicit(&arena->last_decay, monotonic_milliseconds(), memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&arena->backend_lock);
+}
+
+// Map memory for a large heap block: anonymously, or from a memfd of its own with cow_blocks,
+// falling back to an anonymous mapping when memfd is unavailable
+static void* map_heap_memory(size_t length, int cow_blocks, int* fd) {
+    *fd = -1;
+#ifdef MFD_CLOEXEC
+    if (cow_blocks) {
+        *fd = memfd_create("amm-block", MFD_CLOEXEC);
+    }
+    if (*fd >= 0) {
+        void* map = ftruncate(*fd, (off_t)length) == 0 ?
+            mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            return map;
+        }
+        close(*fd);
+        *fd = -1;
+    }
+#else
+    (void)cow_blocks;
+#endif
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return map != MAP_FAILED ? map : NULL;
+}
+
+// Get memory for a heap block, leaving room for the header; returns the aligned pointer
+static void* reserve_heap_memory(MemoryManager* manager, MemArena* arena, size_t size, size_t alignment, void** raw, size_t* map_size, int* fd) {
+    if (alignment < BLOCK_HEADER_SIZE) {
+        alignment = BLOCK_HEADER_SIZE;
+    }
+    *map_size = 0;
+    *fd = -1;
+
+    // Large blocks get their own mapping, with the header just below the first aligned address
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (manager->mmap_threshold != 0 && size >= manager->mmap_threshold && alignment <= page_size) {
+        size_t length = (alignment + size + page_size - 1) & ~(page_size - 1);
+        *raw = map_heap_memory(length, manager->cow_blocks, fd);
+        if (*raw != NULL) {
+            advise_huge_pages(arena, *raw, length);
+            *map_size = length;
+            return (char*)*raw + alignment;
+        }
+    }
+
+    if (manager->heap_backend == HEAP_BACKEND_TLSF) {
+        *raw = size <= SIZE_MAX - BLOCK_HEADER_SIZE - alignment ? tlsf_allocate(arena, BLOCK_HEADER_SIZE + size + alignment - 1) : NULL;
+        if (*raw == NULL) {
+            return NULL; // Allocation failed
+        }
+        uintptr_t aligned_ptr = ((uintptr_t)*raw + BLOCK_HEADER_SIZE + alignment - 1) & ~(alignment - 1);
+        return (void*)aligned_ptr;
+    }
+
+    // Medium blocks come from the buddy region, with the header just below the first aligned address
+    if (manager->heap_backend == HEAP_BACKEND_BUDDY && fits_buddy(size, alignment)) {
+        *raw = buddy_allocate(arena, alignment + size);
+        if (*raw != NULL) {
+            return (char*)*raw + alignment;
+        }
+    }
+
+    // Allocate memory with alignment
+    *raw = malloc(BLOCK_HEADER_SIZE + size + alignment - 1);
+    if (*raw == NULL) {
+        return NULL; // Allocation failed
+    }
+    uintptr_t aligned_ptr = (uintptr_t)*raw + BLOCK_HEADER_SIZE;
+    aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1); // Align the pointer
+    return (void*)aligned_ptr;
+}
+
+// Give a heap block's memory back to the system, or to the arena's buddy region
+static void release_heap_memory(MemArena* arena, void* raw, size_t map_size, int fd) {
+    if (map_size == 0) {
+        if (atomic_load_explicit(&arena->tlsf, memory_order_acquire) != NULL) {
+            tlsf_free(arena, raw);
+            decay_free_pages(arena);
+        } else if (buddy_owns(arena, raw)) {
+            buddy_free(arena, raw);
+            decay_free_pages(arena);
+        } else {
+            free(raw);
+        }
+        return;
+    }
+    munmap(raw, map_size);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Allocate memory outside the pools
+static MemBlock* allocate_from_heap(MemoryManager* manager, MemArena* arena, ThreadCache* cache, size_t size, size_t alignment) {
+    MemBlock* block = (MemBlock*)malloc(sizeof(MemBlock));
+    if (block == NULL) {
+        return NULL; // Allocation failed
+    }
+
+    block->ptr = reserve_heap_memory(manager, arena, size, alignment, &block->raw, &block->map_size, &block->fd);
+    if (block->ptr == NULL) {
+        free(block);
+        return NULL; // Allocation failed
+    }
+
+    block->size = size;
+    block->alignment = alignment > BLOCK_HEADER_SIZE ? alignment : BLOCK_HEADER_SIZE;
+    atomic_init(&block->ref_count, 1); // Initial reference count is 1
+    block->site = NULL;
+    block->pool = NULL;
+    block->arena = arena;
+    block->next = NULL;
+    ((MemBlock**)block->ptr)[-1] = block;
+
+    pthread_mutex_lock(&arena->lock);
+    int registered = register_block_locked(arena, block);
+    pthread_mutex_unlock(&arena->lock);
+    if (registered != 0) {
+        release_heap_memory(arena, block->raw, block->map_size, block->fd);
+        free(block);
+        return NULL;
+    }
+
+    count_allocation(manager, cache, size, 0);
+    return block;
+}
+
+// Allocate memory from pool with alignment
+void* allocate_from_pool(MemoryManager* manager, size_t size, size_t alignment) {
+    ThreadCache* cache = get_thread_cache(manager);
+    MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+    MemBlock* block = allocate_from_pools(manager, arena, cache, size, alignment);
+    return block != NULL ? block->ptr : NULL;
+}
+
+// Find the class index of the smallest pool in the calling thread's arena that fits, or -1
+int find_pool_class(MemoryManager* manager, size_t size, size_t alignment) {
+    ThreadCache* cache = get_thread_cache(manager);
+    MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+    MemPool* pool = atomic_load_explicit(&arena->pools, memory_order_acquire);
+
+    while (pool != NULL) {
+        if (pool->block_size >= size && pool->alignment >= alignment) {
+            return (int)pool->class_index;
+        }
+        pool = atomic_load_explicit(&pool->next, memory_order_acquire);
+    }
+    return -1;
+}
+
+// Allocate from the pool at a known class index, without walking the pool list;
+// falls back to allocate_memory when that pool does not fit or is empty
+void* allocate_from_class(MemoryManager* manager, int class_index, size_t size, size_t alignment) {
+    ThreadCache* cache = get_thread_cache(manager);
+    MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+    if (class_index >= 0 && (size_t)class_index < arena->pool_count) {
+        MemPool* pool = arena->pool_table[class_index];
+        if (!pool->typed && size <= pool->block_size && alignment <= pool->alignment) {
+            MemBlock* block = allocate_in_pool(manager, cache, pool, size);
+            if (block != NULL) {
+                sample_allocation_site(manager, cache, block, CALLER_ADDRESS());
+                return block->ptr;
+            }
+        }
+    }
+    return allocate_memory_at(manager, arena, size, alignment, CALLER_ADDRESS());
+}
+
+// Take a free block from one pool and hand it out with a reference count of 1
+static MemBlock* allocate_in_pool(MemoryManager* manager, ThreadCache* cache, MemPool* pool, size_t size) {
+    MemBlock* block = take_pool_block(manager, cache, pool);
+    if (block != NULL) {
+        block->size = size;
+        atomic_store_explicit(&block->ref_count, 1, memory_order_relaxed); // Initial reference count is 1
+        block->site = NULL;
+        count_allocation(manager, cache, size, 1);
+    }
+    return block;
+}
+
+// Take a free block from the smallest pool of the arena that fits
+static MemBlock* allocate_from_pools(MemoryManager* manager, MemArena* arena, ThreadCache* cache, size_t size, size_t alignment) {
+    MemPool* pool = atomic_load_explicit(&arena->pools, memory_order_acquire);
+#ifdef AMM_STATIC_SIZE_CLASSES
+    // Generated classes: one table lookup, then a pop from the thread cache bin. Sizes a user pool
+    // covers walk the list, so user pools keep serving their sizes ahead of the generated classes
+    if (size <= AMM_STATIC_CLASS_MAX_SIZE && alignment <= AMM_STATIC_CLASS_ALIGNMENT &&
+        size > atomic_load_explicit(&arena->custom_class_limit, memory_order_relaxed)) {
+        size_t class_index = amm_size_class[(size + AMM_STATIC_CLASS_ALIGNMENT - 1) >> AMM_STATIC_CLASS_GRANULE_SHIFT];
+        MemPool* class_pool = arena->pool_table[class_index];
+        MemBlock* block = allocate_in_pool(manager, cache, class_pool, size);
+        if (block != NULL) {
+            return block;
+        }
+        if (manager->heap_backend == HEAP_BACKEND_TLSF) {
+            return NULL;
+        }
+        // Every pool ahead of the class in the list is smaller, so an empty class continues after it
+        pool = atomic_load_explicit(&class_pool->next, memory_order_acquire);
+    }
+#endif
+    // Sizes past every pool go straight to the heap
+    if (size > atomic_load_explicit(&arena->largest_pool, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    while (pool != NULL) {
+        if (pool->block_size >= size && pool->alignment >= alignment) {
+            MemBlock* block = allocate_in_pool(manager, cache, pool, size);
+            if (block != NULL) {
+                return block;
+            }
+            // The TLSF heap takes constant time, so it beats walking on to larger pools
+            if (manager->heap_backend == HEAP_BACKEND_TLSF) {
+                return NULL;
+            }
+        }
+        pool = atomic_load_explicit(&pool->next, memory_order_acquire);
+    }
+
+    return NULL;
+}
+
+// Allocate a pool slab, placing it on the arena's NUMA node before any page is touched
+static void* allocate_slab(MemArena* arena, size_t size, size_t* mapped_size) {
+    *mapped_size = 0;
+    if (arena->node < 0) {
+        return malloc(size);
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size + page_size - 1) & ~(page_size - 1);
+    void* slab = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        return NULL;
+    }
+
+    // A preference rather than a binding, so a full or missing node falls back to any other
+    unsigned long node_mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    node_mask[arena->node / (8 * sizeof(unsigned long))] = 1UL << (arena->node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, slab, length, MPOL_PREFERRED, node_mask, (unsigned long)NUMA_MAX_NODES, 0);
+
+    advise_huge_pages(arena, slab, length);
+    *mapped_size = length;
+    return slab;
+}
+
+// Create a pool in one arena
+static MemPool* add_pool(MemArena* arena, size_t block_size, size_t block_count, size_t alignment, const ObjectPoolConfig* objects) {
+    MemPool* pool = (MemPool*)malloc(sizeof(MemPool));
+    if (pool == NULL) {
+        perror("Failed to create memory pool");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each slot holds the header followed by an aligned block; a padded slot rounds the two together up
+    // to whole cache lines, so the header shares its line only with its own object
+    if (alignment < BLOCK_HEADER_SIZE) {
+        alignment = BLOCK_HEADER_SIZE;
+    }
+    size_t slot_alignment = alignment;
+    if (objects != NULL && objects->pad_to_cache_line && slot_alignment < CACHE_LINE_SIZE) {
+        slot_alignment = CACHE_LINE_SIZE;
+    }
+    size_t stride = (alignment + block_size + slot_alignment - 1) & ~(slot_alignment - 1);
+
+    pool->block_size = block_size;
+    pool->block_count = block_count;
+    pool->alignment = alignment;
+    pool->arena = arena;
+    pool->free_count = block_count;
+    pool->free_list = NULL;
+    atomic_init(&pool->remote_frees, NULL);
+    pool->typed = objects != NULL;
+    pool->reset = objects != NULL ? objects->reset : NULL;
+    pool->hook_context = objects != NULL ? objects->hook_context : NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->slab = allocate_slab(arena, block_count * stride + slot_alignment - 1, &pool->slab_size);
+    pool->blocks = (MemBlock*)malloc(block_count * sizeof(MemBlock));
+    if (pool->slab == NULL || pool->blocks == NULL) {
+        perror("Failed to allocate memory block");
+        exit(EXIT_FAILURE);
+    }
+
+    uintptr_t base = (uintptr_t)pool->slab;
+    base = (base + slot_alignment - 1) & ~(slot_alignment - 1); // Align the pointer
+
+    for (size_t i = block_count; i > 0; i--) {
+        MemBlock* block = &pool->blocks[i - 1];
+        block->size = block_size;
+        block->alignment = alignment;
+        block->ptr = (void*)(base + (i - 1) * stride + alignment);
+        block->raw = NULL;
+        block->map_size = 0;
+        block->fd = -1;
+        atomic_init(&block->ref_count, 0); // Initial reference count is 0
+        block->site = NULL;
+        block->pool = pool;
+        block->arena = arena;
+        block->index = 0;
+        block->next = pool->free_list;
+        pool->free_list = block;
+        ((MemBlock**)block->ptr)[-1] = block;
+        if (objects != NULL && objects->init != NULL) {
+            objects->init(block->ptr, objects->hook_context);
+        }
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    if (arena->pool_count == MAX_SIZE_CLASSES) {
+        fprintf(stderr, "Failed to create memory pool: more than %d pools\n", MAX_SIZE_CLASSES);
+        exit(EXIT_FAILURE);
+    }
+    pool->class_index = arena->pool_count;
+    arena->pool_table[arena->pool_count++] = pool;
+    atomic_init(&pool->next, NULL);
+    if (pool->typed) {
+        pthread_mutex_unlock(&arena->lock);
+        return pool;
+    }
+
+    // Insert in size order and publish the pool only once it is complete
+    MemPool* _Atomic* link = &arena->pools;
+    MemPool* next = atomic_load_explicit(link, memory_order_relaxed);
+#ifdef AMM_STATIC_SIZE_CLASSES
+    // A user pool goes ahead of a generated class of the same size, and sizes up to it skip the table
+    if (pool->class_index >= AMM_STATIC_CLASS_COUNT && block_size <= AMM_STATIC_CLASS_MAX_SIZE &&
+        block_size > atomic_load_explicit(&arena->custom_class_limit, memory_order_relaxed)) {
+        atomic_store_explicit(&arena->custom_class_limit, block_size, memory_order_relaxed);
+    }
+    while (next != NULL && (next->block_size < block_size ||
+                            (next->block_size == block_size && next->class_index >= AMM_STATIC_CLASS_COUNT))) {
+        link = &next->next;
+        next = atomic_load_explicit(link, memory_order_relaxed);
+    }
+#else
+    while (next != NULL && next->block_size <= block_size) {
+        link = &next->next;
+        next = atomic_load_explicit(link, memory_order_relaxed);
+    }
+#endif
+    atomic_init(&pool->next, next);
+    atomic_store_explicit(link, pool, memory_order_release);
+    if (block_size > atomic_load_explicit(&arena->largest_pool, memory_order_relaxed)) {
+        atomic_store_explicit(&arena->largest_pool, block_size, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return pool;
+}
+
+// Create memory pool in every arena
+void create_memory_pool(MemoryManager* manager, size_t block_size, size_t block_count, size_t alignment) {
+    for (size_t i = 0; i < manager->arena_count; i++) {
+        add_pool(manager->arenas[i], block_size, block_count, alignment, NULL);
+    }
+}
+
+// Create memory pool in one arena
+void create_arena_pool(MemoryManager* manager, int arena, size_t block_size, size_t block_count, size_t alignment) {
+    if (arena < 0 || (size_t)arena >= manager->arena_count) {
+        fprintf(stderr, "Failed to create memory pool: no arena %d\n", arena);
+        exit(EXIT_FAILURE);
+    }
+    add_pool(manager->arenas[arena], block_size, block_count, alignment, NULL);
+}
+
+// Create a typed object pool in the calling thread's arena; its objects come only from allocate_object
+MemPool* create_object_pool(MemoryManager* manager, const ObjectPoolConfig* config) {
+    ThreadCache* cache = get_thread_cache(manager);
+    MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+    return add_pool(arena, config->object_size, config->capacity, config->alignment, config);
+}
+
+// Take an object from a typed pool, already initialized by init or reset; NULL when the pool is empty
+void* allocate_object(MemoryManager* manager, MemPool* pool) {
+    ThreadCache* cache = get_thread_cache(manager);
+    MemBlock* block = allocate_in_pool(manager, cache, pool, pool->block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    sample_allocation_site(manager, cache, block, CALLER_ADDRESS());
+    return block->ptr;
+}
+
+// Increment reference count
+void increment_ref_count(MemoryManager* manager, void* ptr) {
+    (void)manager;
+    MemBlock* block = find_block(ptr);
+    if (block != NULL) {
+        atomic_fetch_add_explicit(&block->ref_count, 1, memory_order_relaxed);
+    }
+}
+
+// Decrement reference count
+void decrement_ref_count(MemoryManager* manager, void* ptr) {
+    // Deferred mode only logs the pointer; the log is applied when it fills or at a flush
+    if (manager->defer_decrements && ptr != NULL) {
+        ThreadCache* cache = get_thread_cache(manager);
+        if (cache != NULL) {
+            cache->deferred[cache->deferred_count++] = ptr;
+            if (cache->deferred_count == DEFERRED_LOG_SIZE) {
+                apply_deferred_decrements(cache);
+            }
+            return;
+        }
+    }
+
+    MemBlock* block = find_block(ptr);
+    if (block != NULL && atomic_fetch_sub_explicit(&block->ref_count, 1, memory_order_acq_rel) == 1) {
+        deallocate_block(manager, block);
+    }
+}
+
+// Get a block's reference count, for callers that update it inline
+atomic_int* block_ref_count(void* ptr) {
+    MemBlock* block = find_block(ptr);
+    return block != NULL ? &block->ref_count : NULL;
+}
+
+// Get the number of bytes a block can hold, which may exceed the size it was allocated with
+size_t block_usable_size(void* ptr) {
+    MemBlock* block = find_block(ptr);
+    if (block == NULL) {
+        return 0;
+    }
+    return block->pool != NULL ? block->pool->block_size : block->size;
+}
+
+// Deallocate a block whose reference count the caller has already taken to zero
+void free_unreferenced_block(MemoryManager* manager, void* ptr) {
+    MemBlock* block = find_block(ptr);
+    if (block != NULL && atomic_load_explicit(&block->ref_count, memory_order_relaxed) == 0) {
+        deallocate_block(manager, block);
+    }
+}
+
+// Log decrements in the thread cache instead of applying them, or apply them again as they come
+void set_deferred_decrements(MemoryManager* manager, int enabled) {
+    if (!enabled) {
+        flush_deferred_decrements(manager);
+    }
+    pthread_mutex_lock(&manager->lock);
+    manager->defer_decrements = enabled;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Apply the calling thread's deferred decrements; call it at quiescent points
+void flush_deferred_decrements(MemoryManager* manager) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache != NULL && cache->deferred_count > 0) {
+        apply_deferred_decrements(cache);
+    }
+}
+
+// Order blocks by owning pool, heap blocks first
+static int compare_block_pools(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)(*(MemBlock* const*)a)->pool;
+    uintptr_t y = (uintptr_t)(*(MemBlock* const*)b)->pool;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Return blocks of one pool that reached zero together, splicing them in with a single lock or CAS
+static void release_pool_run(MemoryManager* manager, ThreadCache* cache, MemBlock** blocks, size_t count) {
+    MemPool* pool = blocks[0]->pool;
+    for (size_t i = 0; i < count; i++) {
+        count_deallocation(manager, cache, blocks[i]->size);
+        if (pool->reset != NULL) {
+            pool->reset(blocks[i]->ptr, pool->hook_context);
+        }
+        atomic_store_explicit(&blocks[i]->ref_count, 0, memory_order_relaxed);
+    }
+
+    // The thread's own bins take blocks one at a time without locking
+    if (!frees_remotely(cache, pool) && (pool->arena->cpu_caches != NULL || cache->arena == pool->arena)) {
+        for (size_t i = 0; i < count; i++) {
+            release_pool_block(manager, blocks[i]);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        blocks[i]->next = blocks[i + 1];
+    }
+    if (frees_remotely(cache, pool)) {
+        push_remote_frees(pool, blocks[0], blocks[count - 1]);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    blocks[count - 1]->next = pool->free_list;
+    pool->free_list = blocks[0];
+    pool->free_count += count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Free blocks grouped by pool, so each pool is touched once
+static void free_blocks_grouped(ThreadCache* cache, MemBlock** blocks, size_t count) {
+    qsort(blocks, count, sizeof(MemBlock*), compare_block_pools);
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+        while (i + run < count && blocks[i + run]->pool == blocks[i]->pool) {
+            run++;
+        }
+        if (blocks[i]->pool == NULL) {
+            for (size_t j = i; j < i + run; j++) {
+                deallocate_block(cache->manager, blocks[j]);
+            }
+        } else {
+            release_pool_run(cache->manager, cache, &blocks[i], run);
+        }
+        i += run;
+    }
+}
+
+// Apply a thread's logged decrements, then free the blocks that reached zero grouped by pool
+static void apply_deferred_decrements(ThreadCache* cache) {
+    MemBlock* freed[DEFERRED_LOG_SIZE];
+    size_t freed_count = 0;
+
+    for (size_t i = 0; i < cache->deferred_count; i++) {
+        MemBlock* block = find_block(cache->deferred[i]);
+        if (block != NULL && atomic_fetch_sub_explicit(&block->ref_count, 1, memory_order_acq_rel) == 1) {
+            freed[freed_count++] = block;
+        }
+    }
+    cache->deferred_count = 0;
+    free_blocks_grouped(cache, freed, freed_count);
+}
+
+// Enter an epoch critical section; blocks retired from now on stay valid until the matching exit
+void epoch_enter(MemoryManager* manager) {
+    ThreadCache* cache = get_thread_cache(manager);
+    if (cache == NULL || cache->epoch_depth++ > 0) {
+        return;
+    }
+    size_t epoch = atomic_load(&manager->global_epoch);
+    atomic_store(&cache->epoch, epoch * 2 + 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Leave an epoch critical section
+void epoch_exit(MemoryManager* manager) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache == NULL || cache->epoch_depth == 0 || --cache->epoch_depth > 0) {
+        return;
+    }
+    atomic_store_explicit(&cache->epoch, 0, memory_order_release);
+}
+
+// Advance the global epoch if every thread inside a critical section has seen it; returns the epoch
+static size_t try_advance_epoch(MemoryManager* manager) {
+    size_t epoch = atomic_load(&manager->global_epoch);
+    pthread_mutex_lock(&manager->lock);
+    for (ThreadCache* cache = manager->caches; cache != NULL; cache = cache->next) {
+        size_t local = atomic_load(&cache->epoch);
+        if (local != 0 && local != epoch * 2 + 1) {
+            pthread_mutex_unlock(&manager->lock);
+            return epoch;
+        }
+    }
+    pthread_mutex_unlock(&manager->lock);
+
+    if (atomic_compare_exchange_strong(&manager->global_epoch, &epoch, epoch + 1)) {
+        epoch++;
+    }
+    return epoch;
+}
+
+// Deallocate a chain of retired blocks in batches grouped by pool
+static void free_retired_chain(ThreadCache* cache, MemBlock* block) {
+    MemBlock* batch[DEFERRED_LOG_SIZE];
+    while (block != NULL) {
+        size_t count = 0;
+        while (block != NULL && count < DEFERRED_LOG_SIZE) {
+            batch[count++] = block;
+            block = block->next;
+        }
+        free_blocks_grouped(cache, batch, count);
+    }
+}
+
+// Free the thread's limbo lists that no critical section can still reach
+static void reclaim_limbo(ThreadCache* cache, size_t epoch) {
+    for (int i = 0; i < 3; i++) {
+        if (cache->limbo[i] != NULL && cache->limbo_epoch[i] + 2 <= epoch) {
+            MemBlock* chain = cache->limbo[i];
+            cache->limbo[i] = NULL;
+            free_retired_chain(cache, chain);
+        }
+    }
+}
+
+// Deallocate a block once every thread has left the critical sections that might still use it
+void retire_memory(MemoryManager* manager, void* ptr) {
+    MemBlock* block = find_block(ptr);
+    if (block == NULL) {
+        return;
+    }
+
+    ThreadCache* cache = get_thread_cache(manager);
+    size_t epoch = atomic_load(&manager->global_epoch);
+    if (cache == NULL) {
+        // Without a thread cache, park the block with the orphans of exited threads
+        pthread_mutex_lock(&manager->lock);
+        block->next = manager->orphans;
+        manager->orphans = block;
+        manager->orphan_epoch = epoch;
+        pthread_mutex_unlock(&manager->lock);
+        return;
+    }
+
+    // A slot still holding an older epoch was retired at least three epochs ago
+    int slot = (int)(epoch % 3);
+    if (cache->limbo[slot] != NULL && cache->limbo_epoch[slot] != epoch) {
+        MemBlock* chain = cache->limbo[slot];
+        cache->limbo[slot] = NULL;
+        free_retired_chain(cache, chain);
+    }
+    block->next = cache->limbo[slot];
+    cache->limbo[slot] = block;
+    cache->limbo_epoch[slot] = epoch;
+
+    if (++cache->retired_since_reclaim >= EPOCH_RECLAIM_INTERVAL) {
+        cache->retired_since_reclaim = 0;
+        reclaim_limbo(cache, try_advance_epoch(manager));
+    }
+}
+
+// Try to advance the epoch and free every retired block that is no longer reachable
+void epoch_reclaim(MemoryManager* manager) {
+    ThreadCache* cache = get_thread_cache(manager);
+    size_t epoch = try_advance_epoch(manager);
+    if (cache == NULL) {
+        return;
+    }
+    cache->retired_since_reclaim = 0;
+    reclaim_limbo(cache, epoch);
+
+    pthread_mutex_lock(&manager->lock);
+    MemBlock* orphans = NULL;
+    if (manager->orphans != NULL && manager->orphan_epoch + 2 <= epoch) {
+        orphans = manager->orphans;
+        manager->orphans = NULL;
+    }
+    pthread_mutex_unlock(&manager->lock);
+    free_retired_chain(cache, orphans);
+}
+
+// Hand an exiting thread's retired blocks to the manager
+static void orphan_retired_blocks(ThreadCache* cache) {
+    MemoryManager* manager = cache->manager;
+    pthread_mutex_lock(&manager->lock);
+    for (int i = 0; i < 3; i++) {
+        while (cache->limbo[i] != NULL) {
+            MemBlock* block = cache->limbo[i];
+            cache->limbo[i] = block->next;
+            block->next = manager->orphans;
+            manager->orphans = block;
+        }
+        if (cache->limbo_epoch[i] > manager->orphan_epoch) {
+            manager->orphan_epoch = cache->limbo_epoch[i];
+        }
+    }
+    pthread_mutex_unlock(&manager->lock);
+    atomic_store(&cache->epoch, 0);
+}
+
+// Publish a hazard pointer to what source points to, retrying until source still holds it afterwards
+void* hazard_protect(MemoryManager* manager, int slot, void* _Atomic* source) {
+    ThreadCache* cache = get_thread_cache(manager);
+    void* ptr = atomic_load(source);
+    if (cache == NULL || slot < 0 || slot >= HAZARD_SLOTS) {
+        return NULL;
+    }
+    for (;;) {
+        atomic_store(&cache->hazards[slot], ptr);
+        void* again = atomic_load(source);
+        if (again == ptr) {
+            return ptr;
+        }
+        ptr = again;
+    }
+}
+
+// Drop a hazard pointer
+void hazard_clear(MemoryManager* manager, int slot) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache != NULL && slot >= 0 && slot < HAZARD_SLOTS) {
+        atomic_store_explicit(&cache->hazards[slot], NULL, memory_order_release);
+    }
+}
+
+// Order pointers by address
+static int compare_pointers(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(void* const*)a;
+    uintptr_t y = (uintptr_t)*(void* const*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Check whether a sorted hazard array holds the block
+static int is_hazardous(void** hazards, size_t count, MemBlock* block) {
+    return bsearch(&block->ptr, hazards, count, sizeof(void*), compare_pointers) != NULL;
+}
+
+// Free every retired block of the thread, and of exited threads, that no hazard pointer protects
+static void scan_hazards(ThreadCache* cache) {
+    MemoryManager* manager = cache->manager;
+    pthread_mutex_lock(&manager->lock);
+    size_t capacity = 0;
+    for (ThreadCache* other = manager->caches; other != NULL; other = other->next) {
+        capacity += HAZARD_SLOTS;
+    }
+    void** hazards = (void**)malloc((capacity > 0 ? capacity : 1) * sizeof(void*));
+    if (hazards == NULL) {
+        pthread_mutex_unlock(&manager->lock);
+        return; // Try again at the next scan
+    }
+    size_t hazard_count = 0;
+    for (ThreadCache* other = manager->caches; other != NULL; other = other->next) {
+        for (int i = 0; i < HAZARD_SLOTS; i++) {
+            void* ptr = atomic_load(&other->hazards[i]);
+            if (ptr != NULL) {
+                hazards[hazard_count++] = ptr;
+            }
+        }
+    }
+    MemBlock* orphans = manager->hazard_orphans;
+    manager->hazard_orphans = NULL;
+    pthread_mutex_unlock(&manager->lock);
+    qsort(hazards, hazard_count, sizeof(void*), compare_pointers);
+
+    // Keep the protected blocks in place and free the rest together
+    MemBlock* freed[HAZARD_RETIRED_MAX];
+    size_t freed_count = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < cache->hazard_retired_count; i++) {
+        MemBlock* block = cache->hazard_retired[i];
+        if (is_hazardous(hazards, hazard_count, block)) {
+            cache->hazard_retired[kept++] = block;
+        } else {
+            freed[freed_count++] = block;
+        }
+    }
+    cache->hazard_retired_count = kept;
+    free_blocks_grouped(cache, freed, freed_count);
+
+    MemBlock* still_protected = NULL;
+    while (orphans != NULL) {
+        freed_count = 0;
+        while (orphans != NULL && freed_count < HAZARD_RETIRED_MAX) {
+            MemBlock* block = orphans;
+            orphans = block->next;
+            if (is_hazardous(hazards, hazard_count, block)) {
+                block->next = still_protected;
+                still_protected = block;
+            } else {
+                freed[freed_count++] = block;
+            }
+        }
+        free_blocks_grouped(cache, freed, freed_count);
+    }
+    free(hazards);
+
+    if (still_protected != NULL) {
+        pthread_mutex_lock(&manager->lock);
+        while (still_protected != NULL) {
+            MemBlock* block = still_protected;
+            still_protected = block->next;
+            block->next = manager->hazard_orphans;
+            manager->hazard_orphans = block;
+        }
+        pthread_mutex_unlock(&manager->lock);
+    }
+}
+
+// Deallocate a block once no hazard pointer protects it
+void hazard_retire(MemoryManager* manager, void* ptr) {
+    MemBlock* block = find_block(ptr);
+    if (block == NULL) {
+        return;
+    }
+
+    ThreadCache* cache = get_thread_cache(manager);
+    if (cache == NULL) {
+        pthread_mutex_lock(&manager->lock);
+        block->next = manager->hazard_orphans;
+        manager->hazard_orphans = block;
+        pthread_mutex_unlock(&manager->lock);
+        return;
+    }
+
+    // The list never outgrows its bound: wait for readers when every entry is still protected
+    while (cache->hazard_retired_count == HAZARD_RETIRED_MAX) {
+        scan_hazards(cache);
+        if (cache->hazard_retired_count == HAZARD_RETIRED_MAX) {
+            sched_yield();
+        }
+    }
+    cache->hazard_retired[cache->hazard_retired_count++] = block;
+
+    if (cache->hazard_retired_count >= cache->hazard_next_scan) {
+        scan_hazards(cache);
+        cache->hazard_next_scan = cache->hazard_retired_count + HAZARD_SCAN_THRESHOLD;
+        if (cache->hazard_next_scan > HAZARD_RETIRED_MAX) {
+            cache->hazard_next_scan = HAZARD_RETIRED_MAX;
+        }
+    }
+}
+
+// Free the retired blocks that are no longer protected
+void hazard_reclaim(MemoryManager* manager) {
+    ThreadCache* cache = get_thread_cache(manager);
+    if (cache != NULL) {
+        scan_hazards(cache);
+    }
+}
+
+// Hand an exiting thread's retired blocks to the manager and drop its hazard pointers
+static void orphan_hazard_blocks(ThreadCache* cache) {
+    MemoryManager* manager = cache->manager;
+    pthread_mutex_lock(&manager->lock);
+    for (int i = 0; i < HAZARD_SLOTS; i++) {
+        atomic_store(&cache->hazards[i], NULL);
+    }
+    while (cache->hazard_retired_count > 0) {
+        MemBlock* block = cache->hazard_retired[--cache->hazard_retired_count];
+        block->next = manager->hazard_orphans;
+        manager->hazard_orphans = block;
+    }
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Return a block to its pool, or to the system for heap blocks
+static void deallocate_block(MemoryManager* manager, MemBlock* block) {
+    ThreadCache* cache = get_thread_cache(manager);
+    count_deallocation(manager, cache, block->size);
+
+    GuardSlot* slot = guarded_slot(manager, block);
+    if (slot != NULL) {
+        free_guarded(manager, slot);
+        return;
+    }
+
+    if (block->pool != NULL) {
+        if (block->pool->reset != NULL) {
+            block->pool->reset(block->ptr, block->pool->hook_context);
+        }
+        atomic_store_explicit(&block->ref_count, 0, memory_order_relaxed);
+        release_pool_block(manager, block);
+        return;
+    }
+
+    MemArena* arena = block->arena;
+    pthread_mutex_lock(&arena->lock);
+    unregister_block_locked(arena, block);
+    pthread_mutex_unlock(&arena->lock);
+
+    release_heap_memory(arena, block->raw, block->map_size, block->fd);
+    free(block);
+}
+
+// Deallocate memory
+void deallocate_memory(MemoryManager* manager, void* ptr) {
+    MemBlock* block = find_block(ptr);
+    if (block != NULL && atomic_load_explicit(&block->ref_count, memory_order_relaxed) > 0) {
+        deallocate_block(manager, block);
+    }
+}
+
+// Reallocate memory
+void* reallocate_memory(MemoryManager* manager, void* ptr, size_t new_size, size_t alignment) {
+    MemBlock* current = find_block(ptr);
+    if (current == NULL) {
+        return NULL; // ptr not found
+    }
+
+    // Guarded blocks always move, so the old page is protected and catches stale pointers
+    if (guarded_slot(manager, current) != NULL) {
+        void* moved = allocate_memory_at(manager, NULL, new_size, alignment, current->site);
+        if (moved == NULL) {
+            return NULL; // Allocation failed
+        }
+        MemBlock* block = find_block(moved);
+        copy_bytes(moved, current->ptr, current->size < new_size ? current->size : new_size);
+        atomic_store_explicit(&block->ref_count, atomic_load_explicit(&current->ref_count, memory_order_relaxed), memory_order_relaxed);
+        deallocate_block(manager, current);
+        return moved;
+    }
+
+    // Pool blocks cannot be resized in place, so move the data to a new block in the same arena
+    if (current->pool != NULL) {
+        if (new_size <= current->pool->block_size && current->pool->alignment >= alignment) {
+            pthread_mutex_lock(&manager->lock);
+            manager->stats.bytes_in_use += new_size - current->size;
+            pthread_mutex_unlock(&manager->lock);
+            current->size = new_size;
+            return current->ptr;
+        }
+
+        ThreadCache* cache = get_thread_cache(manager);
+        MemBlock* block = allocate_from_pools(manager, current->arena, cache, new_size, alignment);
+        if (block == NULL) {
+            block = allocate_from_heap(manager, current->arena, cache, new_size, alignment);
+        }
+        if (block == NULL) {
+            return NULL; // Allocation failed
+        }
+
+        copy_bytes(block->ptr, current->ptr, current->size < new_size ? current->size : new_size);
+        atomic_store_explicit(&block->ref_count, atomic_load_explicit(&current->ref_count, memory_order_relaxed), memory_order_relaxed);
+        block->site = current->site;
+        deallocate_block(manager, current);
+        return block->ptr;
+    }
+
+    void* new_ptr;
+    uintptr_t aligned_ptr;
+    MemArena* arena = current->arena;
+    int mapped = manager->mmap_threshold != 0 && new_size >= manager->mmap_threshold;
+    int buddy = current->map_size == 0 && buddy_owns(arena, current->raw);
+    size_t header = (size_t)((char*)current->ptr - (char*)current->raw);
+    if (buddy && !mapped && alignment <= current->alignment && header + new_size <= BUDDY_MAX_BLOCK &&
+        ((size_t)1 << buddy_order(header + new_size)) == buddy_block_size(arena, current->raw)) {
+        // A buddy block stays in place while the new size needs the same order
+        new_ptr = current->raw;
+        aligned_ptr = (uintptr_t)current->ptr;
+        alignment = current->alignment;
+    } else if (current->map_size != 0 || buddy || mapped || manager->heap_backend == HEAP_BACKEND_TLSF ||
+               (manager->heap_backend == HEAP_BACKEND_BUDDY && fits_buddy(new_size, alignment))) {
+        // Mapped, buddy and TLSF blocks move to fresh memory from whichever source suits the new size
+        size_t map_size;
+        int fd;
+        aligned_ptr = (uintptr_t)reserve_heap_memory(manager, arena, new_size, alignment, &new_ptr, &map_size, &fd);
+        if (aligned_ptr == 0) {
+            return NULL; // Allocation failed
+        }
+        copy_bytes((void*)aligned_ptr, current->ptr, current->size < new_size ? current->size : new_size);
+        release_heap_memory(arena, current->raw, current->map_size, current->fd);
+        current->map_size = map_size;
+        current->fd = fd;
+    } else {
+        if (alignment < BLOCK_HEADER_SIZE) {
+            alignment = BLOCK_HEADER_SIZE;
+        }
+        size_t offset = (char*)current->ptr - (char*)current->raw;
+        new_ptr = realloc(current->raw, BLOCK_HEADER_SIZE + new_size + alignment - 1);
+        if (new_ptr == NULL) {
+            return NULL; // realloc failed
+        }
+
+        aligned_ptr = (uintptr_t)new_ptr + BLOCK_HEADER_SIZE;
+        aligned_ptr = (aligned_ptr + alignment - 1) & ~(alignment - 1); // Align the pointer
+
+        // realloc keeps the data at the old offset, which may no longer be aligned
+        if ((char*)aligned_ptr != (char*)new_ptr + offset) {
+            memmove((void*)aligned_ptr, (char*)new_ptr + offset, current->size < new_size ? current->size : new_size);
+        }
+    }
+    ((MemBlock**)aligned_ptr)[-1] = current;
+
+    pthread_mutex_lock(&manager->lock);
+    manager->stats.bytes_in_use += new_size - current->size;
+    if (manager->stats.bytes_in_use > manager->stats.peak_bytes_in_use) {
+        manager->stats.peak_bytes_in_use = manager->stats.bytes_in_use;
+    }
+    pthread_mutex_unlock(&manager->lock);
+    current->raw = new_ptr;
+    current->ptr = (void*)aligned_ptr;
+    current->size = new_size;
+    current->alignment = alignment > BLOCK_HEADER_SIZE ? alignment : BLOCK_HEADER_SIZE;
+    return current->ptr;
+}
+
+// Copy up to 16 bytes with two overlapping moves from each end
+static inline void copy_small(unsigned char* d, const unsigned char* s, size_t n) {
+    if (n >= 8) {
+        uint64_t head, tail;
+        memcpy(&head, s, 8);
+        memcpy(&tail, s + n - 8, 8);
+        memcpy(d, &head, 8);
+        memcpy(d + n - 8, &tail, 8);
+    } else if (n >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, s, 4);
+        memcpy(&tail, s + n - 4, 4);
+        memcpy(d, &head, 4);
+        memcpy(d + n - 4, &tail, 4);
+    } else if (n >= 2) {
+        uint16_t head, tail;
+        memcpy(&head, s, 2);
+        memcpy(&tail, s + n - 2, 2);
+        memcpy(d, &head, 2);
+        memcpy(d + n - 2, &tail, 2);
+    } else if (n == 1) {
+        d[0] = s[0];
+    }
+}
+
+// Bytes above which copies bypass the cache, set from the last-level cache size on first use
+static size_t copy_stream_threshold = COPY_STREAM_DEFAULT_THRESHOLD;
+
+#if COPY_ENGINE_X86
+// Copy with 16-byte SSE2 vectors
+static void copy_sse2(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    if (n <= 16) {
+        copy_small(d, s, n);
+        return;
+    }
+
+    // Up to 128 bytes: the same vectors from the front and the back, overlapping in the middle
+    if (n <= 128) {
+        size_t half = n <= 32 ? 1 : (n <= 64 ? 2 : 4);
+        __m128i v[8];
+        for (size_t i = 0; i < half; i++) {
+            v[i] = _mm_loadu_si128((const __m128i*)(s + 16 * i));
+            v[half + i] = _mm_loadu_si128((const __m128i*)(s + n - 16 * (i + 1)));
+        }
+        for (size_t i = 0; i < half; i++) {
+            _mm_storeu_si128((__m128i*)(d + 16 * i), v[i]);
+            _mm_storeu_si128((__m128i*)(d + n - 16 * (i + 1)), v[half + i]);
+        }
+        return;
+    }
+
+    // Align the destination; the unaligned head and tail are written last from saved vectors
+    __m128i head = _mm_loadu_si128((const __m128i*)s);
+    __m128i tail = _mm_loadu_si128((const __m128i*)(s + n - 16));
+    size_t skew = 16 - ((uintptr_t)d & 15);
+    unsigned char* out = d + skew;
+    const unsigned char* in = s + skew;
+    size_t left = n - skew;
+    if (n >= copy_stream_threshold) {
+        for (; left >= 64; left -= 64, in += 64, out += 64) {
+            _mm_stream_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)in));
+            _mm_stream_si128((__m128i*)(out + 16), _mm_loadu_si128((const __m128i*)(in + 16)));
+            _mm_stream_si128((__m128i*)(out + 32), _mm_loadu_si128((const __m128i*)(in + 32)));
+            _mm_stream_si128((__m128i*)(out + 48), _mm_loadu_si128((const __m128i*)(in + 48)));
+        }
+        _mm_sfence();
+    }
+    for (; left >= 64; left -= 64, in += 64, out += 64) {
+        _mm_store_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)in));
+        _mm_store_si128((__m128i*)(out + 16), _mm_loadu_si128((const __m128i*)(in + 16)));
+        _mm_store_si128((__m128i*)(out + 32), _mm_loadu_si128((const __m128i*)(in + 32)));
+        _mm_store_si128((__m128i*)(out + 48), _mm_loadu_si128((const __m128i*)(in + 48)));
+    }
+    for (; left >= 16; left -= 16, in += 16, out += 16) {
+        _mm_store_si128((__m128i*)out, _mm_loadu_si128((const __m128i*)in));
+    }
+    _mm_storeu_si128((__m128i*)d, head);
+    _mm_storeu_si128((__m128i*)(d + n - 16), tail);
+}
+
+// Copy with 32-byte AVX2 vectors
+__attribute__((target("avx2")))
+static void copy_avx2(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    if (n <= 16) {
+        copy_small(d, s, n);
+        return;
+    }
+    if (n <= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + n - 16));
+        _mm_storeu_si128((__m128i*)d, a);
+        _mm_storeu_si128((__m128i*)(d + n - 16), b);
+        return;
+    }
+    if (n <= 128) {
+        size_t half = n <= 64 ? 1 : 2;
+        __m256i v[4];
+        for (size_t i = 0; i < half; i++) {
+            v[i] = _mm256_loadu_si256((const __m256i*)(s + 32 * i));
+            v[half + i] = _mm256_loadu_si256((const __m256i*)(s + n - 32 * (i + 1)));
+        }
+        for (size_t i = 0; i < half; i++) {
+            _mm256_storeu_si256((__m256i*)(d + 32 * i), v[i]);
+            _mm256_storeu_si256((__m256i*)(d + n - 32 * (i + 1)), v[half + i]);
+        }
+        return;
+    }
+
+    __m256i head = _mm256_loadu_si256((const __m256i*)s);
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+    size_t skew = 32 - ((uintptr_t)d & 31);
+    unsigned char* out = d + skew;
+    const unsigned char* in = s + skew;
+    size_t left = n - skew;
+    if (n >= copy_stream_threshold) {
+        for (; left >= 128; left -= 128, in += 128, out += 128) {
+            _mm256_stream_si256((__m256i*)out, _mm256_loadu_si256((const __m256i*)in));
+            _mm256_stream_si256((__m256i*)(out + 32), _mm256_loadu_si256((const __m256i*)(in + 32)));
+            _mm256_stream_si256((__m256i*)(out + 64), _mm256_loadu_si256((const __m256i*)(in + 64)));
+            _mm256_stream_si256((__m256i*)(out + 96), _mm256_loadu_si256((const __m256i*)(in + 96)));
+        }
+        _mm_sfence();
+    }
+    for (; left >= 128; left -= 128, in += 128, out += 128) {
+        _mm256_store_si256((__m256i*)out, _mm256_loadu_si256((const __m256i*)in));
+        _mm256_store_si256((__m256i*)(out + 32), _mm256_loadu_si256((const __m256i*)(in + 32)));
+        _mm256_store_si256((__m256i*)(out + 64), _mm256_loadu_si256((const __m256i*)(in + 64)));
+        _mm256_store_si256((__m256i*)(out + 96), _mm256_loadu_si256((const __m256i*)(in + 96)));
+    }
+    for (; left >= 32; left -= 32, in += 32, out += 32) {
+        _mm256_store_si256((__m256i*)out, _mm256_loadu_si256((const __m256i*)in));
+    }
+    _mm256_storeu_si256((__m256i*)d, head);
+    _mm256_storeu_si256((__m256i*)(d + n - 32), tail);
+}
+
+// Copy with 64-byte AVX-512 vectors
+__attribute__((target("avx512f")))
+static void copy_avx512(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    if (n <= 16) {
+        copy_small(d, s, n);
+        return;
+    }
+    if (n <= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + n - 16));
+        _mm_storeu_si128((__m128i*)d, a);
+        _mm_storeu_si128((__m128i*)(d + n - 16), b);
+        return;
+    }
+    if (n <= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+        _mm256_storeu_si256((__m256i*)d, a);
+        _mm256_storeu_si256((__m256i*)(d + n - 32), b);
+        return;
+    }
+    if (n <= 128) {
+        __m512i a = _mm512_loadu_si512(s);
+        __m512i b = _mm512_loadu_si512(s + n - 64);
+        _mm512_storeu_si512(d, a);
+        _mm512_storeu_si512(d + n - 64, b);
+        return;
+    }
+
+    __m512i head = _mm512_loadu_si512(s);
+    __m512i tail = _mm512_loadu_si512(s + n - 64);
+    size_t skew = 64 - ((uintptr_t)d & 63);
+    unsigned char* out = d + skew;
+    const unsigned char* in = s + skew;
+    size_t left = n - skew;
+    if (n >= copy_stream_threshold) {
+        for (; left >= 256; left -= 256, in += 256, out += 256) {
+            _mm512_stream_si512((__m512i*)out, _mm512_loadu_si512(in));
+            _mm512_stream_si512((__m512i*)(out + 64), _mm512_loadu_si512(in + 64));
+            _mm512_stream_si512((__m512i*)(out + 128), _mm512_loadu_si512(in + 128));
+            _mm512_stream_si512((__m512i*)(out + 192), _mm512_loadu_si512(in + 192));
+        }
+        _mm_sfence();
+    }
+    for (; left >= 256; left -= 256, in += 256, out += 256) {
+        _mm512_store_si512(out, _mm512_loadu_si512(in));
+        _mm512_store_si512(out + 64, _mm512_loadu_si512(in + 64));
+        _mm512_store_si512(out + 128, _mm512_loadu_si512(in + 128));
+        _mm512_store_si512(out + 192, _mm512_loadu_si512(in + 192));
+    }
+    for (; left >= 64; left -= 64, in += 64, out += 64) {
+        _mm512_store_si512(out, _mm512_loadu_si512(in));
+    }
+    _mm512_storeu_si512(d, head);
+    _mm512_storeu_si512(d + n - 64, tail);
+}
+#endif
+
+// Copy with the C library, where no vector kernel applies
+static void copy_libc(void* dest, const void* src, size_t n) {
+    memcpy(dest, src, n);
+}
+
+// Copy kernel chosen for this CPU
+static void (*copy_kernel)(void* dest, const void* src, size_t n) = copy_libc;
+static const char* copy_kernel_name = "libc";
+static pthread_once_t copy_kernel_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel the CPU supports and size the streaming threshold to the last-level cache
+static void select_copy_kernel(void) {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0) {
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    if (llc > 0) {
+        copy_stream_threshold = (size_t)llc;
+    }
+#endif
+
+#if COPY_ENGINE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        copy_kernel = copy_avx512;
+        copy_kernel_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        copy_kernel = copy_avx2;
+        copy_kernel_name = "avx2";
+    } else {
+        copy_kernel = copy_sse2;
+        copy_kernel_name = "sse2";
+    }
+#endif
+}
+
+// Copy size bytes between non-overlapping buffers with the fastest kernel for this CPU
+void copy_bytes(void* dest, const void* src, size_t size) {
+    if (size <= 16) {
+        copy_small((unsigned char*)dest, (const unsigned char*)src, size);
+        return;
+    }
+    pthread_once(&copy_kernel_once, select_copy_kernel);
+    copy_kernel(dest, src, size);
+}
+
+// Get the name of the copy kernel in use
+const char* copy_engine_name(void) {
+    pthread_once(&copy_kernel_once, select_copy_kernel);
+    return copy_kernel_name;
+}
+
+// Seconds on a monotonic clock
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Time copy_bytes against memcpy for every power of two from 1 byte to max_size
+void benchmark_copy(FILE* out, size_t max_size) {
+    void* src = NULL;
+    void* dest = NULL;
+    if (posix_memalign(&src, 64, max_size + 64) != 0 || posix_memalign(&dest, 64, max_size + 64) != 0) {
+        free(src);
+        fprintf(out, "Copy benchmark: cannot allocate two %zu-byte buffers\n", max_size);
+        return;
+    }
+    memset(src, 0x5a, max_size + 64);
+    memset(dest, 0, max_size + 64);
+
+    fprintf(out, "Copy benchmark (%s kernel, streaming from %zu bytes)\n", copy_engine_name(), copy_stream_threshold);
+    fprintf(out, "%12s %14s %14s\n", "size", "copy_bytes", "memcpy");
+    for (size_t size = 1; size <= max_size; size *= 2) {
+        // Repeat small copies enough to be measurable, and offset the source to include unaligned cases
+        size_t rounds = ((size_t)256 << 20) / size;
+        if (rounds < 2) {
+            rounds = 2;
+        }
+        if (rounds > 1000000) {
+            rounds = 1000000;
+        }
+        const unsigned char* from = (const unsigned char*)src + (size < 64 ? 0 : 3);
+
+        double start = monotonic_seconds();
+        for (size_t i = 0; i < rounds; i++) {
+            copy_bytes(dest, from, size);
+            __asm__ __volatile__("" : : "r"(dest) : "memory");
+        }
+        double engine = monotonic_seconds() - start;
+
+        start = monotonic_seconds();
+        for (size_t i = 0; i < rounds; i++) {
+            memcpy(dest, from, size);
+            __asm__ __volatile__("" : : "r"(dest) : "memory");
+        }
+        double libc = monotonic_seconds() - start;
+
+        fprintf(out, "%12zu %10.2f GB/s %10.2f GB/s\n", size,
+                (double)size * rounds / engine / 1e9, (double)size * rounds / libc / 1e9);
+        if (size > max_size / 2) {
+            break; // Avoid overflowing size
+        }
+    }
+
+    free(src);
+    free(dest);
+}
+
+// Order latencies
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Print the mean and tail of a set of latencies, which is sorted in place; returns the p99.99 latency
+static double print_latencies(FILE* out, const char* name, const char* operation, double* latencies, size_t count) {
+    double total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += latencies[i];
+    }
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    double tail = latencies[count * 9999 / 10000];
+    fprintf(out, "%-8s %-10s %10.0f %10.0f %10.0f %10.0f %10.0f\n", name, operation, total / (double)count * 1e9,
+            latencies[count * 99 / 100] * 1e9, latencies[count * 999 / 1000] * 1e9, tail * 1e9, latencies[count - 1] * 1e9);
+    return tail;
+}
+
+// Time every allocation and free of a random workload on a manager with the given heap backend;
+// returns the worse p99.99 latency of the two operations
+static double benchmark_backend(FILE* out, const char* name, HeapBackend backend, size_t operations, double* allocate_times, double* free_times) {
+    MemoryManager* manager = create_memory_manager_backend(backend);
+    set_mmap_threshold(manager, 0); // Keep every heap block in the backend under test
+    for (size_t size = 32; size <= 1024; size *= 2) {
+        create_memory_pool(manager, size, HEAP_BENCHMARK_POOL_BLOCKS, 16); // Small, so allocations also walk exhausted pools
+    }
+
+    // The first pass only warms up, so that page faults on fresh memory do not count
+    void* live[HEAP_BENCHMARK_LIVE_BLOCKS] = {NULL};
+    size_t allocations = 0;
+    size_t frees = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL; // Same sequence for every backend
+        allocations = 0;
+        frees = 0;
+        for (size_t i = 0; i < operations; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            size_t slot = (size_t)(state % HEAP_BENCHMARK_LIVE_BLOCKS);
+            if (live[slot] != NULL) {
+                double start = monotonic_seconds();
+                deallocate_memory(manager, live[slot]);
+                free_times[frees++] = monotonic_seconds() - start;
+                live[slot] = NULL;
+            } else {
+                // Sizes spread evenly over the powers of two from 16 bytes up to HEAP_BENCHMARK_MAX_SIZE
+                size_t bits = 4 + (size_t)((state >> 20) % 14);
+                size_t size = ((size_t)1 << bits) + (size_t)((state >> 32) & (((size_t)1 << bits) - 1));
+                double start = monotonic_seconds();
+                live[slot] = allocate_memory(manager, size, 16);
+                allocate_times[allocations++] = monotonic_seconds() - start;
+            }
+        }
+    }
+    for (size_t slot = 0; slot < HEAP_BENCHMARK_LIVE_BLOCKS; slot++) {
+        deallocate_memory(manager, live[slot]);
+    }
+    free_memory_manager(manager);
+
+    double allocate_tail = print_latencies(out, name, "allocate", allocate_times, allocations);
+    double free_tail = print_latencies(out, name, "free", free_times, frees);
+    return allocate_tail > free_tail ? allocate_tail : free_tail;
+}
+
+// Benchmark allocation latency of each heap backend against the malloc backend, the list-walk path
+// they replace; returns -1 when the worst case of TLSF is not within HEAP_BENCHMARK_TAIL_BOUND of it
+int benchmark_heap_latency(FILE* out, size_t operations) {
+    double* allocate_times = (double*)malloc(operations * sizeof(double));
+    double* free_times = (double*)malloc(operations * sizeof(double));
+    if (operations == 0 || allocate_times == NULL || free_times == NULL) {
+        free(allocate_times);
+        free(free_times);
+        fprintf(out, "Heap latency benchmark: cannot record %zu operations\n", operations);
+        return -1;
+    }
+
+    fprintf(out, "Heap latency benchmark (%zu operations, up to %zu live blocks of 16 bytes to %zu KiB)\n",
+            operations, (size_t)HEAP_BENCHMARK_LIVE_BLOCKS, (size_t)HEAP_BENCHMARK_MAX_SIZE >> 10);
+    fprintf(out, "%-8s %-10s %10s %10s %10s %10s %10s\n", "backend", "operation", "mean ns", "p99 ns", "p99.9 ns", "p99.99 ns", "max ns");
+    double baseline = benchmark_backend(out, "malloc", HEAP_BACKEND_MALLOC, operations, allocate_times, free_times);
+    double buddy = benchmark_backend(out, "buddy", HEAP_BACKEND_BUDDY, operations, allocate_times, free_times);
+    double tlsf = benchmark_backend(out, "tlsf", HEAP_BACKEND_TLSF, operations, allocate_times, free_times);
+    free(allocate_times);
+    free(free_times);
+
+    // The maximum is left out: it measures preemption by the scheduler more than the allocator
+    int bounded = tlsf <= baseline * HEAP_BENCHMARK_TAIL_BOUND;
+    fprintf(out, "Worst case (p99.99) against malloc: buddy %.2fx, tlsf %.2fx (bound %.2fx): %s\n",
+            buddy / baseline, tlsf / baseline, HEAP_BENCHMARK_TAIL_BOUND, bounded ? "ok" : "FAILED");
+    return bounded ? 0 : -1;
+}
+
+// Copy memory into a new block allocated on behalf of site
+static void* copy_memory_at(MemoryManager* manager, void* src, size_t size, const void* site) {
+    void* dest = allocate_memory_at(manager, NULL, size, sizeof(char), site); // Align to char (byte) alignment
+    if (dest == NULL) {
+        return NULL; // Allocation failed
+    }
+
+    copy_bytes(dest, src, size);
+    return dest;
+}
+
+// Copy memory
+void* copy_memory(MemoryManager* manager, void* src, size_t size) {
+    return copy_memory_at(manager, src, size, CALLER_ADDRESS());
+}
+
+// Copy memory with the given alignment; 0 keeps the source block's alignment
+void* copy_memory_aligned(MemoryManager* manager, void* src, size_t size, size_t alignment) {
+    MemBlock* source = find_block(src);
+    if (alignment == 0) {
+        alignment = source != NULL ? source->alignment : sizeof(char);
+    }
+
+    // A pooled source names its size class: use the same pool, or its twin in this thread's arena
+    if (source != NULL && source->pool != NULL) {
+        ThreadCache* cache = get_thread_cache(manager);
+        MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+        MemPool* pool = source->pool;
+        if (pool->arena != arena) {
+            pthread_mutex_lock(&arena->lock);
+            MemPool* twin = pool->class_index < arena->pool_count ? arena->pool_table[pool->class_index] : NULL;
+            pthread_mutex_unlock(&arena->lock);
+            pool = twin != NULL && twin->block_size == pool->block_size && twin->alignment == pool->alignment ? twin : NULL;
+        }
+        if (pool != NULL && !pool->typed && size <= pool->block_size && alignment <= pool->alignment) {
+            MemBlock* block = allocate_in_pool(manager, cache, pool, size);
+            if (block != NULL) {
+                sample_allocation_site(manager, cache, block, CALLER_ADDRESS());
+                copy_bytes(block->ptr, src, size);
+                return block->ptr;
+            }
+        }
+    }
+
+    void* dest = allocate_memory_at(manager, NULL, size, alignment, CALLER_ADDRESS());
+    if (dest == NULL) {
+        return NULL; // Allocation failed
+    }
+
+    copy_bytes(dest, src, size);
+    return dest;
+}
+
+// Copy every request into dests, allocating all destinations before copying with the next sources prefetched;
+// with contiguous set, the copies share one block that is freed through dests[0]
+int copy_memory_batch(MemoryManager* manager, const CopyRequest* requests, size_t count, void** dests, int contiguous) {
+    if (count == 0) {
+        return 0;
+    }
+
+    if (contiguous) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (requests[i].size > SIZE_MAX - (COPY_BATCH_ALIGNMENT - 1)) {
+                return -1; // Size overflow
+            }
+            size_t padded = (requests[i].size + COPY_BATCH_ALIGNMENT - 1) & ~(size_t)(COPY_BATCH_ALIGNMENT - 1);
+            if (padded > SIZE_MAX - total) {
+                return -1; // Size overflow
+            }
+            total += padded;
+        }
+        char* base = (char*)allocate_memory_at(manager, NULL, total, COPY_BATCH_ALIGNMENT, CALLER_ADDRESS());
+        if (base == NULL) {
+            return -1; // Allocation failed
+        }
+        for (size_t i = 0; i < count; i++) {
+            dests[i] = base;
+            base += (requests[i].size + COPY_BATCH_ALIGNMENT - 1) & ~(size_t)(COPY_BATCH_ALIGNMENT - 1);
+        }
+    } else {
+        // Look the thread's cache and arena up once, and reuse the pool of the previous request when the size repeats
+        ThreadCache* cache = get_thread_cache(manager);
+        MemArena* arena = cache != NULL ? cache->arena : manager->arenas[0];
+        MemPool* last_pool = NULL;
+        size_t last_size = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t size = requests[i].size;
+            MemBlock* block = NULL;
+            if (last_pool != NULL && size == last_size) {
+                block = allocate_in_pool(manager, cache, last_pool, size);
+            }
+            if (block == NULL) {
+                block = allocate_from_pools(manager, arena, cache, size, sizeof(char));
+            }
+            last_pool = block != NULL ? block->pool : NULL;
+            last_size = size;
+            if (block == NULL) {
+                block = allocate_from_heap(manager, arena, cache, size, sizeof(char));
+            }
+            if (block == NULL) {
+                for (size_t j = 0; j < i; j++) {
+                    deallocate_memory(manager, dests[j]);
+                }
+                return -1; // Allocation failed
+            }
+            sample_allocation_site(manager, cache, block, CALLER_ADDRESS());
+            dests[i] = block->ptr;
+        }
+    }
+
+    for (size_t i = 0; i < count && i < COPY_BATCH_PREFETCH_DISTANCE; i++) {
+        PREFETCH(requests[i].src);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (i + COPY_BATCH_PREFETCH_DISTANCE < count) {
+            const CopyRequest* ahead = &requests[i + COPY_BATCH_PREFETCH_DISTANCE];
+            PREFETCH(ahead->src);
+            if (ahead->size > 64) {
+                PREFETCH((const char*)ahead->src + 64);
+            }
+        }
+        copy_bytes(dests[i], requests[i].src, requests[i].size);
+    }
+    return 0;
+}
+
+// Copy memory, sharing the pages of large memfd-backed blocks (cow_blocks) until either side writes to them
+void* copy_memory_cow(MemoryManager* manager, void* src, size_t size) {
+    MemBlock* source = find_block(src);
+    if (source == NULL || source->map_size == 0 || size > source->size ||
+        manager->mmap_threshold == 0 || size < manager->mmap_threshold) {
+        return copy_memory_at(manager, src, size, CALLER_ADDRESS());
+    }
+
+    MemBlock* block = (MemBlock*)malloc(sizeof(MemBlock));
+    if (block == NULL) {
+        return NULL; // Allocation failed
+    }
+
+    // Map the file privately for the copy, then switch the source to a private mapping of the same file,
+    // so the file stops changing and both sides copy a page only when they first write to it
+    MemArena* arena = source->arena;
+    pthread_mutex_lock(&arena->lock);
+    void* map = MAP_FAILED;
+    if (source->fd >= 0) {
+        map = mmap(NULL, source->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, source->fd, 0);
+        if (map != MAP_FAILED &&
+            mmap(source->raw, source->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, source->fd, 0) == MAP_FAILED) {
+            munmap(map, source->map_size);
+            map = MAP_FAILED;
+        }
+        if (map != MAP_FAILED) {
+            close(source->fd);
+            source->fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    // A source that was already shared once holds private pages the file does not have
+    if (map == MAP_FAILED) {
+        free(block);
+        return copy_memory_at(manager, src, size, CALLER_ADDRESS());
+    }
+
+    block->size = size;
+    block->alignment = source->alignment;
+    block->ptr = (char*)map + ((char*)source->ptr - (char*)source->raw);
+    block->raw = map;
+    block->map_size = source->map_size;
+    block->fd = -1;
+    atomic_init(&block->ref_count, 1); // Initial reference count is 1
+    block->site = NULL;
+    block->pool = NULL;
+    block->arena = arena;
+    block->next = NULL;
+    ((MemBlock**)block->ptr)[-1] = block; // Copies the first page
+
+    pthread_mutex_lock(&arena->lock);
+    int registered = register_block_locked(arena, block);
+    pthread_mutex_unlock(&arena->lock);
+    if (registered != 0) {
+        munmap(map, block->map_size);
+        free(block);
+        return NULL;
+    }
+
+    ThreadCache* cache = get_thread_cache(manager);
+    count_allocation(manager, cache, size, 0);
+    sample_allocation_site(manager, cache, block, CALLER_ADDRESS());
+    return block->ptr;
+}
+
+// Set the size from which heap blocks are mmap-backed (0 = never)
+void set_mmap_threshold(MemoryManager* manager, size_t threshold) {
+    pthread_mutex_lock(&manager->lock);
+    manager->mmap_threshold = threshold;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Take every lock of the manager before fork, in the order the code nests them: manager, then per arena
+// the arena, its pools, its CPU caches and its backend, then the guarded pool
+void lock_manager_for_fork(MemoryManager* manager) {
+    pthread_mutex_lock(&manager->lock);
+    for (size_t a = 0; a < manager->arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        for (size_t i = 0; i < arena->pool_count; i++) {
+            pthread_mutex_lock(&arena->pool_table[i]->lock);
+        }
+        if (arena->cpu_caches != NULL) {
+            for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+                pthread_mutex_lock(&arena->cpu_caches[cpu].lock);
+            }
+        }
+        pthread_mutex_lock(&arena->backend_lock);
+    }
+    GuardPool* guard = atomic_load(&manager->guard);
+    if (guard != NULL) {
+        pthread_mutex_lock(&guard->lock);
+    }
+}
+
+// Release a lock taken before fork; in the child it is reinitialized, since only the forking thread exists there
+static void release_fork_lock(pthread_mutex_t* lock, int child) {
+    if (child) {
+        pthread_mutex_init(lock, NULL);
+    } else {
+        pthread_mutex_unlock(lock);
+    }
+}
+
+// Release the locks taken by lock_manager_for_fork, in reverse order
+static void release_manager_after_fork(MemoryManager* manager, int child) {
+    GuardPool* guard = atomic_load(&manager->guard);
+    if (guard != NULL) {
+        release_fork_lock(&guard->lock, child);
+    }
+    for (size_t a = manager->arena_count; a > 0; a--) {
+        MemArena* arena = manager->arenas[a - 1];
+        release_fork_lock(&arena->backend_lock, child);
+        if (arena->cpu_caches != NULL) {
+            for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+                release_fork_lock(&arena->cpu_caches[cpu].lock, child);
+            }
+        }
+        for (size_t i = 0; i < arena->pool_count; i++) {
+            release_fork_lock(&arena->pool_table[i]->lock, child);
+        }
+        release_fork_lock(&arena->lock, child);
+    }
+    release_fork_lock(&manager->lock, child);
+}
+
+// Release the manager's locks in the parent after fork
+void unlock_manager_after_fork(MemoryManager* manager) {
+    release_manager_after_fork(manager, 0);
+}
+
+// Reinitialize the manager's locks in the child after fork. The caches of threads that did not fork
+// stay on the cache list, so the blocks they held stay out of use in the child.
+void reset_manager_after_fork(MemoryManager* manager) {
+    release_manager_after_fork(manager, 1);
+}
+
+// Apply the deferred decrements every thread still has logged; no other thread may use the manager.
+// Each log is applied with its cache current, as at thread exit, and outside the manager lock,
+// because the frees it makes take the lock themselves.
+static void apply_all_deferred_decrements(MemoryManager* manager) {
+    ThreadCache* current = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    for (;;) {
+        pthread_mutex_lock(&manager->lock);
+        ThreadCache* cache = manager->caches;
+        while (cache != NULL && cache->deferred_count == 0) {
+            cache = cache->next;
+        }
+        pthread_mutex_unlock(&manager->lock);
+        if (cache == NULL) {
+            break;
+        }
+        pthread_setspecific(manager->cache_key, cache);
+        apply_deferred_decrements(cache);
+    }
+    pthread_setspecific(manager->cache_key, current);
+}
+
+// Free memory manager
+void free_memory_manager(MemoryManager* manager) {
+    apply_all_deferred_decrements(manager);
+    if (manager->report_leaks_on_free) {
+        report_leaks(manager, stderr);
+    }
+
+    // Thread caches only hold pool blocks, which are freed with their pool below
+    pthread_key_delete(manager->cache_key);
+    ThreadCache* cache = manager->caches;
+    while (cache != NULL) {
+        ThreadCache* next_cache = cache->next;
+        free(cache);
+        cache = next_cache;
+    }
+
+    for (size_t a = 0; a < manager->arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+
+        // Per-CPU caches also only hold pool blocks
+        if (arena->cpu_caches != NULL) {
+            for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+                pthread_mutex_destroy(&arena->cpu_caches[cpu].lock);
+            }
+            free(arena->cpu_caches);
+        }
+
+        for (size_t i = 0; i < arena->block_count; i++) {
+            MemBlock* block = arena->blocks[i];
+            release_heap_memory(arena, block->raw, block->map_size, block->fd);
+            free(block);
+        }
+        free(arena->blocks);
+
+        BuddyRegion* region = atomic_load(&arena->buddy);
+        if (region != NULL) {
+            munmap(region->base, BUDDY_REGION_SIZE);
+            free(region);
+        }
+        free_tlsf_heap(arena);
+        pthread_mutex_destroy(&arena->backend_lock);
+
+        for (size_t i = 0; i < arena->pool_count; i++) {
+            MemPool* pool = arena->pool_table[i];
+            pthread_mutex_destroy(&pool->lock);
+            if (pool->slab_size != 0) {
+                munmap(pool->slab, pool->slab_size);
+            } else {
+                free(pool->slab);
+            }
+            free(pool->blocks);
+            free(pool);
+        }
+
+        pthread_mutex_destroy(&arena->lock);
+        free(arena);
+    }
+
+    free_guard_pool(manager);
+    pthread_mutex_destroy(&manager->lock);
+    free(manager);
+}
+
+// Print memory blocks
+void print_memory_blocks(MemoryManager* manager) {
+    printf("Current Memory Blocks:\n");
+    size_t printed = 0;
+    for (size_t a = 0; a < manager->arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        for (size_t i = arena->block_count; i > 0; i--) {
+            MemBlock* current = arena->blocks[i - 1];
+            printf("Block at %p, size: %zu bytes, ref_count: %d\n", current->ptr, current->size, atomic_load(&current->ref_count));
+            printed++;
+        }
+        for (size_t p = 0; p < arena->pool_count; p++) {
+            MemPool* pool = arena->pool_table[p];
+            for (size_t i = 0; i < pool->block_count; i++) {
+                MemBlock* current = &pool->blocks[i];
+                int ref_count = atomic_load(&current->ref_count);
+                if (ref_count > 0) {
+                    printf("Block at %p, size: %zu bytes, ref_count: %d\n", current->ptr, current->size, ref_count);
+                    printed++;
+                }
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    GuardPool* guard = atomic_load(&manager->guard);
+    if (guard != NULL) {
+        pthread_mutex_lock(&guard->lock);
+        for (size_t i = 0; i < guard->slot_count; i++) {
+            MemBlock* current = &guard->slots[i].block;
+            if (guard->slots[i].state == GUARD_SLOT_ALLOCATED) {
+                printf("Block at %p, size: %zu bytes, ref_count: %d (guarded)\n", current->ptr, current->size, atomic_load(&current->ref_count));
+                printed++;
+            }
+        }
+        pthread_mutex_unlock(&guard->lock);
+    }
+    if (printed == 0) {
+        printf("No memory blocks in use.\n");
+    }
+
+    if (atomic_load(&manager->arenas[0]->pools) == NULL) {
+        printf("No memory pools created.\n");
+    } else {
+        printf("\nMemory Pools:\n");
+        for (size_t a = 0; a < manager->arena_count; a++) {
+            MemPool* pool = atomic_load(&manager->arenas[a]->pools);
+            while (pool != NULL) {
+                if (manager->arena_count > 1) {
+                    printf("Arena %zu: ", a);
+                }
+                printf("Pool with block size: %zu bytes, block count: %zu\n", pool->block_size, pool->block_count);
+                pool = atomic_load(&pool->next);
+            }
+        }
+    }
+
+    printf("\n");
+}
+
+// Order free blocks by address
+static int compare_block_addresses(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)(*(MemBlock* const*)a)->ptr;
+    uintptr_t y = (uintptr_t)(*(MemBlock* const*)b)->ptr;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Defragment memory
+void defragment_memory(MemoryManager* manager) {
+    // Blocks cached by this thread are free too
+    flush_thread_cache(manager);
+
+    // Rebuild each pool's free list in address order so that reuse stays dense
+    for (size_t a = 0; a < manager->arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+        release_free_pages(arena); // Free backend blocks are already merged as far as they go
+        pthread_mutex_lock(&arena->lock);
+        for (size_t p = 0; p < arena->pool_count; p++) {
+            MemPool* pool = arena->pool_table[p];
+            pthread_mutex_lock(&pool->lock);
+            take_remote_frees_locked(pool);
+            if (pool->free_count < 2) {
+                pthread_mutex_unlock(&pool->lock);
+                continue;
+            }
+
+            MemBlock** free_blocks = (MemBlock**)malloc(pool->free_count * sizeof(MemBlock*));
+            if (free_blocks == NULL) {
+                pthread_mutex_unlock(&pool->lock);
+                pthread_mutex_unlock(&arena->lock);
+                printf("Defragmentation failed\n");
+                return;
+            }
+
+            size_t count = 0;
+            for (MemBlock* block = pool->free_list; block != NULL; block = block->next) {
+                free_blocks[count++] = block;
+            }
+            qsort(free_blocks, count, sizeof(MemBlock*), compare_block_addresses);
+
+            pool->free_list = NULL;
+            for (size_t i = count; i > 0; i--) {
+                free_blocks[i - 1]->next = pool->free_list;
+                pool->free_list = free_blocks[i - 1];
+            }
+            pthread_mutex_unlock(&pool->lock);
+            free(free_blocks);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+// Leaked blocks sharing a size and allocation site
+typedef struct {
+    size_t size;
+    const void* site;
+    size_t count;
+    int min_ref_count;
+    int max_ref_count;
+} LeakGroup;
+
+// Order leak groups by size, then by allocation site
+static int compare_leak_keys(const void* a, const void* b) {
+    const LeakGroup* x = (const LeakGroup*)a;
+    const LeakGroup* y = (const LeakGroup*)b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->site != y->site) {
+        return (uintptr_t)x->site < (uintptr_t)y->site ? -1 : 1;
+    }
+    return 0;
+}
+
+// Order leak groups by total leaked bytes, largest first
+static int compare_leak_bytes(const void* a, const void* b) {
+    const LeakGroup* x = (const LeakGroup*)a;
+    const LeakGroup* y = (const LeakGroup*)b;
+    size_t x_bytes = x->size * x->count;
+    size_t y_bytes = y->size * y->count;
+    if (x_bytes != y_bytes) {
+        return x_bytes > y_bytes ? -1 : 1;
+    }
+    return compare_leak_keys(a, b);
+}
+
+// Enable the leak report printed by free_memory_manager
+void enable_leak_report(MemoryManager* manager, size_t sample_rate) {
+    pthread_mutex_lock(&manager->lock);
+    manager->report_leaks_on_free = 1;
+    manager->leak_sample_rate = sample_rate;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Add one block in use to the leak groups
+static void add_leak(LeakGroup* group, MemBlock* block, int ref_count) {
+    group->size = block->size;
+    group->site = block->site;
+    group->count = 1;
+    group->min_ref_count = ref_count;
+    group->max_ref_count = ref_count;
+}
+
+// Block waiting on reclamation: retired, or with decrements still in a thread's log
+typedef struct {
+    MemBlock* block;
+    int decrements; // Logged decrements, INT_MAX for a retired block
+} PendingBlock;
+
+// Pending blocks gathered for the leak report; count goes on past capacity, so a first pass with no
+// capacity only counts
+typedef struct {
+    PendingBlock* entries;
+    size_t capacity;
+    size_t count;
+} PendingList;
+
+// Order pending blocks by address
+static int compare_pending_blocks(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const PendingBlock*)a)->block;
+    uintptr_t y = (uintptr_t)((const PendingBlock*)b)->block;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void add_pending_block(PendingList* list, MemBlock* block, int decrements) {
+    if (list->count < list->capacity) {
+        list->entries[list->count] = (PendingBlock){block, decrements};
+    }
+    list->count++;
+}
+
+// Add every thread's logs and retired lists and the manager's orphans; the caller holds the manager lock
+static void add_pending_blocks(MemoryManager* manager, PendingList* list) {
+    for (MemBlock* block = manager->orphans; block != NULL; block = block->next) {
+        add_pending_block(list, block, INT_MAX);
+    }
+    for (MemBlock* block = manager->hazard_orphans; block != NULL; block = block->next) {
+        add_pending_block(list, block, INT_MAX);
+    }
+    for (ThreadCache* cache = manager->caches; cache != NULL; cache = cache->next) {
+        for (size_t i = 0; i < cache->deferred_count; i++) {
+            MemBlock* block = find_block(cache->deferred[i]);
+            if (block != NULL) {
+                add_pending_block(list, block, 1);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            for (MemBlock* block = cache->limbo[i]; block != NULL; block = block->next) {
+                add_pending_block(list, block, INT_MAX);
+            }
+        }
+        for (size_t i = 0; i < cache->hazard_retired_count; i++) {
+            add_pending_block(list, cache->hazard_retired[i], INT_MAX);
+        }
+    }
+}
+
+// Sort the pending blocks and merge the entries of each into one; returns the new count
+static size_t merge_pending_blocks(PendingBlock* pending, size_t count) {
+    qsort(pending, count, sizeof(PendingBlock), compare_pending_blocks);
+    size_t merged = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (merged > 0 && pending[merged - 1].block == pending[i].block) {
+            int* decrements = &pending[merged - 1].decrements;
+            *decrements = *decrements > INT_MAX - pending[i].decrements ? INT_MAX : *decrements + pending[i].decrements;
+        } else {
+            pending[merged++] = pending[i];
+        }
+    }
+    return merged;
+}
+
+// Reference count a block keeps once its pending reclamation is done; 0 when that frees it
+static int settled_ref_count(const PendingBlock* pending, size_t pending_count, MemBlock* block) {
+    int ref_count = atomic_load(&block->ref_count);
+    PendingBlock key = {block, 0};
+    const PendingBlock* entry =
+        pending_count > 0 ? (const PendingBlock*)bsearch(&key, pending, pending_count, sizeof(PendingBlock), compare_pending_blocks) : NULL;
+    if (entry == NULL) {
+        return ref_count;
+    }
+    return entry->decrements >= ref_count ? 0 : ref_count - entry->decrements;
+}
+
+// Report blocks that are still referenced, grouped by size and allocation site. Blocks waiting on
+// reclamation are left out: retired ones, and those whose logged decrements take them to zero. Other
+// threads' logs and retired lists are read as they stand, so the report is exact only while those
+// threads neither retire nor log decrements, as in free_memory_manager.
+void report_leaks(MemoryManager* manager, FILE* out) {
+    pthread_mutex_lock(&manager->lock);
+    PendingList list = {NULL, 0, 0};
+    add_pending_blocks(manager, &list);
+    list.capacity = list.count;
+    list.entries = (PendingBlock*)malloc((list.capacity > 0 ? list.capacity : 1) * sizeof(PendingBlock));
+    if (list.entries == NULL) {
+        pthread_mutex_unlock(&manager->lock);
+        fprintf(out, "Leak report: out of memory while grouping blocks\n");
+        return;
+    }
+    list.count = 0;
+    add_pending_blocks(manager, &list);
+    PendingBlock* pending = list.entries;
+    size_t pending_count = merge_pending_blocks(pending, list.count < list.capacity ? list.count : list.capacity);
+
+    // Arenas are always locked in table order, after the manager
+    size_t arena_count = manager->arena_count;
+    size_t capacity = 0;
+    for (size_t a = 0; a < arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        capacity += arena->block_count;
+        for (size_t p = 0; p < arena->pool_count; p++) {
+            capacity += arena->pool_table[p]->block_count;
+        }
+    }
+    GuardPool* guard = atomic_load(&manager->guard);
+    if (guard != NULL) {
+        pthread_mutex_lock(&guard->lock);
+        capacity += guard->slot_count;
+    }
+
+    LeakGroup* groups = (LeakGroup*)malloc((capacity > 0 ? capacity : 1) * sizeof(LeakGroup));
+    size_t block_count = 0;
+    for (size_t a = 0; a < arena_count; a++) {
+        MemArena* arena = manager->arenas[a];
+        for (size_t i = 0; groups != NULL && i < arena->block_count; i++) {
+            MemBlock* current = arena->blocks[i];
+            int ref_count = settled_ref_count(pending, pending_count, current);
+            if (ref_count > 0) {
+                add_leak(&groups[block_count++], current, ref_count);
+            }
+        }
+        for (size_t p = 0; groups != NULL && p < arena->pool_count; p++) {
+            MemPool* pool = arena->pool_table[p];
+            for (size_t i = 0; i < pool->block_count; i++) {
+                int ref_count = settled_ref_count(pending, pending_count, &pool->blocks[i]);
+                if (ref_count > 0) {
+                    add_leak(&groups[block_count++], &pool->blocks[i], ref_count);
+                }
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (guard != NULL) {
+        for (size_t i = 0; groups != NULL && i < guard->slot_count; i++) {
+            if (guard->slots[i].state == GUARD_SLOT_ALLOCATED) {
+                MemBlock* current = &guard->slots[i].block;
+                int ref_count = settled_ref_count(pending, pending_count, current);
+                if (ref_count > 0) {
+                    add_leak(&groups[block_count++], current, ref_count);
+                }
+            }
+        }
+        pthread_mutex_unlock(&guard->lock);
+    }
+    pthread_mutex_unlock(&manager->lock);
+    free(pending);
+
+    if (groups == NULL) {
+        fprintf(out, "Leak report: out of memory while grouping blocks\n");
+        return;
+    }
+
+    if (block_count == 0) {
+        free(groups);
+        fprintf(out, "Leak report: no blocks still referenced.\n");
+        return;
+    }
+
+    // Merge runs of equal keys in place
+    qsort(groups, block_count, sizeof(LeakGroup), compare_leak_keys);
+    size_t group_count = 0;
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < block_count; i++) {
+        total_bytes += groups[i].size;
+        if (group_count > 0 && compare_leak_keys(&groups[group_count - 1], &groups[i]) == 0) {
+            LeakGroup* group = &groups[group_count - 1];
+            group->count++;
+            if (groups[i].min_ref_count < group->min_ref_count) {
+                group->min_ref_count = groups[i].min_ref_count;
+            }
+            if (groups[i].max_ref_count > group->max_ref_count) {
+                group->max_ref_count = groups[i].max_ref_count;
+            }
+        } else {
+            groups[group_count++] = groups[i];
+        }
+    }
+    qsort(groups, group_count, sizeof(LeakGroup), compare_leak_bytes);
+
+    fprintf(out, "Leak report: %zu blocks still referenced, %zu bytes total\n", block_count, total_bytes);
+    for (size_t i = 0; i < group_count; i++) {
+        LeakGroup* group = &groups[i];
+        fprintf(out, "  %zu x %zu bytes, ref_count %d..%d", group->count, group->size, group->min_ref_count, group->max_ref_count);
+        if (group->site != NULL) {
+            fprintf(out, ", allocated at %p", group->site);
+        }
+        fprintf(out, "\n");
+    }
+
+    free(groups);
+}
+
+// Copy the allocation statistics, including the calling thread's unmerged counts
+void get_memory_stats(MemoryManager* manager, MemStats* stats) {
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cache != NULL) {
+        merge_thread_stats(cache);
+    }
+
+    pthread_mutex_lock(&manager->lock);
+    *stats = manager->stats;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// Snapshot stages, in output order
+enum {
+    SNAPSHOT_STAGE_STATS,
+    SNAPSHOT_STAGE_POOLS,
+    SNAPSHOT_STAGE_BLOCKS,
+    SNAPSHOT_STAGE_POOL_BLOCKS,
+    SNAPSHOT_STAGE_GUARD_BLOCKS,
+    SNAPSHOT_STAGE_END,
+    SNAPSHOT_STAGE_DONE
+};
+
+// Binary record tags
+enum {
+    SNAPSHOT_TAG_STATS = 'S',
+    SNAPSHOT_TAG_POOL = 'P',
+    SNAPSHOT_TAG_BLOCK = 'B',
+    SNAPSHOT_TAG_END = 'E'
+};
+
+// Append a little-endian 64-bit field to a binary record
+static size_t put_u64(unsigned char* record, size_t length, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        record[length++] = (unsigned char)(value >> (8 * i));
+    }
+    return length;
+}
+
+// Start a heap snapshot
+void begin_heap_snapshot(SnapshotCursor* cursor, SnapshotFormat format) {
+    cursor->format = format;
+    cursor->stage = SNAPSHOT_STAGE_STATS;
+    cursor->arena = 0;
+    cursor->pool = 0;
+    cursor->position = 0;
+    cursor->emitted = 0;
+}
+
+// Check whether a heap snapshot has been written completely
+int heap_snapshot_done(const SnapshotCursor* cursor) {
+    return cursor->stage == SNAPSHOT_STAGE_DONE;
+}
+
+// Format one block record
+static size_t format_block_record(SnapshotCursor* cursor, MemBlock* block, int ref_count, unsigned char* record, size_t capacity) {
+    size_t n = 0;
+    if (cursor->format == SNAPSHOT_JSON) {
+        return (size_t)snprintf((char*)record, capacity,
+            "%s{\"address\":\"%p\",\"size\":%zu,\"ref_count\":%d,\"pooled\":%s,\"arena\":%zu,\"site\":\"%p\"}",
+            cursor->emitted == 0 ? "" : ",", block->ptr, block->size, ref_count,
+            block->pool != NULL ? "true" : "false", block->arena->index, block->site);
+    }
+    record[n++] = SNAPSHOT_TAG_BLOCK;
+    n = put_u64(record, n, (uintptr_t)block->ptr);
+    n = put_u64(record, n, block->size);
+    n = put_u64(record, n, (uint64_t)ref_count);
+    n = put_u64(record, n, (uintptr_t)block->site);
+    n = put_u64(record, n, block->arena->index);
+    record[n++] = block->pool != NULL;
+    return n;
+}
+
+// Format the record at the cursor; sets *advance to 1 when it is a record, 0 when it closes the current stage
+static size_t format_snapshot_record_locked(MemoryManager* manager, SnapshotCursor* cursor, unsigned char* record, size_t capacity, int* advance) {
+    int json = cursor->format == SNAPSHOT_JSON;
+    size_t n = 0;
+    *advance = 0;
+
+    switch (cursor->stage) {
+    case SNAPSHOT_STAGE_STATS: {
+        MemStats* stats = &manager->stats;
+        if (json) {
+            return (size_t)snprintf((char*)record, capacity,
+                "{\"stats\":{\"allocations\":%zu,\"deallocations\":%zu,\"pool_hits\":%zu,\"pool_misses\":%zu,"
+                "\"blocks_in_use\":%zu,\"bytes_in_use\":%zu,\"peak_bytes_in_use\":%zu,\"cached_bytes\":%zu},\"pools\":[",
+                stats->allocations, stats->deallocations, stats->pool_hits, stats->pool_misses,
+                stats->blocks_in_use, stats->bytes_in_use, stats->peak_bytes_in_use,
+                atomic_load_explicit(&manager->cached_bytes, memory_order_relaxed));
+        }
+        memcpy(record, "AMMS", 4);
+        record[4] = 2; // Format version
+        record[5] = SNAPSHOT_TAG_STATS;
+        n = 6;
+        n = put_u64(record, n, stats->allocations);
+        n = put_u64(record, n, stats->deallocations);
+        n = put_u64(record, n, stats->pool_hits);
+        n = put_u64(record, n, stats->pool_misses);
+        n = put_u64(record, n, stats->blocks_in_use);
+        n = put_u64(record, n, stats->bytes_in_use);
+        n = put_u64(record, n, stats->peak_bytes_in_use);
+        n = put_u64(record, n, atomic_load_explicit(&manager->cached_bytes, memory_order_relaxed));
+        return n;
+    }
+    case SNAPSHOT_STAGE_POOLS:
+        for (; cursor->arena < manager->arena_count; cursor->arena++, cursor->pool = 0) {
+            MemArena* arena = manager->arenas[cursor->arena];
+            pthread_mutex_lock(&arena->lock);
+            MemPool* pool = cursor->pool < arena->pool_count ? arena->pool_table[cursor->pool] : NULL;
+            pthread_mutex_unlock(&arena->lock);
+            if (pool == NULL) {
+                continue;
+            }
+            pthread_mutex_lock(&pool->lock);
+            size_t free_count = pool->free_count;
+            pthread_mutex_unlock(&pool->lock);
+            cursor->pool++;
+            *advance = 1;
+            if (json) {
+                return (size_t)snprintf((char*)record, capacity,
+                    "%s{\"arena\":%zu,\"block_size\":%zu,\"block_count\":%zu,\"alignment\":%zu,\"free_count\":%zu}",
+                    cursor->emitted == 0 ? "" : ",", cursor->arena, pool->block_size, pool->block_count, pool->alignment, free_count);
+            }
+            record[n++] = SNAPSHOT_TAG_POOL;
+            n = put_u64(record, n, cursor->arena);
+            n = put_u64(record, n, pool->block_size);
+            n = put_u64(record, n, pool->block_count);
+            n = put_u64(record, n, pool->alignment);
+            n = put_u64(record, n, free_count);
+            return n;
+        }
+        return json ? (size_t)snprintf((char*)record, capacity, "],\"blocks\":[") : 0;
+    case SNAPSHOT_STAGE_BLOCKS:
+        // Walk each table down from its last index; position is one more than the entries left, 0 before the walk.
+        // A removal moves the last entry into the gap: either a block already written (repeated later) or,
+        // when the last entry is the next one to read, that block moves below the cursor, which is clamped
+        // to the shorter table. No block in the table when the walk started is skipped; blocks added
+        // above the cursor during the walk are left out.
+        for (; cursor->arena < manager->arena_count; cursor->arena++, cursor->position = 0) {
+            MemArena* arena = manager->arenas[cursor->arena];
+            pthread_mutex_lock(&arena->lock);
+            if (cursor->position == 0 || cursor->position > arena->block_count + 1) {
+                cursor->position = arena->block_count + 1;
+            }
+            if (cursor->position == 1) {
+                pthread_mutex_unlock(&arena->lock);
+                continue;
+            }
+            cursor->position--;
+            MemBlock* block = arena->blocks[cursor->position - 1];
+            *advance = 1;
+            n = format_block_record(cursor, block, atomic_load(&block->ref_count), record, capacity);
+            pthread_mutex_unlock(&arena->lock);
+            return n;
+        }
+        return 0;
+    case SNAPSHOT_STAGE_POOL_BLOCKS:
+        // Pool blocks never move, so their slots are a stable position
+        for (; cursor->arena < manager->arena_count; cursor->arena++, cursor->pool = 0) {
+            MemArena* arena = manager->arenas[cursor->arena];
+            for (;;) {
+                pthread_mutex_lock(&arena->lock);
+                MemPool* pool = cursor->pool < arena->pool_count ? arena->pool_table[cursor->pool] : NULL;
+                pthread_mutex_unlock(&arena->lock);
+                if (pool == NULL) {
+                    break;
+                }
+                while (cursor->position < pool->block_count) {
+                    MemBlock* block = &pool->blocks[cursor->position++];
+                    int ref_count = atomic_load(&block->ref_count);
+                    if (ref_count > 0) {
+                        *advance = 1;
+                        return format_block_record(cursor, block, ref_count, record, capacity);
+                    }
+                }
+                cursor->pool++;
+                cursor->position = 0;
+            }
+        }
+        return 0;
+    case SNAPSHOT_STAGE_GUARD_BLOCKS: {
+        // Guarded slots never move either; a slot still being filled in is not allocated yet
+        GuardPool* guard = atomic_load_explicit(&manager->guard, memory_order_acquire);
+        if (guard != NULL) {
+            pthread_mutex_lock(&guard->lock);
+            while (cursor->position < guard->slot_count) {
+                GuardSlot* slot = &guard->slots[cursor->position++];
+                if (slot->state == GUARD_SLOT_ALLOCATED) {
+                    *advance = 1;
+                    n = format_block_record(cursor, &slot->block, atomic_load(&slot->block.ref_count), record, capacity);
+                    pthread_mutex_unlock(&guard->lock);
+                    return n;
+                }
+            }
+            pthread_mutex_unlock(&guard->lock);
+        }
+        return json ? (size_t)snprintf((char*)record, capacity, "]") : 0;
+    }
+    case SNAPSHOT_STAGE_END:
+        if (json) {
+            return (size_t)snprintf((char*)record, capacity, "}");
+        }
+        record[n++] = SNAPSHOT_TAG_END;
+        return n;
+    }
+    return 0;
+}
+
+// Write the next part of a heap snapshot into buffer; returns the number of bytes written
+size_t write_heap_snapshot(MemoryManager* manager, SnapshotCursor* cursor, void* buffer, size_t capacity) {
+    unsigned char record[SNAPSHOT_MIN_BUFFER];
+    unsigned char* out = (unsigned char*)buffer;
+    size_t written = 0;
+    int full = 0;
+
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    if (cursor->stage == SNAPSHOT_STAGE_STATS && cache != NULL) {
+        merge_thread_stats(cache);
+    }
+
+    // Hold the lock for a bounded number of records at a time so allocators are never stalled for long
+    while (!full && cursor->stage != SNAPSHOT_STAGE_DONE) {
+        pthread_mutex_lock(&manager->lock);
+        for (int records = 0; records < SNAPSHOT_RECORDS_PER_LOCK && cursor->stage != SNAPSHOT_STAGE_DONE; records++) {
+            SnapshotCursor saved = *cursor;
+            int advance;
+            size_t length = format_snapshot_record_locked(manager, cursor, record, sizeof(record), &advance);
+            if (written + length > capacity) {
+                *cursor = saved; // Retry this record with the next buffer
+                full = 1;
+                break;
+            }
+            memcpy(out + written, record, length);
+            written += length;
+
+            if (advance) {
+                cursor->emitted++;
+            } else {
+                // Heap, pool and guarded blocks share one array
+                if (cursor->stage != SNAPSHOT_STAGE_BLOCKS && cursor->stage != SNAPSHOT_STAGE_POOL_BLOCKS) {
+                    cursor->emitted = 0;
+                }
+                cursor->stage++;
+                cursor->arena = 0;
+                cursor->pool = 0;
+                cursor->position = 0;
+            }
+        }
+        pthread_mutex_unlock(&manager->lock);
+    }
+    return written;
+}
+
+// Stack allocator over one manager block; allocations are freed in reverse order
+struct StackAllocator {
+    MemoryManager* manager;
+    char* base; // Manager block holding every allocation
+    size_t capacity;
+    size_t top; // Offset of the first free byte
+    int debug; // Check the order of frees and pops, and poison what they release
+    size_t live; // Allocations not yet freed or popped
+};
+
+// Header in front of every stack allocation
+typedef struct {
+    size_t previous; // Top before the allocation, restored when it is freed
+    size_t end; // Top right after the allocation; a free in order finds it still the top
+} StackHeader;
+
+// Report a stack allocator used out of order and stop
+static void stack_misuse(StackAllocator* stack, const char* what, const void* where) {
+    fprintf(stderr, "Stack allocator %p: %s %p out of order (top %zu, %zu live allocations)\n",
+            (void*)stack, what, where, stack->top, stack->live);
+    abort();
+}
+
+// Create a stack allocator over a block of capacity bytes taken from the manager
+StackAllocator* create_stack_allocator(MemoryManager* manager, size_t capacity, int debug) {
+    StackAllocator* stack = (StackAllocator*)malloc(sizeof(StackAllocator));
+    if (stack == NULL) {
+        perror("Failed to create stack allocator");
+        exit(EXIT_FAILURE);
+    }
+    stack->base = (char*)allocate_memory(manager, capacity, STACK_ALIGNMENT);
+    if (stack->base == NULL) {
+        perror("Failed to allocate stack allocator memory");
+        exit(EXIT_FAILURE);
+    }
+    stack->manager = manager;
+    stack->capacity = capacity;
+    stack->top = 0;
+    stack->debug = debug;
+    stack->live = 0;
+    return stack;
+}
+
+// Allocate on top of the stack with any power-of-two alignment; NULL when it does not fit
+void* stack_allocate(StackAllocator* stack, size_t size, size_t alignment) {
+    if (alignment < STACK_ALIGNMENT) {
+        alignment = STACK_ALIGNMENT;
+    }
+    // Align the address rather than the offset, so alignments beyond the block's own still hold
+    uintptr_t start = (uintptr_t)stack->base + stack->top + sizeof(StackHeader);
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned < start) {
+        return NULL;
+    }
+    size_t offset = aligned - (uintptr_t)stack->base;
+    if (offset > stack->capacity || size > stack->capacity - offset) {
+        return NULL;
+    }
+
+    StackHeader* header = (StackHeader*)aligned - 1;
+    header->previous = stack->top;
+    header->end = offset + size;
+    stack->top = offset + size;
+    stack->live++;
+    return (void*)aligned;
+}
+
+// Free the most recent allocation still on the stack
+void stack_free(StackAllocator* stack, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    StackHeader* header = (StackHeader*)ptr - 1;
+    size_t previous = header->previous;
+    if (stack->debug) {
+        if (stack->live == 0 || header->end != stack->top || previous >= header->end) {
+            stack_misuse(stack, "free of", ptr);
+        }
+        memset(stack->base + previous, STACK_DEBUG_POISON, stack->top - previous); // Header included
+    }
+    stack->top = previous;
+    stack->live--;
+}
+
+// Mark the current top, for stack_pop to release everything allocated after it
+StackMarker stack_push(StackAllocator* stack) {
+    return (StackMarker){stack->top, stack->live};
+}
+
+// Release every allocation made since the marker was pushed
+void stack_pop(StackAllocator* stack, StackMarker marker) {
+    if (stack->debug) {
+        // A marker above the top was already popped past by an outer one, or its allocations freed
+        if (marker.top > stack->top || marker.live > stack->live) {
+            stack_misuse(stack, "pop to", stack->base + marker.top);
+        }
+        memset(stack->base + marker.top, STACK_DEBUG_POISON, stack->top - marker.top);
+    }
+    stack->top = marker.top;
+    stack->live = marker.live;
+}
+
+// Get the bytes in use, alignment padding and headers included
+size_t stack_used(const StackAllocator* stack) {
+    return stack->top;
+}
+
+// Give the stack's block back to the manager
+void destroy_stack_allocator(StackAllocator* stack) {
+    if (stack->debug && stack->live != 0) {
+        fprintf(stderr, "Stack allocator %p destroyed with %zu live allocations\n", (void*)stack, stack->live);
+    }
+    deallocate_memory(stack->manager, stack->base);
+    free(stack);
+}
+
+// Process-wide registry of guarded slot pools, searched by the fault handler
+static GuardPool* _Atomic guard_pools[GUARD_MAX_POOLS];
+static struct sigaction guard_previous_action; // SIGSEGV disposition before the fault handler
+static pthread_once_t guard_handler_once = PTHREAD_ONCE_INIT;
+
+// Record the calling thread's stack; returns the number of frames
+static int record_guard_trace(void** trace) {
+#if HAVE_BACKTRACE
+    return backtrace(trace, GUARD_TRACE_DEPTH);
+#else
+    (void)trace;
+    return 0;
+#endif
+}
+
+// Append text to a fault report line, cutting it at GUARD_LINE_SIZE; stdio is not async-signal-safe
+static size_t append_guard_text(char* line, size_t length, const char* text) {
+    while (*text != '\0' && length < GUARD_LINE_SIZE - 1) {
+        line[length++] = *text++;
+    }
+    line[length] = '\0';
+    return length;
+}
+
+// Append a number to a fault report line in decimal, or in hexadecimal with a 0x prefix
+static size_t append_guard_number(char* line, size_t length, uintptr_t value, unsigned base) {
+    char digits[sizeof(uintptr_t) * 8 + 3];
+    size_t start = sizeof(digits) - 1;
+    digits[start] = '\0';
+    do {
+        digits[--start] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    if (base == 16) {
+        digits[--start] = 'x';
+        digits[--start] = '0';
+    }
+    return append_guard_text(line, length, &digits[start]);
+}
+
+// Write a report line and a recorded stack to stderr from the fault handler
+static void write_guard_report(const char* line, size_t length, void* const* trace, int depth) {
+    ssize_t written = write(STDERR_FILENO, line, length);
+    (void)written; // Nothing to do about a lost report line
+#if HAVE_BACKTRACE
+    if (depth > 0) {
+        backtrace_symbols_fd(trace, depth, STDERR_FILENO);
+    }
+#else
+    (void)trace;
+    (void)depth;
+#endif
+}
+
+// Describe a fault in a guarded pool: what the access hit, then where the block was allocated and freed
+static void report_guard_fault(GuardPool* pool, const char* address) {
+    size_t page = (size_t)(address - pool->base) / pool->page_size;
+    size_t in_page = (size_t)(address - pool->base) % pool->page_size;
+    const char* kind;
+    size_t slot_index;
+    if (page % 2 == 1) {
+        slot_index = page / 2;
+        kind = pool->slots[slot_index].state == GUARD_SLOT_FREED ? "use-after-free" : "invalid access";
+    } else if (page > 0 && (page / 2 == pool->slot_count || in_page < pool->page_size / 2)) {
+        slot_index = page / 2 - 1; // Closer to the end of the slot before this guard page
+        kind = "buffer overflow";
+    } else {
+        slot_index = page / 2;
+        kind = "buffer underflow";
+    }
+
+    char line[GUARD_LINE_SIZE];
+    size_t length = append_guard_text(line, 0, "Guarded sampling: ");
+    if (slot_index >= pool->slot_count ||
+        (pool->slots[slot_index].state != GUARD_SLOT_ALLOCATED && pool->slots[slot_index].state != GUARD_SLOT_FREED)) {
+        length = append_guard_text(line, length, "invalid access at ");
+        length = append_guard_number(line, length, (uintptr_t)address, 16);
+        length = append_guard_text(line, length, ", not near any block\n");
+        write_guard_report(line, length, NULL, 0);
+        return;
+    }
+    GuardSlot* slot = &pool->slots[slot_index];
+    const char* start = (const char*)slot->block.ptr;
+    length = append_guard_text(line, length, kind);
+    length = append_guard_text(line, length, " at ");
+    length = append_guard_number(line, length, (uintptr_t)address, 16);
+    length = append_guard_text(line, length, ", ");
+    length = append_guard_number(line, length, address < start ? (uintptr_t)(start - address) : (uintptr_t)(address - start), 10);
+    length = append_guard_text(line, length, address < start ? " bytes before" :
+                               ((size_t)(address - start) < slot->block.size ? " bytes into" : " bytes from the start of"));
+    length = append_guard_text(line, length, " the ");
+    length = append_guard_number(line, length, slot->block.size, 10);
+    length = append_guard_text(line, length, "-byte block at ");
+    length = append_guard_number(line, length, (uintptr_t)start, 16);
+    length = append_guard_text(line, length, "\n");
+    write_guard_report(line, length, NULL, 0);
+
+    length = append_guard_text(line, 0, "Allocated by thread ");
+    length = append_guard_number(line, length, (uintptr_t)slot->alloc_thread, 10);
+    length = append_guard_text(line, length, " at ");
+    length = append_guard_number(line, length, (uintptr_t)slot->block.site, 16);
+    length = append_guard_text(line, length, ":\n");
+    write_guard_report(line, length, slot->alloc_trace, slot->alloc_depth);
+    if (slot->state == GUARD_SLOT_FREED) {
+        length = append_guard_text(line, 0, "Freed by thread ");
+        length = append_guard_number(line, length, (uintptr_t)slot->free_thread, 10);
+        length = append_guard_text(line, length, ":\n");
+        write_guard_report(line, length, slot->free_trace, slot->free_depth);
+    }
+}
+
+// Report faults in guarded pools; pass every other fault to the previous disposition, keeping this handler
+static void guard_fault_handler(int signal, siginfo_t* info, void* context) {
+    const char* address = (const char*)info->si_addr;
+    for (size_t i = 0; i < GUARD_MAX_POOLS; i++) {
+        GuardPool* pool = atomic_load_explicit(&guard_pools[i], memory_order_acquire);
+        if (pool != NULL && address >= pool->base && address < pool->base + pool->length) {
+            report_guard_fault(pool, address);
+            // The faulting instruction runs again on return and faults into the previous handler, or the default crash
+            sigaction(SIGSEGV, &guard_previous_action, NULL);
+            return;
+        }
+    }
+
+    // Not a guard fault: a recovering handler (JIT, GC, sandbox) handles it and guard reports go on working
+    if (guard_previous_action.sa_flags & SA_SIGINFO) {
+        guard_previous_action.sa_sigaction(signal, info, context);
+    } else if (guard_previous_action.sa_handler != SIG_DFL && guard_previous_action.sa_handler != SIG_IGN) {
+        guard_previous_action.sa_handler(signal);
+    } else {
+        // The fault repeats under the default disposition and crashes as it would have without sampling
+        sigaction(SIGSEGV, &guard_previous_action, NULL);
+    }
+}
+
+// Install the fault handler, keeping the disposition it replaces
+static void install_guard_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_previous_action);
+}
+
+// Guard one in sample_rate allocations of up to a page with PROT_NONE pages, using slots guarded slots
+int enable_guarded_sampling(MemoryManager* manager, size_t sample_rate, size_t slots) {
+    if (sample_rate == 0 || slots == 0 || atomic_load(&manager->guard) != NULL) {
+        return -1;
+    }
+    GuardPool* pool = (GuardPool*)malloc(sizeof(GuardPool));
+    if (pool == NULL) {
+        return -1;
+    }
+    pool->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pool->slot_count = slots;
+    pool->next_slot = 0;
+    pool->length = (2 * slots + 1) * pool->page_size; // A guard page on both sides of every slot
+    pool->slots = (GuardSlot*)calloc(slots, sizeof(GuardSlot));
+    pool->base = (char*)mmap(NULL, pool->length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->slots == NULL || pool->base == (char*)MAP_FAILED) {
+        if (pool->base != (char*)MAP_FAILED) {
+            munmap(pool->base, pool->length);
+        }
+        free(pool->slots);
+        free(pool);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+
+    size_t registered = GUARD_MAX_POOLS;
+    for (size_t i = 0; i < GUARD_MAX_POOLS && registered == GUARD_MAX_POOLS; i++) {
+        GuardPool* expected = NULL;
+        if (atomic_compare_exchange_strong(&guard_pools[i], &expected, pool)) {
+            registered = i;
+        }
+    }
+    if (registered == GUARD_MAX_POOLS) {
+        pthread_mutex_destroy(&pool->lock);
+        munmap(pool->base, pool->length);
+        free(pool->slots);
+        free(pool);
+        return -1;
+    }
+
+    // The first backtrace loads the unwinder, which allocates; do it now rather than under the pool lock
+    void* trace[GUARD_TRACE_DEPTH];
+    record_guard_trace(trace);
+    pthread_once(&guard_handler_once, install_guard_handler);
+
+    pthread_mutex_lock(&manager->lock);
+    atomic_store_explicit(&manager->guard, pool, memory_order_release);
+    manager->guard_sample_rate = sample_rate;
+    pthread_mutex_unlock(&manager->lock);
+    return 0;
+}
+
+// Find the guarded slot behind a block, or NULL for any other block
+static GuardSlot* guarded_slot(MemoryManager* manager, MemBlock* block) {
+    GuardPool* pool = atomic_load_explicit(&manager->guard, memory_order_acquire);
+    if (pool == NULL || (char*)block < (char*)pool->slots || (char*)block >= (char*)(pool->slots + pool->slot_count)) {
+        return NULL;
+    }
+    return (GuardSlot*)block;
+}
+
+// Place an allocation at the end of a free slot, against the guard page after it;
+// NULL when it does not fit in a page or every slot is in use
+static void* allocate_guarded(MemoryManager* manager, ThreadCache* cache, size_t size, size_t alignment, const void* site) {
+    GuardPool* pool = atomic_load_explicit(&manager->guard, memory_order_acquire);
+    if (alignment < BLOCK_HEADER_SIZE) {
+        alignment = BLOCK_HEADER_SIZE;
+    }
+    if (pool == NULL || alignment > pool->page_size || size > pool->page_size - alignment) {
+        return NULL;
+    }
+
+    // Take slots round-robin, so a freed slot stays protected for as long as possible
+    pthread_mutex_lock(&pool->lock);
+    GuardSlot* slot = NULL;
+    size_t index = 0;
+    for (size_t i = 0; i < pool->slot_count && slot == NULL; i++) {
+        index = (pool->next_slot + i) % pool->slot_count;
+        if (pool->slots[index].state == GUARD_SLOT_UNUSED || pool->slots[index].state == GUARD_SLOT_FREED) {
+            slot = &pool->slots[index];
+        }
+    }
+    if (slot == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    pool->next_slot = index + 1;
+    slot->state = GUARD_SLOT_RESERVED;
+    pthread_mutex_unlock(&pool->lock);
+
+    char* page = pool->base + (2 * index + 1) * pool->page_size;
+    if (mprotect(page, pool->page_size, PROT_READ | PROT_WRITE) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        slot->state = GUARD_SLOT_UNUSED;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    // Right-aligned: the block ends within alignment - 1 bytes of the guard page
+    MemBlock* block = &slot->block;
+    uintptr_t ptr = ((uintptr_t)page + pool->page_size - size) & ~(uintptr_t)(alignment - 1);
+    block->size = size;
+    block->alignment = alignment;
+    block->ptr = (void*)ptr;
+    block->raw = page;
+    block->map_size = 0;
+    block->fd = -1;
+    atomic_init(&block->ref_count, 1); // Initial reference count is 1
+    block->site = site;
+    block->pool = NULL;
+    block->arena = cache->arena;
+    block->index = 0;
+    block->next = NULL;
+    ((MemBlock**)block->ptr)[-1] = block;
+    slot->alloc_thread = (pid_t)syscall(SYS_gettid);
+    slot->alloc_depth = record_guard_trace(slot->alloc_trace);
+
+    // Leak reports and snapshots only read allocated slots, so the block is complete before it is listed
+    pthread_mutex_lock(&pool->lock);
+    slot->state = GUARD_SLOT_ALLOCATED;
+    pthread_mutex_unlock(&pool->lock);
+    count_allocation(manager, cache, size, 0);
+    return block->ptr;
+}
+
+// Protect a freed guarded block's page, so any later access faults and is reported
+static void free_guarded(MemoryManager* manager, GuardSlot* slot) {
+    GuardPool* pool = atomic_load_explicit(&manager->guard, memory_order_relaxed);
+    slot->free_thread = (pid_t)syscall(SYS_gettid);
+    slot->free_depth = record_guard_trace(slot->free_trace);
+    // Freed before the page is protected, so an access racing the free is reported as use-after-free.
+    // The lock is held across mprotect so no allocation takes the slot before its page is protected.
+    pthread_mutex_lock(&pool->lock);
+    atomic_store_explicit(&slot->state, GUARD_SLOT_FREED, memory_order_release);
+    mprotect(slot->block.raw, pool->page_size, PROT_NONE);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Unregister and unmap a manager's guarded pool
+static void free_guard_pool(MemoryManager* manager) {
+    GuardPool* pool = atomic_load(&manager->guard);
+    if (pool == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < GUARD_MAX_POOLS; i++) {
+        GuardPool* expected = pool;
+        atomic_compare_exchange_strong(&guard_pools[i], &expected, NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    munmap(pool->base, pool->length);
+    free(pool->slots);
+    free(pool);
+}
+
+// Order stores to a persistent heap as written, so a killed process leaves them in that order
+#define PERSIST_BARRIER() atomic_signal_fence(memory_order_seq_cst)
+
+// Block header in a persistent heap, in front of every block
+typedef struct {
+    uint32_t size_class; // The block, header included, spans 1 << size_class bytes
+    uint32_t state; // PERSISTENT_FREE or PERSISTENT_ALLOCATED
+    uint64_t next; // Offset of the next free block of the class while free, the block's tag while allocated
+} PersistentBlock;
+
+// Intent record replayed by recovery when a process dies between its commit and its clear
+typedef struct {
+    uint64_t block; // Offset of the block header
+    uint64_t link; // Offset of the word receiving the block's offset, or 0 when there is none
+    uint32_t op; // PERSISTENT_ALLOCATED or PERSISTENT_FREE
+    uint32_t valid;
+} PersistentLog;
+
+// Start of the file; every pointer inside the file is an offset from here
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean; // Set on close; recovery rebuilds the free lists when it is 0
+    uint64_t size; // File length
+    uint64_t top; // End of the blocks carved so far
+    uint64_t root;
+    uint64_t free_lists[PERSISTENT_CLASSES];
+    PersistentLog log;
+    pthread_mutex_t lock; // Process-shared and robust; serializes every change to the heap
+} PersistentHeader;
+
+// Process-local handle of a mapped persistent or shared heap
+struct PersistentHeap {
+    char* base; // Mapped at a different address in every process
+    size_t size;
+    int fd;
+    int shared; // Lives in a shared memory segment rather than a file
+    int recovered; // Open found the heap not cleanly closed
+};
+
+#define PERSISTENT_DATA_START (((sizeof(PersistentHeader) + PERSISTENT_ALIGNMENT - 1) / PERSISTENT_ALIGNMENT) * PERSISTENT_ALIGNMENT)
+
+static PersistentHeader* persistent_header(const PersistentHeap* heap) {
+    return (PersistentHeader*)heap->base;
+}
+
+static PersistentBlock* persistent_block(const PersistentHeap* heap, uint64_t offset) {
+    return (PersistentBlock*)(heap->base + offset);
+}
+
+// Check that an offset names a word inside the heap's data area
+static int persistent_word_valid(const PersistentHeap* heap, uint64_t offset) {
+    return offset >= PERSISTENT_DATA_START && offset % sizeof(uint64_t) == 0 && offset <= heap->size - sizeof(uint64_t);
+}
+
+// Replay an interrupted allocation or free, then rebuild the free lists by walking every block;
+// runs on open after a crash and when a process of a shared heap died holding its lock
+static int recover_persistent_heap(PersistentHeap* heap) {
+    PersistentHeader* header = persistent_header(heap);
+    PersistentLog* log = &header->log;
+    if (log->valid) {
+        if (log->block < PERSISTENT_DATA_START || log->block >= header->top ||
+            (log->link != 0 && !persistent_word_valid(heap, log->link))) {
+            return -1;
+        }
+        persistent_block(heap, log->block)->state = log->op;
+        if (log->op == PERSISTENT_ALLOCATED) {
+            persistent_block(heap, log->block)->next = log->block ^ PERSISTENT_BLOCK_TAG;
+        }
+        if (log->link != 0) {
+            *(uint64_t*)(heap->base + log->link) = log->op == PERSISTENT_ALLOCATED ? log->block + sizeof(PersistentBlock) : 0;
+        }
+        PERSIST_BARRIER();
+        log->valid = 0;
+    }
+
+    for (size_t c = 0; c < PERSISTENT_CLASSES; c++) {
+        header->free_lists[c] = 0;
+    }
+    uint64_t offset = PERSISTENT_DATA_START;
+    while (offset < header->top) {
+        PersistentBlock* block = persistent_block(heap, offset);
+        if (block->size_class < PERSISTENT_MIN_CLASS || block->size_class >= PERSISTENT_CLASSES ||
+            ((uint64_t)1 << block->size_class) > header->top - offset) {
+            return -1;
+        }
+        if (block->state == PERSISTENT_FREE) {
+            block->next = header->free_lists[block->size_class];
+            header->free_lists[block->size_class] = offset;
+        } else if (block->state != PERSISTENT_ALLOCATED) {
+            return -1;
+        }
+        offset += (uint64_t)1 << block->size_class;
+    }
+    return offset == header->top ? 0 : -1;
+}
+
+// Map a heap file or shared memory segment and set up its handle
+static PersistentHeap* map_persistent_heap(int fd, size_t size, int shared) {
+    PersistentHeap* heap = (PersistentHeap*)malloc(sizeof(PersistentHeap));
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (heap == NULL || base == MAP_FAILED) {
+        if (base != MAP_FAILED) {
+            munmap(base, size);
+        }
+        free(heap);
+        close(fd);
+        return NULL;
+    }
+    heap->base = (char*)base;
+    heap->size = size;
+    heap->fd = fd;
+    heap->shared = shared;
+    heap->recovered = 0;
+    return heap;
+}
+
+// Unmap a heap without touching its contents
+static void unmap_persistent_heap(PersistentHeap* heap) {
+    munmap(heap->base, heap->size);
+    close(heap->fd);
+    free(heap);
+}
+
+// Set up the heap's lock: shared between processes, and robust so a process dying with it is noticed
+static void init_persistent_lock(PersistentHeader* header) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Write an empty heap's header; the magic is written last and marks the heap ready
+static void format_persistent_heap(PersistentHeap* heap) {
+    PersistentHeader* header = persistent_header(heap);
+    memset(header, 0, sizeof(PersistentHeader));
+    header->version = PERSISTENT_VERSION;
+    header->size = heap->size;
+    header->top = PERSISTENT_DATA_START;
+    init_persistent_lock(header);
+    atomic_thread_fence(memory_order_release);
+    header->magic = PERSISTENT_MAGIC;
+}
+
+// Check a mapped header against the heap's size
+static int persistent_header_valid(const PersistentHeap* heap) {
+    const PersistentHeader* header = persistent_header(heap);
+    return header->magic == PERSISTENT_MAGIC && header->version == PERSISTENT_VERSION && header->size == heap->size &&
+           header->top >= PERSISTENT_DATA_START && header->top <= heap->size;
+}
+
+// Lock a heap; when the previous owner died holding the lock, redo its change as after a crash.
+// Returns -1 with errno set when the heap cannot be used: a failed recovery leaves the lock
+// unrecoverable, so every process sees ENOTRECOVERABLE from then on
+static int lock_persistent_heap(PersistentHeap* heap) {
+    PersistentHeader* header = persistent_header(heap);
+    int result = pthread_mutex_lock(&header->lock);
+    if (result == EOWNERDEAD) {
+        if (recover_persistent_heap(heap) != 0) {
+            pthread_mutex_unlock(&header->lock); // Without pthread_mutex_consistent
+            errno = EIO;
+            return -1;
+        }
+        pthread_mutex_consistent(&header->lock);
+    } else if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+static void unlock_persistent_heap(PersistentHeap* heap) {
+    pthread_mutex_unlock(&persistent_header(heap)->lock);
+}
+
+// Open a persistent heap file, creating it with the given size if it does not exist (size 0 only reattaches)
+PersistentHeap* open_persistent_heap(const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    // One process at a time, so the lock and the clean flag in the file can be reset on open
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    int created = st.st_size == 0;
+    if (created) {
+        if (size < PERSISTENT_DATA_START + ((size_t)1 << PERSISTENT_MIN_CLASS) || ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        size = (size_t)st.st_size;
+    }
+    PersistentHeap* heap = map_persistent_heap(fd, size, 0);
+    if (heap == NULL) {
+        return NULL;
+    }
+
+    // A file whose creation was cut short has no magic yet and is set up again
+    PersistentHeader* header = persistent_header(heap);
+    if (created || header->magic == 0) {
+        format_persistent_heap(heap);
+    } else if (!persistent_header_valid(heap)) {
+        unmap_persistent_heap(heap);
+        errno = EINVAL;
+        return NULL;
+    } else {
+        init_persistent_lock(header);
+        if (!header->clean) {
+            heap->recovered = 1;
+            if (recover_persistent_heap(heap) != 0) {
+                unmap_persistent_heap(heap);
+                errno = EIO;
+                return NULL;
+            }
+        }
+    }
+    header->clean = 0;
+    return heap;
+}
+
+// Create or attach to a heap in a POSIX shared memory segment, for allocation across processes
+PersistentHeap* open_shared_heap(const char* name, size_t size) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    int created = fd >= 0;
+    if (!created) {
+        if (errno != EEXIST || (fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600)) < 0) {
+            return NULL;
+        }
+    }
+
+    // Attachers wait for the creator to size the segment and write the magic
+    struct stat st;
+    if (created) {
+        if (size < PERSISTENT_DATA_START + ((size_t)1 << PERSISTENT_MIN_CLASS) || ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            shm_unlink(name);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        int waited = 0;
+        while (fstat(fd, &st) == 0 && st.st_size == 0 && waited++ < SHARED_HEAP_ATTACH_SPINS) {
+            sched_yield();
+        }
+        if (st.st_size == 0) {
+            close(fd);
+            errno = EAGAIN;
+            return NULL;
+        }
+        size = (size_t)st.st_size;
+    }
+    PersistentHeap* heap = map_persistent_heap(fd, size, 1);
+    if (heap == NULL) {
+        return NULL;
+    }
+
+    PersistentHeader* header = persistent_header(heap);
+    if (created) {
+        format_persistent_heap(heap);
+        return heap;
+    }
+    int waited = 0;
+    while (*(volatile uint64_t*)&header->magic == 0 && waited++ < SHARED_HEAP_ATTACH_SPINS) {
+        sched_yield();
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (!persistent_header_valid(heap)) {
+        unmap_persistent_heap(heap);
+        errno = header->magic == 0 ? EAGAIN : EINVAL;
+        return NULL;
+    }
+    return heap;
+}
+
+// Remove a shared heap's name; processes that have it open keep using it
+int unlink_shared_heap(const char* name) {
+    return shm_unlink(name);
+}
+
+// Detach from a heap: a file heap is flushed and marked cleanly closed, a shared heap is only unmapped
+void close_persistent_heap(PersistentHeap* heap) {
+    PersistentHeader* header = persistent_header(heap);
+    if (!heap->shared) {
+        msync(heap->base, heap->size, MS_SYNC);
+        if (!header->log.valid) {
+            header->clean = 1;
+            msync(heap->base, heap->size, MS_SYNC);
+        }
+        pthread_mutex_destroy(&header->lock);
+    }
+    unmap_persistent_heap(heap);
+}
+
+// Check whether opening the heap had to recover from a process that did not close it
+int persistent_heap_recovered(const PersistentHeap* heap) {
+    return heap->recovered;
+}
+
+// Write a persistent heap's changes back to its file
+int persistent_sync(PersistentHeap* heap) {
+    return msync(heap->base, heap->size, MS_SYNC);
+}
+
+// Allocate from a persistent heap; when link is given (a word inside the heap), the block's
+// offset is stored there in the same crash-atomic step, so a crash can never leak the block
+void* persistent_allocate(PersistentHeap* heap, size_t size, uint64_t* link) {
+    uint64_t link_offset = link != NULL ? (uint64_t)((char*)link - heap->base) : 0;
+    if ((link != NULL && ((char*)link < heap->base || !persistent_word_valid(heap, link_offset))) ||
+        size > heap->size || size > ((uint64_t)1 << (PERSISTENT_CLASSES - 1)) - sizeof(PersistentBlock)) {
+        return NULL; // Larger than the heap or than the largest class
+    }
+    uint32_t size_class = PERSISTENT_MIN_CLASS;
+    while (((uint64_t)1 << size_class) - sizeof(PersistentBlock) < size) {
+        size_class++;
+    }
+
+    if (lock_persistent_heap(heap) != 0) {
+        return NULL;
+    }
+    PersistentHeader* header = persistent_header(heap);
+    uint64_t offset = header->free_lists[size_class];
+    uint64_t length = (uint64_t)1 << size_class;
+    if (offset == 0) {
+        // Carve a new block: its header is complete before top moves past it
+        if (length > header->size - header->top) {
+            unlock_persistent_heap(heap);
+            return NULL;
+        }
+        offset = header->top;
+        PersistentBlock* block = persistent_block(heap, offset);
+        block->size_class = size_class;
+        block->state = PERSISTENT_FREE;
+        block->next = 0;
+        PERSIST_BARRIER();
+        header->top = offset + length;
+    } else {
+        header->free_lists[size_class] = persistent_block(heap, offset)->next;
+    }
+    persistent_block(heap, offset)->next = offset ^ PERSISTENT_BLOCK_TAG; // Off every free list now
+    PERSIST_BARRIER();
+
+    // The log's valid flag is the commit point; everything after it is replayed after a crash
+    PersistentLog* log = &header->log;
+    log->block = offset;
+    log->link = link_offset;
+    log->op = PERSISTENT_ALLOCATED;
+    PERSIST_BARRIER();
+    log->valid = 1;
+    PERSIST_BARRIER();
+    persistent_block(heap, offset)->state = PERSISTENT_ALLOCATED;
+    if (link != NULL) {
+        *link = offset + sizeof(PersistentBlock);
+    }
+    PERSIST_BARRIER();
+    log->valid = 0;
+    unlock_persistent_heap(heap);
+    return heap->base + offset + sizeof(PersistentBlock);
+}
+
+// Free a persistent block, clearing link (a word inside the heap, or NULL) in the same crash-atomic step
+void persistent_free(PersistentHeap* heap, void* ptr, uint64_t* link) {
+    uint64_t offset = persistent_offset(heap, ptr);
+    uint64_t link_offset = link != NULL ? (uint64_t)((char*)link - heap->base) : 0;
+    if (offset == 0 || offset < PERSISTENT_DATA_START + sizeof(PersistentBlock) ||
+        (link != NULL && ((char*)link < heap->base || !persistent_word_valid(heap, link_offset)))) {
+        return;
+    }
+    offset -= sizeof(PersistentBlock);
+
+    if (lock_persistent_heap(heap) != 0) {
+        return;
+    }
+    PersistentHeader* header = persistent_header(heap);
+    PersistentBlock* block = persistent_block(heap, offset);
+    // An interior pointer can land on user data that looks like a header, but not on one with the
+    // tag of its own offset
+    if (offset >= header->top || (offset - PERSISTENT_DATA_START) % ((uint64_t)1 << PERSISTENT_MIN_CLASS) != 0 ||
+        block->state != PERSISTENT_ALLOCATED || block->next != (offset ^ PERSISTENT_BLOCK_TAG) ||
+        block->size_class < PERSISTENT_MIN_CLASS || block->size_class >= PERSISTENT_CLASSES ||
+        ((uint64_t)1 << block->size_class) > header->top - offset) {
+        unlock_persistent_heap(heap);
+        return; // Not a live block of this heap
+    }
+    PersistentLog* log = &header->log;
+    log->block = offset;
+    log->link = link_offset;
+    log->op = PERSISTENT_FREE;
+    PERSIST_BARRIER();
+    log->valid = 1;
+    PERSIST_BARRIER();
+    block->state = PERSISTENT_FREE;
+    if (link != NULL) {
+        *link = 0;
+    }
+    PERSIST_BARRIER();
+    log->valid = 0;
+    PERSIST_BARRIER();
+
+    // The free list is rebuilt by recovery, so pushing onto it needs no logging
+    block->next = header->free_lists[block->size_class];
+    header->free_lists[block->size_class] = offset;
+    unlock_persistent_heap(heap);
+}
+
+// Convert a pointer into a persistent heap to its offset, 0 for NULL or a pointer outside the heap
+uint64_t persistent_offset(const PersistentHeap* heap, const void* ptr) {
+    const char* p = (const char*)ptr;
+    if (p == NULL || p < heap->base + PERSISTENT_DATA_START || p >= heap->base + heap->size) {
+        return 0;
+    }
+    return (uint64_t)(p - heap->base);
+}
+
+// Convert an offset in a persistent heap back to a pointer in this mapping, NULL for 0
+void* persistent_pointer(const PersistentHeap* heap, uint64_t offset) {
+    return offset != 0 && offset < heap->size ? heap->base + offset : NULL;
+}
+
+// Set the offset applications find their data from after reattaching
+void persistent_set_root(PersistentHeap* heap, uint64_t offset) {
+    persistent_header(heap)->root = offset;
+}
+
+// Get the root offset
+uint64_t persistent_root(const PersistentHeap* heap) {
+    return persistent_header(heap)->root;
 }
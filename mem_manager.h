@@ -0,0 +1,240 @@
+// Public interface of the memory manager library (libamm)
+#ifndef MEM_MANAGER_H
+#define MEM_MANAGER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifndef __cplusplus
+#include <stdatomic.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Heap blocks at least this large get their own mapping
+#define MMAP_THRESHOLD_DEFAULT ((size_t)256 << 10)
+
+// Limits
+#define MAX_SIZE_CLASSES 64 // Pools per arena
+#define MAX_ARENAS 64
+#define MAX_CONFIG_POOLS 16 // Pools a MemoryManagerConfig can list
+#define GUARD_DEFAULT_SLOTS 64 // Guarded allocations live at once, unless configured otherwise
+#define HAZARD_SLOTS 4 // Hazard pointers per thread
+#define CACHE_LINE_SIZE 64 // Slot alignment of padded object pools
+
+// Copy engine tuning
+#define COPY_BENCHMARK_MAX_SIZE ((size_t)1 << 30)
+#define COPY_BATCH_ALIGNMENT 16 // Alignment of each copy in a contiguous batch
+#define HEAP_BENCHMARK_OPERATIONS ((size_t)1 << 20)
+
+// Smallest buffer write_heap_snapshot can make progress with
+#define SNAPSHOT_MIN_BUFFER 512
+
+typedef struct MemoryManager MemoryManager;
+typedef struct MemPool MemPool;
+typedef struct PersistentHeap PersistentHeap;
+typedef struct StackAllocator StackAllocator;
+
+// Object pool hook, called with the object and the pool's hook context
+typedef void (*ObjectHook)(void* object, void* context);
+
+// Description of a typed object pool
+typedef struct {
+    size_t object_size;
+    size_t alignment;
+    size_t capacity; // Objects in the pool
+    ObjectHook init; // Called once for every object when the pool is created (optional)
+    ObjectHook reset; // Called on every freed object, so the next allocation gets it initialized (optional)
+    void* hook_context;
+    int pad_to_cache_line; // Give every object cache lines of its own, avoiding false sharing
+} ObjectPoolConfig;
+
+// Source of heap blocks below the mmap threshold, those the pools do not serve
+typedef enum {
+    HEAP_BACKEND_BUDDY, // Buddy regions for 4 KiB to 1 MiB, malloc for the rest
+    HEAP_BACKEND_TLSF, // One TLSF heap per arena for every size, in bounded time
+    HEAP_BACKEND_MALLOC // malloc for every size
+} HeapBackend;
+
+// How threads reach the pools; every mode is thread-safe
+typedef enum {
+    THREAD_MODE_CACHED, // Per-thread caches in front of the pools
+    THREAD_MODE_PER_CPU, // Per-CPU caches, bounded by the CPU count instead of the thread count
+    THREAD_MODE_LOCKED // No caches: every pool allocation and free takes the pool lock
+} ThreadMode;
+
+// Transparent huge page advice for the manager's own mappings
+typedef enum {
+    HUGE_PAGES_DEFAULT, // Leave it to the system setting
+    HUGE_PAGES_ALWAYS, // MADV_HUGEPAGE
+    HUGE_PAGES_NEVER // MADV_NOHUGEPAGE
+} HugePagePolicy;
+
+// Pool that create_memory_manager_ex creates in every arena
+typedef struct {
+    size_t block_size;
+    size_t block_count;
+    size_t alignment;
+} PoolConfig;
+
+// Settings of create_memory_manager_ex; fill in the defaults with init_memory_manager_config first.
+// Options in the AMM_CONF environment variable take precedence over these fields, and each one that
+// does is named on stderr
+typedef struct {
+    HeapBackend backend;
+    ThreadMode threads;
+    size_t arenas; // Shared arenas, arena 0 included
+    int numa; // One arena per NUMA node instead, as with enable_numa_arenas
+    size_t mmap_threshold; // Heap blocks from this size up get their own mapping (0 = never)
+    int cow_blocks; // Map those blocks from a memfd each, so copy_memory_cow can share them; costs one fd per block
+    HugePagePolicy huge_pages;
+    size_t thread_cache_bytes; // Bytes cached across all threads, as with set_thread_cache_cap
+    size_t sample_rate; // Record the allocation site of one in N allocations (0 = never)
+    int report_leaks; // Print a leak report from free_memory_manager
+    int defer_decrements;
+    size_t decay_ms; // Least time between returns of free heap pages to the system (0 = only in defragment_memory)
+    size_t guard_sample_rate; // Guard one in N allocations with PROT_NONE pages (0 = never)
+    size_t guard_slots; // Guarded allocations live at once
+    size_t pool_count;
+    PoolConfig pools[MAX_CONFIG_POOLS];
+} MemoryManagerConfig;
+
+// Allocation statistics
+typedef struct {
+    size_t allocations;
+    size_t deallocations;
+    size_t pool_hits; // Allocations served from a pool
+    size_t pool_misses; // Allocations that fell back to the heap
+    size_t blocks_in_use;
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+} MemStats;
+
+// Where freed pool blocks are cached before going back to their pool
+typedef enum {
+    CACHE_PER_THREAD,
+    CACHE_PER_CPU // Bounded by CPU count instead of thread count
+} CacheMode;
+
+// Heap snapshot output formats
+typedef enum {
+    SNAPSHOT_JSON,
+    SNAPSHOT_BINARY // Little-endian records, see write_heap_snapshot
+} SnapshotFormat;
+
+// Resumable position of a heap snapshot
+typedef struct {
+    SnapshotFormat format;
+    int stage;
+    size_t arena; // Arena table index while walking pools and blocks
+    size_t pool; // Pool table index while walking pool blocks
+    size_t position;
+    size_t emitted; // Records written in the current stage
+} SnapshotCursor;
+
+// Position of a stack allocator, returned by stack_push
+typedef struct {
+    size_t top;
+    size_t live; // Allocations on the stack when the marker was pushed
+} StackMarker;
+
+// One source of a batched copy
+typedef struct {
+    const void* src;
+    size_t size;
+} CopyRequest;
+
+// Function prototypes
+MemoryManager* create_memory_manager();
+MemoryManager* create_memory_manager_backend(HeapBackend backend);
+void init_memory_manager_config(MemoryManagerConfig* config);
+int parse_memory_manager_config(MemoryManagerConfig* config, const char* options);
+MemoryManager* create_memory_manager_ex(const MemoryManagerConfig* config);
+void* allocate_memory(MemoryManager* manager, size_t size, size_t alignment);
+void increment_ref_count(MemoryManager* manager, void* ptr);
+void decrement_ref_count(MemoryManager* manager, void* ptr);
+void free_unreferenced_block(MemoryManager* manager, void* ptr);
+size_t block_usable_size(void* ptr);
+void deallocate_memory(MemoryManager* manager, void* ptr);
+void set_deferred_decrements(MemoryManager* manager, int enabled);
+void flush_deferred_decrements(MemoryManager* manager);
+void epoch_enter(MemoryManager* manager);
+void epoch_exit(MemoryManager* manager);
+void retire_memory(MemoryManager* manager, void* ptr);
+void epoch_reclaim(MemoryManager* manager);
+void hazard_clear(MemoryManager* manager, int slot);
+void hazard_retire(MemoryManager* manager, void* ptr);
+void hazard_reclaim(MemoryManager* manager);
+void* reallocate_memory(MemoryManager* manager, void* ptr, size_t new_size, size_t alignment);
+void* copy_memory(MemoryManager* manager, void* src, size_t size);
+void* copy_memory_cow(MemoryManager* manager, void* src, size_t size);
+void* copy_memory_aligned(MemoryManager* manager, void* src, size_t size, size_t alignment);
+int copy_memory_batch(MemoryManager* manager, const CopyRequest* requests, size_t count, void** dests, int contiguous);
+void set_mmap_threshold(MemoryManager* manager, size_t threshold);
+void copy_bytes(void* dest, const void* src, size_t size);
+const char* copy_engine_name(void);
+void benchmark_copy(FILE* out, size_t max_size);
+int benchmark_heap_latency(FILE* out, size_t operations);
+void free_memory_manager(MemoryManager* manager);
+void lock_manager_for_fork(MemoryManager* manager);
+void unlock_manager_after_fork(MemoryManager* manager);
+void reset_manager_after_fork(MemoryManager* manager);
+void print_memory_blocks(MemoryManager* manager);
+void defragment_memory(MemoryManager* manager);
+void create_memory_pool(MemoryManager* manager, size_t block_size, size_t block_count, size_t alignment);
+void* allocate_from_pool(MemoryManager* manager, size_t size, size_t alignment);
+int find_pool_class(MemoryManager* manager, size_t size, size_t alignment);
+void* allocate_from_class(MemoryManager* manager, int class_index, size_t size, size_t alignment);
+MemPool* create_object_pool(MemoryManager* manager, const ObjectPoolConfig* config);
+void* allocate_object(MemoryManager* manager, MemPool* pool);
+void set_thread_cache_cap(MemoryManager* manager, size_t max_cached_bytes);
+void flush_thread_cache(MemoryManager* manager);
+int set_cache_mode(MemoryManager* manager, CacheMode mode);
+int create_arena(MemoryManager* manager, int dedicated);
+int create_node_arena(MemoryManager* manager, int node);
+int enable_numa_arenas(MemoryManager* manager);
+void create_arena_pool(MemoryManager* manager, int arena, size_t block_size, size_t block_count, size_t alignment);
+void bind_thread_to_arena(MemoryManager* manager, int arena);
+int thread_arena(MemoryManager* manager);
+void* allocate_in_arena(MemoryManager* manager, int arena, size_t size, size_t alignment);
+int cache_uses_rseq(MemoryManager* manager);
+void enable_leak_report(MemoryManager* manager, size_t sample_rate);
+int enable_guarded_sampling(MemoryManager* manager, size_t sample_rate, size_t slots);
+void report_leaks(MemoryManager* manager, FILE* out);
+void get_memory_stats(MemoryManager* manager, MemStats* stats);
+void begin_heap_snapshot(SnapshotCursor* cursor, SnapshotFormat format);
+size_t write_heap_snapshot(MemoryManager* manager, SnapshotCursor* cursor, void* buffer, size_t capacity);
+int heap_snapshot_done(const SnapshotCursor* cursor);
+StackAllocator* create_stack_allocator(MemoryManager* manager, size_t capacity, int debug);
+void* stack_allocate(StackAllocator* stack, size_t size, size_t alignment);
+void stack_free(StackAllocator* stack, void* ptr);
+StackMarker stack_push(StackAllocator* stack);
+void stack_pop(StackAllocator* stack, StackMarker marker);
+size_t stack_used(const StackAllocator* stack);
+void destroy_stack_allocator(StackAllocator* stack);
+PersistentHeap* open_persistent_heap(const char* path, size_t size);
+void close_persistent_heap(PersistentHeap* heap);
+PersistentHeap* open_shared_heap(const char* name, size_t size);
+int unlink_shared_heap(const char* name);
+int persistent_heap_recovered(const PersistentHeap* heap);
+int persistent_sync(PersistentHeap* heap);
+void* persistent_allocate(PersistentHeap* heap, size_t size, uint64_t* link);
+void persistent_free(PersistentHeap* heap, void* ptr, uint64_t* link);
+uint64_t persistent_offset(const PersistentHeap* heap, const void* ptr);
+void* persistent_pointer(const PersistentHeap* heap, uint64_t offset);
+void persistent_set_root(PersistentHeap* heap, uint64_t offset);
+uint64_t persistent_root(const PersistentHeap* heap);
+
+// Functions taking C11 atomics; C++ callers get them from mem_manager.hpp
+#ifndef __cplusplus
+atomic_int* block_ref_count(void* ptr);
+void* hazard_protect(MemoryManager* manager, int slot, void* _Atomic* source);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MEM_MANAGER_H
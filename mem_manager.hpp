@@ -0,0 +1,311 @@
+// C++ interface to the memory manager: a std::pmr::memory_resource and a stateless STL allocator
+#ifndef MEM_MANAGER_HPP
+#define MEM_MANAGER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "mem_manager.h"
+
+// C functions that mem_manager.h declares only for C, because they take C11 atomics
+extern "C" {
+std::atomic<int>* block_ref_count(void* ptr); // atomic_int* on the C side
+}
+
+// The redeclaration above treats the C side's atomic_int as a std::atomic<int>. The two share a
+// layout only when the C++ type is a plain lock-free int, as on GCC and Clang; anything else would
+// have the two languages disagree on the reference count
+static_assert(sizeof(std::atomic<int>) == sizeof(int) && alignof(std::atomic<int>) == alignof(int),
+              "std::atomic<int> must have the layout of the C side's atomic_int");
+static_assert(std::atomic<int>::is_always_lock_free, "std::atomic<int> must be lock-free to match atomic_int");
+
+namespace mm {
+
+// Size classes served by pool_resource pools, smallest first
+inline constexpr std::size_t size_classes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1024, 2048};
+inline constexpr std::size_t class_count = sizeof(size_classes) / sizeof(size_classes[0]);
+inline constexpr std::size_t class_alignment = alignof(std::max_align_t);
+inline constexpr std::size_t no_class = class_count;
+
+// Index of the smallest size class that fits, or no_class; constant-folded when size and alignment are
+constexpr std::size_t size_class_index(std::size_t size, std::size_t alignment) noexcept {
+    if (alignment > class_alignment) {
+        return no_class;
+    }
+    for (std::size_t i = 0; i < class_count; i++) {
+        if (size <= size_classes[i]) {
+            return i;
+        }
+    }
+    return no_class;
+}
+
+// Memory resource backed by a manager's pools; the manager must outlive it
+class pool_resource : public std::pmr::memory_resource {
+public:
+    // Map the size classes to the manager's pools, first creating blocks_per_class blocks
+    // per class in every arena when blocks_per_class is non-zero
+    explicit pool_resource(MemoryManager* manager, std::size_t blocks_per_class = 0) noexcept : manager_(manager) {
+        for (std::size_t i = 0; i < class_count; i++) {
+            if (blocks_per_class != 0) {
+                create_memory_pool(manager, size_classes[i], blocks_per_class, class_alignment);
+            }
+            pools_[i] = find_pool_class(manager, size_classes[i], class_alignment);
+        }
+    }
+
+    MemoryManager* manager() const noexcept {
+        return manager_;
+    }
+
+    // Allocate without going through the virtual interface; NULL when out of memory
+    void* allocate_bytes(std::size_t bytes, std::size_t alignment) noexcept {
+        std::size_t index = size_class_index(bytes, alignment);
+        if (index != no_class) {
+            return allocate_from_class(manager_, pools_[index], bytes, alignment);
+        }
+        return allocate_memory(manager_, bytes, alignment);
+    }
+
+    // Allocate with the size class chosen at compile time
+    template <std::size_t Bytes, std::size_t Alignment>
+    void* allocate_fixed() noexcept {
+        constexpr std::size_t index = size_class_index(Bytes, Alignment);
+        if constexpr (index != no_class) {
+            return allocate_from_class(manager_, pools_[index], Bytes, Alignment);
+        } else {
+            return allocate_memory(manager_, Bytes, Alignment);
+        }
+    }
+
+    void deallocate_bytes(void* ptr) noexcept {
+        deallocate_memory(manager_, ptr);
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void* ptr = allocate_bytes(bytes, alignment);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t, std::size_t) override {
+        deallocate_bytes(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        const pool_resource* resource = dynamic_cast<const pool_resource*>(&other);
+        return resource != nullptr && resource->manager_ == manager_;
+    }
+
+private:
+    MemoryManager* manager_;
+    int pools_[class_count];
+};
+
+// Resource used by every mm::allocator. Set it before any allocator allocates, and keep it alive
+// until every container using mm::allocator is destroyed; allocating without one throws std::bad_alloc
+inline pool_resource* default_pool_resource_ = nullptr;
+
+inline void set_default_pool_resource(pool_resource* resource) noexcept {
+    default_pool_resource_ = resource;
+}
+
+inline pool_resource* default_pool_resource() noexcept {
+    return default_pool_resource_;
+}
+
+// Stateless allocator drawing from the default pool resource; single objects such as
+// list, map and hash nodes get their size class at compile time
+template <typename T>
+class allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+
+    allocator() noexcept = default;
+
+    template <typename U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if (default_pool_resource_ == nullptr) {
+            throw std::bad_alloc();
+        }
+        void* ptr;
+        if (n == 1) {
+            ptr = default_pool_resource_->allocate_fixed<sizeof(T), alignof(T)>();
+        } else {
+            if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+                throw std::bad_array_new_length();
+            }
+            ptr = default_pool_resource_->allocate_bytes(n * sizeof(T), alignof(T));
+        }
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    // Leaks the memory if the default resource was cleared while the container was alive
+    void deallocate(T* ptr, std::size_t) noexcept {
+        if (default_pool_resource_ != nullptr) {
+            default_pool_resource_->deallocate_bytes(ptr);
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+// Intrusive reference-counted pointer to an object in a manager block. It shares the block's
+// own ref_count: copies add to it inline, moves leave it alone, and the last owner destroys
+// the object and frees the block. Copying the pointer never allocates.
+template <typename T>
+class ref_ptr {
+public:
+    ref_ptr() noexcept = default;
+
+    // Take over one reference to ptr, which must start a manager block (NULL is allowed)
+    ref_ptr(MemoryManager* manager, T* ptr) noexcept
+        : ptr_(ptr), count_(ptr != nullptr ? block_ref_count(const_cast<std::remove_cv_t<T>*>(ptr)) : nullptr),
+          manager_(manager) {
+        if (count_ == nullptr) {
+            ptr_ = nullptr;
+        }
+    }
+
+    ref_ptr(const ref_ptr& other) noexcept : ptr_(other.ptr_), count_(other.count_), manager_(other.manager_) {
+        if (count_ != nullptr) {
+            count_->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    ref_ptr(ref_ptr&& other) noexcept : ptr_(other.ptr_), count_(other.count_), manager_(other.manager_) {
+        other.ptr_ = nullptr;
+        other.count_ = nullptr;
+    }
+
+    ~ref_ptr() {
+        release();
+    }
+
+    ref_ptr& operator=(ref_ptr other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void swap(ref_ptr& other) noexcept {
+        std::swap(ptr_, other.ptr_);
+        std::swap(count_, other.count_);
+        std::swap(manager_, other.manager_);
+    }
+
+    void reset() noexcept {
+        release();
+        ptr_ = nullptr;
+        count_ = nullptr;
+    }
+
+    T* get() const noexcept {
+        return ptr_;
+    }
+
+    T& operator*() const noexcept {
+        return *ptr_;
+    }
+
+    T* operator->() const noexcept {
+        return ptr_;
+    }
+
+    explicit operator bool() const noexcept {
+        return ptr_ != nullptr;
+    }
+
+    int use_count() const noexcept {
+        return count_ != nullptr ? count_->load(std::memory_order_relaxed) : 0;
+    }
+
+private:
+    void release() noexcept {
+        if (count_ != nullptr && count_->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            ptr_->~T();
+            free_unreferenced_block(manager_, const_cast<std::remove_cv_t<T>*>(ptr_));
+        }
+    }
+
+    T* ptr_ = nullptr;
+    std::atomic<int>* count_ = nullptr;
+    MemoryManager* manager_ = nullptr;
+};
+
+template <typename T, typename U>
+bool operator==(const ref_ptr<T>& a, const ref_ptr<U>& b) noexcept {
+    return a.get() == b.get();
+}
+
+template <typename T, typename U>
+bool operator!=(const ref_ptr<T>& a, const ref_ptr<U>& b) noexcept {
+    return a.get() != b.get();
+}
+
+// Construct an object in a new block owned by a ref_ptr
+template <typename T, typename... Args>
+ref_ptr<T> make_ref(MemoryManager* manager, Args&&... args) {
+    void* ptr = allocate_memory(manager, sizeof(T), alignof(T));
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    T* object;
+    try {
+        object = ::new (ptr) T(std::forward<Args>(args)...);
+    } catch (...) {
+        deallocate_memory(manager, ptr);
+        throw;
+    }
+    return ref_ptr<T>(manager, object);
+}
+
+// Scope on a stack allocator: everything allocated from it during the frame's lifetime is
+// released when the frame is destroyed
+class stack_frame {
+public:
+    explicit stack_frame(StackAllocator* stack) noexcept : stack_(stack), marker_(stack_push(stack)) {}
+
+    stack_frame(const stack_frame&) = delete;
+    stack_frame& operator=(const stack_frame&) = delete;
+
+    ~stack_frame() {
+        stack_pop(stack_, marker_);
+    }
+
+    // Allocate inside the frame; NULL when the stack is full
+    void* allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+        return stack_allocate(stack_, bytes, alignment);
+    }
+
+private:
+    StackAllocator* stack_;
+    StackMarker marker_;
+};
+
+} // namespace mm
+
+#endif // MEM_MANAGER_HPP
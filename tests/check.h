@@ -0,0 +1,16 @@
+// Assertion helper shared by the tests; a failed check prints where and exits with failure
+#ifndef AMM_TEST_CHECK_H
+#define AMM_TEST_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(condition)                                                                \
+    do {                                                                                \
+        if (!(condition)) {                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(EXIT_FAILURE);                                                         \
+        }                                                                               \
+    } while (0)
+
+#endif // AMM_TEST_CHECK_H
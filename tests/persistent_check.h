@@ -0,0 +1,72 @@
+// Heap walk shared by the persistent and shared heap tests; include after mem_manager.c
+#ifndef AMM_TEST_PERSISTENT_CHECK_H
+#define AMM_TEST_PERSISTENT_CHECK_H
+
+#include "check.h"
+
+#define HEAP_SIZE ((size_t)4 << 20) // Largest heap check_heap can walk
+#define SLOTS 64 // Link words in the root block, each 0 or the offset of a live block
+
+// Mark of each possible block start while checking, indexed by (offset - PERSISTENT_DATA_START) >> PERSISTENT_MIN_CLASS
+enum { MARK_NONE, MARK_FREE, MARK_ALLOCATED, MARK_LISTED, MARK_LINKED };
+
+static unsigned char marks[HEAP_SIZE >> PERSISTENT_MIN_CLASS];
+
+static size_t mark_index(uint64_t offset) {
+    return (size_t)((offset - PERSISTENT_DATA_START) >> PERSISTENT_MIN_CLASS);
+}
+
+// Check that the blocks tile the heap, that the free lists hold exactly the free blocks of their class,
+// and that every allocated block but the root is linked from exactly one root slot
+static void check_heap(PersistentHeap* heap) {
+    PersistentHeader* header = persistent_header(heap);
+    CHECK(heap->size <= HEAP_SIZE);
+    CHECK(persistent_header_valid(heap));
+    CHECK(!header->log.valid);
+    memset(marks, MARK_NONE, sizeof(marks));
+
+    size_t free_blocks = 0;
+    size_t allocated_blocks = 0;
+    uint64_t offset = PERSISTENT_DATA_START;
+    while (offset < header->top) {
+        PersistentBlock* block = persistent_block(heap, offset);
+        CHECK(block->size_class >= PERSISTENT_MIN_CLASS && block->size_class < PERSISTENT_CLASSES);
+        CHECK(block->state == PERSISTENT_FREE || block->state == PERSISTENT_ALLOCATED);
+        CHECK(block->state == PERSISTENT_FREE || block->next == (offset ^ PERSISTENT_BLOCK_TAG));
+        marks[mark_index(offset)] = block->state == PERSISTENT_FREE ? MARK_FREE : MARK_ALLOCATED;
+        free_blocks += block->state == PERSISTENT_FREE;
+        allocated_blocks += block->state == PERSISTENT_ALLOCATED;
+        offset += (uint64_t)1 << block->size_class;
+    }
+    CHECK(offset == header->top);
+
+    size_t listed = 0;
+    for (uint32_t c = 0; c < PERSISTENT_CLASSES; c++) {
+        for (uint64_t entry = header->free_lists[c]; entry != 0; entry = persistent_block(heap, entry)->next) {
+            CHECK(entry >= PERSISTENT_DATA_START && entry < header->top);
+            CHECK(marks[mark_index(entry)] == MARK_FREE); // A block start, free, and not listed twice
+            CHECK(persistent_block(heap, entry)->size_class == c);
+            marks[mark_index(entry)] = MARK_LISTED;
+            listed++;
+        }
+    }
+    CHECK(listed == free_blocks);
+
+    uint64_t root = persistent_root(heap);
+    CHECK(root >= PERSISTENT_DATA_START + sizeof(PersistentBlock) && root < header->top);
+    CHECK(marks[mark_index(root - sizeof(PersistentBlock))] == MARK_ALLOCATED);
+    marks[mark_index(root - sizeof(PersistentBlock))] = MARK_LINKED;
+    uint64_t* slots = (uint64_t*)persistent_pointer(heap, root);
+    size_t linked = 1;
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (slots[i] != 0) {
+            CHECK(slots[i] >= PERSISTENT_DATA_START + sizeof(PersistentBlock) && slots[i] < header->top);
+            CHECK(marks[mark_index(slots[i] - sizeof(PersistentBlock))] == MARK_ALLOCATED); // Live, linked once
+            marks[mark_index(slots[i] - sizeof(PersistentBlock))] = MARK_LINKED;
+            linked++;
+        }
+    }
+    CHECK(linked == allocated_blocks); // No leaked block
+}
+
+#endif // AMM_TEST_PERSISTENT_CHECK_H
@@ -0,0 +1,81 @@
+// Arenas: threads are spread over the shared arenas and never given a dedicated one; a bound thread
+// and allocate_in_arena use the arena asked for; a block freed from another arena goes straight back
+// to its owner's pool; rebinding hands the thread's cached blocks back to the arena it leaves
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 256
+#define THREADS 8
+
+static MemoryManager* manager;
+
+// Pool of one size in one arena
+static MemPool* arena_pool(int arena) {
+    MemArena* owner = manager->arenas[arena];
+    return owner->pool_table[owner->pool_count - 1];
+}
+
+// Report the arena the thread was given
+static void* report_arena(void* arg) {
+    *(int*)arg = thread_arena(manager);
+    return NULL;
+}
+
+// Bind to an arena and allocate a block from its pool
+static void* allocate_bound(void* arg) {
+    void** blocks = (void**)arg;
+    bind_thread_to_arena(manager, 2);
+    CHECK(thread_arena(manager) == 2);
+    blocks[0] = allocate_from_pool(manager, 64, 16);
+    blocks[1] = allocate_in_arena(manager, 1, 64, 16);
+    return NULL;
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    CHECK(create_arena(manager, 0) == 1);
+    CHECK(create_arena(manager, 1) == 2);
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+
+    // New threads go round the shared arenas and never reach the dedicated one
+    int seen[THREADS];
+    int used[3] = {0};
+    for (int i = 0; i < THREADS; i++) {
+        pthread_t thread;
+        CHECK(pthread_create(&thread, NULL, report_arena, &seen[i]) == 0);
+        pthread_join(thread, NULL);
+        CHECK(seen[i] == 0 || seen[i] == 1);
+        used[seen[i]]++;
+    }
+    CHECK(used[0] > 0 && used[1] > 0 && used[2] == 0);
+
+    // A bound thread allocates from its arena, and allocate_in_arena from the one named
+    void* blocks[2];
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, allocate_bound, blocks) == 0);
+    pthread_join(thread, NULL);
+    CHECK(blocks[0] != NULL && find_block(blocks[0])->pool == arena_pool(2));
+    CHECK(blocks[1] != NULL && find_block(blocks[1])->pool == arena_pool(1));
+    CHECK(allocate_in_arena(manager, 3, 64, 16) == NULL);
+
+    // Freed here, each block goes straight back to its owner's pool rather than into this thread's bins
+    bind_thread_to_arena(manager, 0);
+    size_t free_two = arena_pool(2)->free_count;
+    size_t free_one = arena_pool(1)->free_count;
+    deallocate_memory(manager, blocks[0]);
+    deallocate_memory(manager, blocks[1]);
+    CHECK(arena_pool(2)->free_count == free_two + 1 && arena_pool(1)->free_count == free_one + 1);
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    CHECK(cache->bins[arena_pool(2)->class_index].count == 0);
+
+    // Rebinding hands the thread's cached blocks back to the arena it leaves
+    void* cached = allocate_from_pool(manager, 64, 16);
+    deallocate_memory(manager, cached);
+    CHECK(cache->bins[arena_pool(0)->class_index].count > 0);
+    bind_thread_to_arena(manager, 1);
+    CHECK(thread_arena(manager) == 1 && arena_pool(0)->free_count == POOL_BLOCKS);
+
+    free_memory_manager(manager);
+    printf("arenas: ok\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Buddy regions: splitting down to the requested order, merging with free buddies, and every
+// allocated block coalescing back into whole top blocks once freed
+#include "../mem_manager.c"
+#include "check.h"
+
+#define STRESS_BLOCKS 2000
+#define STRESS_ROUNDS 20
+#define HEAP_BLOCKS 200 // Medium heap blocks live at once, well within one region
+
+// Free blocks on the list of an order, checking list links, alignment and the order's bitmap
+static size_t count_free(BuddyRegion* region, int order) {
+    size_t listed = 0;
+    BuddyFree* previous = NULL;
+    for (BuddyFree* node = region->free_lists[order - BUDDY_MIN_ORDER]; node != NULL; node = node->next) {
+        size_t offset = (size_t)((char*)node - region->base);
+        uint64_t mask;
+        CHECK(offset % ((size_t)1 << order) == 0 && offset < region->carved);
+        CHECK((*buddy_bit_word(region, offset, order, &mask) & mask) != 0);
+        CHECK(node->prev == previous);
+        previous = node;
+        listed++;
+    }
+    size_t bits = 0;
+    for (size_t i = 0; i < sizeof(region->free_bits[0]) / sizeof(uint64_t); i++) {
+        bits += (size_t)__builtin_popcountll(region->free_bits[order - BUDDY_MIN_ORDER][i]);
+    }
+    CHECK(bits == listed);
+    return listed;
+}
+
+// Check that nothing is allocated: every carved top block is free and whole
+static void check_coalesced(BuddyRegion* region) {
+    for (int order = BUDDY_MIN_ORDER; order < BUDDY_MAX_ORDER; order++) {
+        CHECK(count_free(region, order) == 0);
+    }
+    CHECK(count_free(region, BUDDY_MAX_ORDER) == region->carved / BUDDY_MAX_BLOCK);
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager_backend(HEAP_BACKEND_BUDDY);
+    MemArena* arena = manager->arenas[0];
+
+    // The first small block splits a top block once per order; its buddy comes from the last split
+    char* first = (char*)buddy_allocate(arena, BUDDY_MIN_BLOCK);
+    BuddyRegion* region = atomic_load(&arena->buddy);
+    CHECK(first == region->base);
+    CHECK(region->carved == BUDDY_MAX_BLOCK);
+    for (int order = BUDDY_MIN_ORDER; order < BUDDY_MAX_ORDER; order++) {
+        CHECK(count_free(region, order) == 1);
+    }
+    CHECK(buddy_block_size(arena, first) == BUDDY_MIN_BLOCK);
+    char* second = (char*)buddy_allocate(arena, BUDDY_MIN_BLOCK - 100);
+    CHECK(second == first + BUDDY_MIN_BLOCK);
+    CHECK(count_free(region, BUDDY_MIN_ORDER) == 0);
+    char* larger = (char*)buddy_allocate(arena, 3 * BUDDY_MIN_BLOCK);
+    CHECK(buddy_block_size(arena, larger) == 4 * BUDDY_MIN_BLOCK);
+    CHECK((size_t)(larger - region->base) % (4 * BUDDY_MIN_BLOCK) == 0);
+
+    // Freeing the buddies merges them and then each merged block with the rest of the top block
+    buddy_free(arena, first);
+    CHECK(count_free(region, BUDDY_MIN_ORDER) == 1);
+    buddy_free(arena, second);
+    CHECK(count_free(region, BUDDY_MIN_ORDER) == 0);
+    buddy_free(arena, larger);
+    check_coalesced(region);
+
+    // Random sizes freed in random order always coalesce back to whole top blocks
+    static char* blocks[STRESS_BLOCKS];
+    unsigned seed = 1;
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            size_t bytes = BUDDY_MIN_BLOCK / 2 + rand_r(&seed) % (BUDDY_MAX_BLOCK / 16);
+            blocks[i] = (char*)buddy_allocate(arena, bytes);
+            if (blocks[i] != NULL) {
+                size_t size = buddy_block_size(arena, blocks[i]);
+                CHECK(size >= bytes && (size_t)(blocks[i] - region->base) % size == 0);
+                blocks[i][0] = (char)i; // Overlapping blocks would overwrite each other's marks
+            }
+        }
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            CHECK(blocks[i] == NULL || blocks[i][0] == (char)i);
+        }
+        for (size_t i = STRESS_BLOCKS; i > 1; i--) {
+            size_t j = rand_r(&seed) % i;
+            char* swap = blocks[i - 1];
+            blocks[i - 1] = blocks[j];
+            blocks[j] = swap;
+        }
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            if (blocks[i] != NULL) {
+                buddy_free(arena, blocks[i]);
+            }
+        }
+        check_coalesced(region);
+    }
+
+    // Medium heap blocks go through the buddy region and give it back when freed
+    static void* heap_blocks[HEAP_BLOCKS];
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        size_t size = BUDDY_MIN_BLOCK + rand_r(&seed) % (MMAP_THRESHOLD_DEFAULT - BUDDY_MIN_BLOCK);
+        heap_blocks[i] = allocate_memory(manager, size, 16);
+        CHECK(heap_blocks[i] != NULL);
+        CHECK(buddy_owns(arena, find_block(heap_blocks[i])->raw));
+    }
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        deallocate_memory(manager, heap_blocks[i]);
+    }
+    check_coalesced(region);
+
+    // A full region fails instead of growing, and still coalesces once emptied
+    static char* top_blocks[BUDDY_REGION_SIZE / BUDDY_MAX_BLOCK];
+    for (size_t i = 0; i < BUDDY_REGION_SIZE / BUDDY_MAX_BLOCK; i++) {
+        top_blocks[i] = (char*)buddy_allocate(arena, BUDDY_MAX_BLOCK);
+        CHECK(top_blocks[i] != NULL);
+    }
+    CHECK(region->carved == BUDDY_REGION_SIZE);
+    CHECK(buddy_allocate(arena, BUDDY_MIN_BLOCK) == NULL);
+    for (size_t i = 0; i < BUDDY_REGION_SIZE / BUDDY_MAX_BLOCK; i++) {
+        buddy_free(arena, top_blocks[i]);
+    }
+    check_coalesced(region);
+
+    free_memory_manager(manager);
+    printf("buddy: ok\n");
+    return 0;
+}
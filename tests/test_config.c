@@ -0,0 +1,76 @@
+// AMM_CONF parsing: numbers are decimal whatever their leading digits, suffixes scale them, invalid
+// pool specs and alignments are rejected before they reach a pool, and options applied over a
+// program's config are named on stderr
+#include "../mem_manager.c"
+#include "check.h"
+
+#define OUTPUT_SIZE 4096
+
+// Parse one option string into a fresh config; returns parse_memory_manager_config's result
+static int parse(MemoryManagerConfig* config, const char* options) {
+    init_memory_manager_config(config);
+    return parse_memory_manager_config(config, options);
+}
+
+// Create a manager from a config with AMM_CONF set, capturing what it prints on stderr
+static void create_with_env(const MemoryManagerConfig* config, const char* options, char* output) {
+    setenv("AMM_CONF", options, 1);
+    FILE* file = tmpfile();
+    CHECK(file != NULL);
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fileno(file), STDERR_FILENO);
+    MemoryManager* manager = create_memory_manager_ex(config);
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    unsetenv("AMM_CONF");
+    CHECK(manager->decay_ms == 250 && manager->mmap_threshold == MMAP_THRESHOLD_DEFAULT);
+    free_memory_manager(manager);
+    rewind(file);
+    size_t length = fread(output, 1, OUTPUT_SIZE - 1, file);
+    output[length] = '\0';
+    fclose(file);
+}
+
+int main(void) {
+    MemoryManagerConfig config;
+
+    CHECK(parse(&config, "pools=64x4096/256x1024@64") == 0);
+    CHECK(config.pool_count == 2);
+    CHECK(config.pools[0].block_size == 64 && config.pools[0].block_count == 4096 && config.pools[0].alignment == 16);
+    CHECK(config.pools[1].block_size == 256 && config.pools[1].block_count == 1024 && config.pools[1].alignment == 64);
+
+    // A leading zero is not octal and 0x is not hexadecimal, while suffixes still scale
+    CHECK(parse(&config, "decay_ms=010,mmap_threshold=08") == 0);
+    CHECK(config.decay_ms == 10 && config.mmap_threshold == 8);
+    CHECK(parse(&config, "pools=064x0128@016/1kx2/2mx1@4k") == 0);
+    CHECK(config.pool_count == 3);
+    CHECK(config.pools[0].block_size == 64 && config.pools[0].block_count == 128 && config.pools[0].alignment == 16);
+    CHECK(config.pools[1].block_size == 1024 && config.pools[1].block_count == 2);
+    CHECK(config.pools[2].block_size == (2 << 20) && config.pools[2].alignment == 4096);
+    CHECK(parse(&config, "mmap_threshold=0x100") == -1);
+    CHECK(config.mmap_threshold == MMAP_THRESHOLD_DEFAULT);
+    CHECK(parse(&config, "decay_ms=+5") == -1 && parse(&config, "decay_ms= 5") == -1);
+    CHECK(parse(&config, "pools=0x40x128") == -1);
+    CHECK(parse(&config, "pools=64x128@0x20") == -1);
+
+    // Zero and non-power-of-two alignments, and specs without a valid split
+    CHECK(parse(&config, "pools=64x128@0") == -1);
+    CHECK(parse(&config, "pools=64x128@24") == -1);
+    CHECK(parse(&config, "pools=64") == -1);
+    CHECK(parse(&config, "pools=64x") == -1);
+    CHECK(parse(&config, "pools=x64") == -1);
+
+    // AMM_CONF wins over the program's config and says which options it applied
+    static char output[OUTPUT_SIZE];
+    init_memory_manager_config(&config);
+    config.decay_ms = 1000;
+    create_with_env(&config, "decay_ms=250,bogus=1", output);
+    CHECK(strstr(output, "AMM_CONF: decay_ms=250 overrides the configured value") != NULL);
+    CHECK(strstr(output, "bogus=1 overrides") == NULL);
+    CHECK(strstr(output, "AMM_CONF: ignoring invalid options") != NULL);
+
+    printf("config: ok\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Copy engine: every kernel this CPU runs copies every small size and a range of large ones exactly,
+// from and to every alignment, with and without streaming stores, and writes nothing outside the
+// destination; copy_memory, copy_memory_aligned and copy_memory_batch return faithful copies
+#include "../mem_manager.c"
+#include "check.h"
+
+#define SMALL_MAX 600 // Every size up to here, past each kernel's overlapping-vector cases
+#define SKEWS 64 // Source and destination offsets tried, up to the widest vector
+#define LARGE_MAX ((size_t)1 << 20)
+#define GUARD 64 // Bytes checked on both sides of the destination
+#define CANARY 0xa5
+
+typedef void (*CopyKernel)(void* dest, const void* src, size_t n);
+
+static unsigned char source[LARGE_MAX + SKEWS];
+static unsigned char target[LARGE_MAX + SKEWS + 2 * GUARD];
+
+// Copy size bytes at the given offsets and check the copy and the bytes around it
+static void check_copy(CopyKernel kernel, size_t size, size_t src_skew, size_t dest_skew) {
+    unsigned char* dest = target + GUARD + dest_skew;
+    memset(dest - GUARD, CANARY, size + 2 * GUARD);
+    kernel(dest, source + src_skew, size);
+    CHECK(memcmp(dest, source + src_skew, size) == 0);
+    for (size_t i = 0; i < GUARD; i++) {
+        CHECK(dest[-1 - (ptrdiff_t)i] == CANARY && dest[size + i] == CANARY);
+    }
+}
+
+static void check_kernel(CopyKernel kernel) {
+    for (size_t size = 0; size <= SMALL_MAX; size++) {
+        check_copy(kernel, size, size % SKEWS, (size * 7) % SKEWS);
+    }
+    for (size_t skew = 0; skew < SKEWS; skew++) {
+        check_copy(kernel, 4096 + skew, skew, SKEWS - 1 - skew);
+    }
+    size_t large[] = {1000, 4095, 65536 + 13, LARGE_MAX - 1};
+    for (size_t i = 0; i < sizeof(large) / sizeof(large[0]); i++) {
+        check_copy(kernel, large[i], 3, 0);
+        check_copy(kernel, large[i], 0, 5);
+    }
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(source); i++) {
+        source[i] = (unsigned char)(i * 131 + (i >> 8));
+    }
+
+    // The kernel copy_bytes picked, then each one this CPU supports, also with streaming stores forced
+    CHECK(strlen(copy_engine_name()) > 0);
+    check_kernel(copy_bytes);
+    CopyKernel kernels[4];
+    size_t kernel_count = 0;
+    kernels[kernel_count++] = copy_libc;
+#if COPY_ENGINE_X86
+    kernels[kernel_count++] = copy_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernel_count++] = copy_avx2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels[kernel_count++] = copy_avx512;
+    }
+#endif
+    size_t threshold = copy_stream_threshold;
+    for (size_t i = 0; i < kernel_count; i++) {
+        copy_stream_threshold = threshold;
+        check_kernel(kernels[i]);
+        copy_stream_threshold = 4096;
+        check_kernel(kernels[i]);
+    }
+    copy_stream_threshold = threshold;
+
+    // Manager copies
+    MemoryManager* manager = create_memory_manager();
+    create_memory_pool(manager, 256, 16, 16);
+    char* pooled = (char*)allocate_from_pool(manager, 200, 16);
+    char* heap = (char*)allocate_memory(manager, 100000, 16);
+    CHECK(pooled != NULL && heap != NULL);
+    memcpy(pooled, source, 200);
+    memcpy(heap, source + 1, 100000);
+
+    char* copy = (char*)copy_memory(manager, heap, 100000);
+    CHECK(copy != NULL && memcmp(copy, heap, 100000) == 0 && block_usable_size(copy) >= 100000);
+    char* aligned = (char*)copy_memory_aligned(manager, heap, 5000, 256);
+    CHECK(aligned != NULL && (uintptr_t)aligned % 256 == 0 && memcmp(aligned, heap, 5000) == 0);
+    char* same_class = (char*)copy_memory_aligned(manager, pooled, 200, 0);
+    CHECK(same_class != NULL && find_block(same_class)->pool == find_block(pooled)->pool);
+    CHECK(memcmp(same_class, pooled, 200) == 0);
+
+    CopyRequest requests[] = {{pooled, 200}, {heap, 100000}, {source + 5, 17}};
+    void* dests[3];
+    for (int contiguous = 0; contiguous <= 1; contiguous++) {
+        CHECK(copy_memory_batch(manager, requests, 3, dests, contiguous) == 0);
+        for (int i = 0; i < 3; i++) {
+            CHECK(memcmp(dests[i], requests[i].src, requests[i].size) == 0);
+        }
+        if (contiguous) {
+            CHECK((char*)dests[1] - (char*)dests[0] == 208 && (char*)dests[2] - (char*)dests[1] == 100000);
+            deallocate_memory(manager, dests[0]);
+        } else {
+            for (int i = 0; i < 3; i++) {
+                deallocate_memory(manager, dests[i]);
+            }
+        }
+    }
+
+    deallocate_memory(manager, copy);
+    deallocate_memory(manager, aligned);
+    deallocate_memory(manager, same_class);
+    deallocate_memory(manager, pooled);
+    deallocate_memory(manager, heap);
+    free_memory_manager(manager);
+    printf("copy (%s): ok\n", copy_engine_name());
+    return 0;
+}
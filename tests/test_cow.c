@@ -0,0 +1,65 @@
+// Large heap blocks: mapped anonymously by default, so holding many of them opens no file descriptors;
+// with cow_blocks each has a memfd and copy_memory_cow shares its pages until either side writes
+#include "../mem_manager.c"
+#include <dirent.h>
+#include "check.h"
+
+#define BLOCK_SIZE ((size_t)1 << 20)
+#define HELD 200
+
+// Count this process's open file descriptors
+static size_t open_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    CHECK(dir != NULL);
+    size_t count = 0;
+    while (readdir(dir) != NULL) {
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+int main(void) {
+    // Default: many large blocks live at once cost no descriptors, and copies are full copies
+    MemoryManager* manager = create_memory_manager();
+    size_t fds = open_fds();
+    static void* held[HELD];
+    for (size_t i = 0; i < HELD; i++) {
+        held[i] = allocate_memory(manager, BLOCK_SIZE, 16);
+        CHECK(held[i] != NULL && find_block(held[i])->map_size != 0 && find_block(held[i])->fd == -1);
+    }
+    CHECK(open_fds() == fds);
+    memset(held[0], 7, BLOCK_SIZE);
+    char* copy = (char*)copy_memory_cow(manager, held[0], BLOCK_SIZE);
+    CHECK(copy != NULL && memcmp(copy, held[0], BLOCK_SIZE) == 0);
+    copy[0] = 8;
+    CHECK(((char*)held[0])[0] == 7);
+    deallocate_memory(manager, copy);
+    for (size_t i = 0; i < HELD; i++) {
+        deallocate_memory(manager, held[i]);
+    }
+    free_memory_manager(manager);
+
+    // cow_blocks: one descriptor per block, and the copy maps the source's pages privately
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.cow_blocks = 1;
+    manager = create_memory_manager_ex(&config);
+    char* source = (char*)allocate_memory(manager, BLOCK_SIZE, 16);
+    CHECK(source != NULL && find_block(source)->fd >= 0);
+    CHECK(open_fds() == fds + 1);
+    memset(source, 3, BLOCK_SIZE);
+    copy = (char*)copy_memory_cow(manager, source, BLOCK_SIZE);
+    CHECK(copy != NULL && copy != source && memcmp(copy, source, BLOCK_SIZE) == 0);
+    CHECK(open_fds() == fds); // The source's memfd is closed once both sides map it privately
+    // Writes on either side stay private to it
+    copy[BLOCK_SIZE / 2] = 9;
+    source[BLOCK_SIZE / 4] = 4;
+    CHECK(source[BLOCK_SIZE / 2] == 3 && copy[BLOCK_SIZE / 4] == 3);
+    deallocate_memory(manager, copy);
+    deallocate_memory(manager, source);
+    free_memory_manager(manager);
+
+    printf("copy-on-write: ok\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+// C++ interface: pool_resource serves size classes from pools and larger requests from the heap,
+// compares equal only over the same manager, and mm::allocator throws without a default resource
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <vector>
+#include "mem_manager.hpp"
+#include "check.h"
+
+#define ENTRIES 1000
+
+int main() {
+    // No default resource yet: allocating throws instead of dereferencing NULL
+    bool threw = false;
+    try {
+        std::vector<int, mm::allocator<int>> values;
+        values.push_back(1);
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    MemoryManager* manager = create_memory_manager();
+    {
+        mm::pool_resource resource(manager, 2 * ENTRIES);
+        mm::set_default_pool_resource(&resource);
+        MemStats before;
+        get_memory_stats(manager, &before);
+
+        // Map nodes come from the pools
+        {
+            std::map<int, int, std::less<int>, mm::allocator<std::pair<const int, int>>> index;
+            for (int i = 0; i < ENTRIES; i++) {
+                index[i] = i * 2;
+            }
+            for (int i = 0; i < ENTRIES; i++) {
+                CHECK(index.at(i) == i * 2);
+            }
+            MemStats during;
+            get_memory_stats(manager, &during);
+            CHECK(during.pool_hits - before.pool_hits >= ENTRIES);
+            CHECK(during.blocks_in_use - before.blocks_in_use == ENTRIES);
+        }
+
+        // Past the largest size class, requests go to the heap
+        {
+            std::pmr::vector<char> buffer(&resource);
+            buffer.resize(mm::size_classes[mm::class_count - 1] * 4, 'x');
+            CHECK(buffer.back() == 'x');
+            MemStats during;
+            get_memory_stats(manager, &during);
+            CHECK(during.pool_misses > before.pool_misses);
+        }
+
+        MemStats after;
+        get_memory_stats(manager, &after);
+        CHECK(after.blocks_in_use == before.blocks_in_use && after.bytes_in_use == before.bytes_in_use);
+
+        mm::pool_resource same(manager);
+        MemoryManager* other_manager = create_memory_manager();
+        mm::pool_resource other(other_manager);
+        CHECK(resource.is_equal(same));
+        CHECK(!resource.is_equal(other));
+        CHECK(mm::allocator<int>() == mm::allocator<long>());
+        mm::set_default_pool_resource(nullptr);
+        free_memory_manager(other_manager);
+    }
+    free_memory_manager(manager);
+
+    printf("C++ wrapper: ok\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Page return with decay_ms: spread over several heap frees, each returning a bounded number of
+// pages, leaving no free backend page resident once a return finishes, and never restarted by a
+// free that comes in while another thread is starting it
+#include "../mem_manager.c"
+#include "check.h"
+
+#define BLOCKS 256
+#define BLOCK_SIZE ((size_t)60 << 10)
+#define CHURN_SIZE ((size_t)8 << 10)
+#define MAX_FREES 100000
+
+// Count resident pages of [start, end)
+static size_t resident_pages(uintptr_t start, uintptr_t end, size_t page_size) {
+    static unsigned char vector[BUDDY_MAX_BLOCK / 4096 + 1];
+    size_t resident = 0;
+    for (; start < end; start += page_size) {
+        CHECK(mincore((void*)start, page_size, vector) == 0);
+        resident += vector[0] & 1;
+    }
+    return resident;
+}
+
+// Resident pages a finished return should have released: past the links of every free block
+static size_t resident_free_pages(MemArena* arena, size_t page_size) {
+    size_t resident = 0;
+    BuddyRegion* region = atomic_load(&arena->buddy);
+    for (int order = BUDDY_MIN_ORDER; region != NULL && order <= BUDDY_MAX_ORDER; order++) {
+        for (BuddyFree* node = region->free_lists[order - BUDDY_MIN_ORDER]; node != NULL; node = node->next) {
+            resident += resident_pages((uintptr_t)node + page_size, (uintptr_t)node + ((size_t)1 << order), page_size);
+        }
+    }
+    TlsfHeap* heap = atomic_load(&arena->tlsf);
+    for (int fl = 0; heap != NULL && fl < TLSF_FL_COUNT; fl++) {
+        for (int sl = 0; sl < (1 << TLSF_SL_LOG2); sl++) {
+            for (TlsfBlock* block = heap->free_lists[fl][sl]; block != NULL; block = block->next_free) {
+                uintptr_t start = ((uintptr_t)(block + 1) + page_size - 1) & ~(uintptr_t)(page_size - 1);
+                uintptr_t end = (uintptr_t)tlsf_next_block(block) & ~(uintptr_t)(page_size - 1);
+                resident += end > start ? resident_pages(start, end, page_size) : 0;
+            }
+        }
+    }
+    return resident;
+}
+
+static void check_backend(HeapBackend backend) {
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.backend = backend;
+    config.decay_ms = 1;
+    MemoryManager* manager = create_memory_manager_ex(&config);
+    MemArena* arena = manager->arenas[0];
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    static void* blocks[BLOCKS];
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = allocate_memory(manager, BLOCK_SIZE, 16);
+        CHECK(blocks[i] != NULL);
+        memset(blocks[i], 1, BLOCK_SIZE);
+    }
+    for (size_t i = 0; i < BLOCKS; i++) {
+        deallocate_memory(manager, blocks[i]);
+    }
+
+    // Let the period pass, then churn one small block until a whole return has run
+    usleep(5000);
+    size_t frees = 0;
+    int started = 0;
+    while (frees < MAX_FREES) {
+        void* ptr = allocate_memory(manager, CHURN_SIZE, 16);
+        CHECK(ptr != NULL);
+        memset(ptr, 2, CHURN_SIZE);
+        deallocate_memory(manager, ptr);
+        frees++;
+        int decaying = atomic_load(&arena->decaying);
+        if (started && !decaying) {
+            break;
+        }
+        started |= decaying;
+    }
+    CHECK(started);
+    CHECK(frees < MAX_FREES);
+    // BLOCKS * BLOCK_SIZE of dirty pages cannot all be returned within a few frees' budgets
+    CHECK(frees > (BLOCKS * BLOCK_SIZE / page_size) / DECAY_PAGES_PER_FREE / 2);
+
+    // Churning re-dirties at most the small block's pages and the links written splitting for it
+    CHECK(resident_free_pages(arena, page_size) <= CHURN_SIZE / page_size + BUDDY_ORDERS);
+
+    // While another thread has claimed the start, a free neither starts a return nor touches the claim
+    usleep(5000);
+    atomic_store(&arena->last_decay, UINT_LEAST64_MAX);
+    decay_free_pages(arena);
+    CHECK(!atomic_load(&arena->decaying));
+    CHECK(atomic_load(&arena->last_decay) == UINT_LEAST64_MAX);
+    free_memory_manager(manager);
+}
+
+int main(void) {
+    check_backend(HEAP_BACKEND_BUDDY);
+    check_backend(HEAP_BACKEND_TLSF);
+    printf("decay: ok\n");
+    return 0;
+}
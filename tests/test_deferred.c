@@ -0,0 +1,148 @@
+// Deferred decrements: a decrement only stores the pointer in the thread's log; the log is applied
+// when it fills, at an explicit flush and at thread exit, freeing blocks back to their own pools;
+// free_memory_manager applies the logs of threads still running before it reports leaks
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS (2 * DEFERRED_LOG_SIZE)
+#define OUTPUT_SIZE 4096
+
+static MemoryManager* manager;
+static MemPool* small_pool;
+static MemPool* large_pool;
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parked_cond = PTHREAD_COND_INITIALIZER;
+static int parked;
+
+static ThreadCache* current_cache(void) {
+    return (ThreadCache*)pthread_getspecific(manager->cache_key);
+}
+
+// Allocate count blocks alternating between the two pools
+static void allocate_mixed(void** blocks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = allocate_from_pool(manager, i % 2 == 0 ? 32 : 200, 16);
+        CHECK(blocks[i] != NULL);
+    }
+}
+
+// Log a decrement for each of the blocks, then exit with the log applied by the thread destructor
+static void* log_and_exit(void* arg) {
+    void* blocks[10];
+    allocate_mixed(blocks, 10);
+    for (size_t i = 0; i < 10; i++) {
+        decrement_ref_count(manager, blocks[i]);
+    }
+    CHECK(current_cache()->deferred_count == 10);
+    (void)arg;
+    return NULL;
+}
+
+// Log decrements and stay alive, without touching the manager again, until told to exit
+static void* log_and_park(void* arg) {
+    void** blocks = (void**)arg;
+    for (size_t i = 0; i < 10; i++) {
+        decrement_ref_count(manager, blocks[i]);
+    }
+    pthread_mutex_lock(&parked_lock);
+    parked = 1;
+    pthread_cond_broadcast(&parked_cond);
+    while (parked == 1) {
+        pthread_cond_wait(&parked_cond, &parked_lock);
+    }
+    pthread_mutex_unlock(&parked_lock);
+    return NULL;
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0); // Freed blocks go straight to their pool, so free counts are exact
+    create_memory_pool(manager, 32, POOL_BLOCKS, 16);
+    create_memory_pool(manager, 200, POOL_BLOCKS, 16);
+    MemArena* arena = manager->arenas[0];
+    small_pool = arena->pool_table[arena->pool_count - 2];
+    large_pool = arena->pool_table[arena->pool_count - 1];
+    set_deferred_decrements(manager, 1);
+
+    // The hot path stores the pointer and nothing else
+    static void* blocks[POOL_BLOCKS];
+    allocate_mixed(blocks, 2);
+    decrement_ref_count(manager, blocks[0]);
+    ThreadCache* cache = current_cache();
+    CHECK(cache->deferred_count == 1 && cache->deferred[0] == blocks[0]);
+    CHECK(atomic_load(&find_block(blocks[0])->ref_count) == 1);
+    CHECK(small_pool->free_count == POOL_BLOCKS - 1);
+
+    // An explicit flush applies the log; a block with another reference only drops to 1
+    increment_ref_count(manager, blocks[1]);
+    decrement_ref_count(manager, blocks[1]);
+    flush_deferred_decrements(manager);
+    CHECK(cache->deferred_count == 0);
+    CHECK(small_pool->free_count == POOL_BLOCKS && large_pool->free_count == POOL_BLOCKS - 1);
+    CHECK(atomic_load(&find_block(blocks[1])->ref_count) == 1);
+    decrement_ref_count(manager, blocks[1]);
+    flush_deferred_decrements(manager);
+    CHECK(large_pool->free_count == POOL_BLOCKS);
+
+    // A full log applies itself on the decrement that fills it, each block back to its own pool
+    allocate_mixed(blocks, DEFERRED_LOG_SIZE);
+    for (size_t i = 0; i + 1 < DEFERRED_LOG_SIZE; i++) {
+        decrement_ref_count(manager, blocks[i]);
+    }
+    CHECK(cache->deferred_count == DEFERRED_LOG_SIZE - 1);
+    CHECK(small_pool->free_count == POOL_BLOCKS - DEFERRED_LOG_SIZE / 2);
+    decrement_ref_count(manager, blocks[DEFERRED_LOG_SIZE - 1]);
+    CHECK(cache->deferred_count == 0);
+    CHECK(small_pool->free_count == POOL_BLOCKS && large_pool->free_count == POOL_BLOCKS);
+
+    // A thread's log is applied when it exits
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, log_and_exit, NULL) == 0);
+    pthread_join(thread, NULL);
+    CHECK(small_pool->free_count == POOL_BLOCKS && large_pool->free_count == POOL_BLOCKS);
+
+    // Turning the mode off applies the caller's log
+    allocate_mixed(blocks, 4);
+    for (size_t i = 0; i < 4; i++) {
+        decrement_ref_count(manager, blocks[i]);
+    }
+    set_deferred_decrements(manager, 0);
+    CHECK(cache->deferred_count == 0 && small_pool->free_count == POOL_BLOCKS && large_pool->free_count == POOL_BLOCKS);
+    set_deferred_decrements(manager, 1);
+
+    // free_memory_manager applies the log of a thread that is still running before reporting leaks
+    allocate_mixed(blocks, 10);
+    CHECK(pthread_create(&thread, NULL, log_and_park, blocks) == 0);
+    pthread_mutex_lock(&parked_lock);
+    while (parked == 0) {
+        pthread_cond_wait(&parked_cond, &parked_lock);
+    }
+    pthread_mutex_unlock(&parked_lock);
+    CHECK(small_pool->free_count == POOL_BLOCKS - 5);
+
+    enable_leak_report(manager, 0);
+    FILE* file = tmpfile();
+    CHECK(file != NULL);
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fileno(file), STDERR_FILENO);
+    free_memory_manager(manager);
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    static char output[OUTPUT_SIZE];
+    rewind(file);
+    size_t length = fread(output, 1, OUTPUT_SIZE - 1, file);
+    output[length] = '\0';
+    fclose(file);
+    CHECK(strstr(output, "Leak report: no blocks still referenced.") != NULL);
+
+    pthread_mutex_lock(&parked_lock);
+    parked = 2;
+    pthread_cond_broadcast(&parked_cond);
+    pthread_mutex_unlock(&parked_lock);
+    pthread_join(thread, NULL);
+
+    printf("deferred decrements: ok\n");
+    return 0;
+}
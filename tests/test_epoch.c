@@ -0,0 +1,124 @@
+// Epoch reclamation: a reader pinned in a critical section holds back every block retired since it
+// entered; a retired block returns to its pool only once the global epoch is two ahead of the epoch
+// it was retired in; an exiting thread's limbo lists move to the manager's orphan list
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 64
+#define RETIRED 20 // Below EPOCH_RECLAIM_INTERVAL, so only explicit reclaims advance the epoch
+
+static MemoryManager* manager;
+static MemPool* pool;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int state; // 1 once the reader is inside its critical section, 2 to let it leave
+
+static void set_state(int value) {
+    pthread_mutex_lock(&state_lock);
+    state = value;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_lock);
+}
+
+static void wait_state(int value) {
+    pthread_mutex_lock(&state_lock);
+    while (state != value) {
+        pthread_cond_wait(&state_cond, &state_lock);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+static size_t global_epoch(void) {
+    return atomic_load(&manager->global_epoch);
+}
+
+// Stay inside one critical section until told to leave
+static void* pinned_reader(void* arg) {
+    (void)arg;
+    epoch_enter(manager);
+    set_state(1);
+    wait_state(2);
+    epoch_exit(manager);
+    return NULL;
+}
+
+// Retire blocks and exit without reclaiming them
+static void* retire_and_exit(void* arg) {
+    void** blocks = (void**)arg;
+    for (size_t i = 0; i < RETIRED; i++) {
+        retire_memory(manager, blocks[i]);
+    }
+    return NULL;
+}
+
+static void allocate_blocks(void** blocks) {
+    for (size_t i = 0; i < RETIRED; i++) {
+        blocks[i] = allocate_from_pool(manager, 64, 16);
+        CHECK(blocks[i] != NULL && find_block(blocks[i])->pool == pool);
+    }
+    CHECK(pool->free_count == POOL_BLOCKS - RETIRED);
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0); // Freed blocks go straight to the pool, so its free count is exact
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    MemArena* arena = manager->arenas[0];
+    pool = arena->pool_table[arena->pool_count - 1];
+    void* blocks[RETIRED];
+
+    // Blocks come back exactly when the epoch is two ahead of the one they were retired in
+    allocate_blocks(blocks);
+    size_t retired_in = global_epoch();
+    for (size_t i = 0; i < RETIRED; i++) {
+        retire_memory(manager, blocks[i]);
+    }
+    CHECK(pool->free_count == POOL_BLOCKS - RETIRED);
+    epoch_reclaim(manager);
+    CHECK(global_epoch() == retired_in + 1 && pool->free_count == POOL_BLOCKS - RETIRED);
+    epoch_reclaim(manager);
+    CHECK(global_epoch() == retired_in + 2 && pool->free_count == POOL_BLOCKS);
+
+    // A pinned reader lets the epoch move at most once, so nothing retired after it entered is freed
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, pinned_reader, NULL) == 0);
+    wait_state(1);
+    size_t pinned_in = global_epoch();
+    allocate_blocks(blocks);
+    for (size_t i = 0; i < RETIRED; i++) {
+        retire_memory(manager, blocks[i]);
+    }
+    for (int i = 0; i < 10; i++) {
+        epoch_reclaim(manager);
+    }
+    CHECK(global_epoch() == pinned_in + 1);
+    CHECK(pool->free_count == POOL_BLOCKS - RETIRED);
+    for (size_t i = 0; i < RETIRED; i++) {
+        CHECK(atomic_load(&find_block(blocks[i])->ref_count) > 0); // Still allocated, still readable
+    }
+
+    // Once the reader leaves, two more epochs free them
+    set_state(2);
+    pthread_join(thread, NULL);
+    epoch_reclaim(manager);
+    CHECK(global_epoch() == pinned_in + 2 && pool->free_count == POOL_BLOCKS);
+
+    // An exiting thread hands its limbo lists to the orphan list, which is freed two epochs later
+    allocate_blocks(blocks);
+    CHECK(pthread_create(&thread, NULL, retire_and_exit, blocks) == 0);
+    pthread_join(thread, NULL);
+    size_t orphaned = 0;
+    for (MemBlock* block = manager->orphans; block != NULL; block = block->next) {
+        orphaned++;
+    }
+    CHECK(orphaned == RETIRED && manager->orphan_epoch == global_epoch());
+    CHECK(pool->free_count == POOL_BLOCKS - RETIRED);
+    epoch_reclaim(manager);
+    CHECK(manager->orphans != NULL && pool->free_count == POOL_BLOCKS - RETIRED);
+    epoch_reclaim(manager);
+    CHECK(manager->orphans == NULL && pool->free_count == POOL_BLOCKS);
+
+    free_memory_manager(manager);
+    printf("epoch reclamation: ok\n");
+    return 0;
+}
@@ -0,0 +1,80 @@
+// fork while other threads allocate: with the manager's atfork handlers the child can go on allocating
+// from pools, the buddy backend and the manager-locked paths without finding a lock held by a lost thread
+#include "../mem_manager.c"
+#include <sys/wait.h>
+#include "check.h"
+
+#define WORKERS 4
+#define FORKS 100
+#define CHILD_TIMEOUT 10 // Seconds before a deadlocked child is killed
+
+static MemoryManager* manager;
+static atomic_int stopping;
+
+static void prepare_fork(void) {
+    lock_manager_for_fork(manager);
+}
+
+static void parent_after_fork(void) {
+    unlock_manager_after_fork(manager);
+}
+
+static void child_after_fork(void) {
+    reset_manager_after_fork(manager);
+}
+
+// Allocate and free pool and heap blocks until told to stop
+static void* churn(void* arg) {
+    (void)arg;
+    size_t sizes[] = {32, 200, 5000, 70000};
+    for (size_t i = 0; !atomic_load(&stopping); i++) {
+        void* ptr = allocate_memory(manager, sizes[i % 4], 16);
+        CHECK(ptr != NULL);
+        deallocate_memory(manager, ptr);
+    }
+    return NULL;
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    create_memory_pool(manager, 64, 256, 16);
+    create_memory_pool(manager, 256, 256, 16);
+    pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+
+    pthread_t workers[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        CHECK(pthread_create(&workers[i], NULL, churn, NULL) == 0);
+    }
+
+    for (int i = 0; i < FORKS; i++) {
+        pid_t child = fork();
+        CHECK(child >= 0);
+        if (child == 0) {
+            alarm(CHILD_TIMEOUT);
+            for (int j = 0; j < 1000; j++) {
+                void* small = allocate_memory(manager, 48, 16);
+                void* medium = allocate_memory(manager, 5000, 16);
+                if (small == NULL || medium == NULL) {
+                    _exit(EXIT_FAILURE);
+                }
+                deallocate_memory(manager, small);
+                deallocate_memory(manager, medium);
+            }
+            MemStats stats;
+            get_memory_stats(manager, &stats);
+            defragment_memory(manager);
+            _exit(EXIT_SUCCESS);
+        }
+        int status;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    atomic_store(&stopping, 1);
+    for (int i = 0; i < WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free_memory_manager(manager);
+    printf("fork: ok\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Guarded sampling: sampled blocks are listed by the leak report, heap snapshots and the block
+// listing, the fault handler's hand-formatted report names the access and the block, and faults
+// outside the guarded pool go to the program's own handler without uninstalling the guard handler
+#include "../mem_manager.c"
+#include <setjmp.h>
+#include <sys/wait.h>
+#include "check.h"
+
+#define BLOCK_SIZE 100
+#define OUTPUT_SIZE 65536
+
+// Read a whole temporary file back from the start
+static void read_output(FILE* file, char* output) {
+    fflush(file);
+    rewind(file);
+    size_t length = fread(output, 1, OUTPUT_SIZE - 1, file);
+    output[length] = '\0';
+}
+
+// Run a bad access in a child process with stderr in a file; checks that it dies of SIGSEGV
+static void expect_fault(MemoryManager* manager, char* ptr, size_t offset, int free_first, char* output) {
+    FILE* file = tmpfile();
+    CHECK(file != NULL);
+    fflush(NULL);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        dup2(fileno(file), STDERR_FILENO);
+        if (free_first) {
+            deallocate_memory(manager, ptr);
+        }
+        *(volatile char*)(ptr + offset) = 1;
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    read_output(file, output);
+    fclose(file);
+}
+
+static sigjmp_buf recover_point;
+static volatile sig_atomic_t recovering; // Set around the faults the test handler recovers from
+static volatile sig_atomic_t recovered;
+
+// Recovering SIGSEGV handler like a JIT or GC would install; crashes as usual outside the test's faults
+static void recover_handler(int signal) {
+    if (!recovering) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_DFL;
+        sigaction(signal, &action, NULL);
+        return;
+    }
+    recovered++;
+    siglongjmp(recover_point, 1);
+}
+
+// Fault on a page of its own and recover through the program's handler
+static void fault_and_recover(char* page) {
+    recovering = 1;
+    if (sigsetjmp(recover_point, 1) == 0) {
+        *(volatile char*)page = 1;
+    }
+    recovering = 0;
+}
+
+int main(void) {
+    struct sigaction recover_action;
+    memset(&recover_action, 0, sizeof(recover_action));
+    recover_action.sa_handler = recover_handler;
+    sigemptyset(&recover_action.sa_mask);
+    sigaction(SIGSEGV, &recover_action, NULL);
+
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.guard_sample_rate = 1;
+    config.guard_slots = 4;
+    MemoryManager* manager = create_memory_manager_ex(&config);
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    static char output[OUTPUT_SIZE];
+    char expected[256];
+
+    char* ptr = (char*)allocate_memory(manager, BLOCK_SIZE, 16);
+    CHECK(ptr != NULL);
+    CHECK(guarded_slot(manager, find_block(ptr)) != NULL);
+
+    // The block shows up in the leak report, the snapshot and the block listing
+    FILE* file = tmpfile();
+    CHECK(file != NULL);
+    report_leaks(manager, file);
+    read_output(file, output);
+    CHECK(strstr(output, "1 blocks still referenced, 100 bytes total") != NULL);
+    fclose(file);
+
+    SnapshotCursor cursor;
+    begin_heap_snapshot(&cursor, SNAPSHOT_JSON);
+    size_t length = 0;
+    while (!heap_snapshot_done(&cursor)) {
+        CHECK(length + SNAPSHOT_MIN_BUFFER < OUTPUT_SIZE);
+        length += write_heap_snapshot(manager, &cursor, output + length, SNAPSHOT_MIN_BUFFER);
+    }
+    output[length] = '\0';
+    snprintf(expected, sizeof(expected), "{\"address\":\"%p\",\"size\":%d,", (void*)ptr, BLOCK_SIZE);
+    CHECK(strstr(output, expected) != NULL);
+    CHECK(output[length - 2] == ']' && output[length - 1] == '}');
+
+    file = tmpfile();
+    CHECK(file != NULL);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(fileno(file), STDOUT_FILENO);
+    print_memory_blocks(manager);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    read_output(file, output);
+    snprintf(expected, sizeof(expected), "Block at %p, size: %d bytes, ref_count: 1 (guarded)", (void*)ptr, BLOCK_SIZE);
+    CHECK(strstr(output, expected) != NULL);
+    fclose(file);
+
+    // Unrelated faults reach the program's handler and leave the guard handler installed
+    char* unrelated = (char*)mmap(NULL, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(unrelated != MAP_FAILED);
+    fault_and_recover(unrelated);
+    fault_and_recover(unrelated);
+    CHECK(recovered == 2);
+    struct sigaction current;
+    sigaction(SIGSEGV, NULL, &current);
+    CHECK((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == guard_fault_handler);
+    munmap(unrelated, page_size);
+
+    // Faults are reported with the same numbers stdio would have printed
+    size_t overflow = page_size - (uintptr_t)ptr % page_size + 8; // Just into the guard page after the block
+    expect_fault(manager, ptr, overflow, 0, output);
+    snprintf(expected, sizeof(expected), "Guarded sampling: buffer overflow at %p, %zu bytes from the start of the %d-byte block at %p\n",
+             (void*)(ptr + overflow), overflow, BLOCK_SIZE, (void*)ptr);
+    CHECK(strstr(output, expected) != NULL);
+    snprintf(expected, sizeof(expected), "Allocated by thread %ld at ", (long)syscall(SYS_gettid));
+    CHECK(strstr(output, expected) != NULL);
+
+    expect_fault(manager, ptr, 10, 1, output);
+    snprintf(expected, sizeof(expected), "Guarded sampling: use-after-free at %p, 10 bytes into the %d-byte block at %p\n",
+             (void*)(ptr + 10), BLOCK_SIZE, (void*)ptr);
+    CHECK(strstr(output, expected) != NULL);
+    CHECK(strstr(output, "Freed by thread ") != NULL);
+
+    // Once freed, the block leaves every listing
+    deallocate_memory(manager, ptr);
+    file = tmpfile();
+    CHECK(file != NULL);
+    report_leaks(manager, file);
+    read_output(file, output);
+    CHECK(strstr(output, "no blocks still referenced") != NULL);
+    fclose(file);
+
+    free_memory_manager(manager);
+    printf("guarded sampling: ok\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Hazard pointers: a stalled reader pins only the block it protects; a thread's retired list never
+// holds more than HAZARD_RETIRED_MAX blocks; unprotected blocks go back to their pools together at
+// each scan; an exiting thread's retired blocks wait on the manager until no hazard protects them
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 512
+#define RETIREMENTS 2000 // Many times HAZARD_RETIRED_MAX
+
+static MemoryManager* manager;
+static MemPool* pool;
+static void* _Atomic shared;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int state; // 1 once the reader has protected shared, 2 to let it go
+
+static void set_state(int value) {
+    pthread_mutex_lock(&state_lock);
+    state = value;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_lock);
+}
+
+static void wait_state(int value) {
+    pthread_mutex_lock(&state_lock);
+    while (state != value) {
+        pthread_cond_wait(&state_cond, &state_lock);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Protect the shared block and stall until told to go
+static void* stalled_reader(void* arg) {
+    (void)arg;
+    CHECK(hazard_protect(manager, 0, &shared) == atomic_load(&shared));
+    set_state(1);
+    wait_state(2);
+    hazard_clear(manager, 0);
+    return NULL;
+}
+
+// Retire the shared block and exit before any scan
+static void* retire_and_exit(void* arg) {
+    (void)arg;
+    hazard_retire(manager, atomic_load(&shared));
+    return NULL;
+}
+
+static void* allocate_block(void) {
+    void* ptr = allocate_from_pool(manager, 64, 16);
+    CHECK(ptr != NULL && find_block(ptr)->pool == pool);
+    return ptr;
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0); // Freed blocks go straight to the pool, so its free count is exact
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    MemArena* arena = manager->arenas[0];
+    pool = arena->pool_table[arena->pool_count - 1];
+
+    // A stalled reader protects one block
+    void* pinned = allocate_block();
+    atomic_store(&shared, pinned);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, stalled_reader, NULL) == 0);
+    wait_state(1);
+    hazard_retire(manager, pinned);
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    CHECK(cache->hazard_retired_count == 1);
+
+    // Retired blocks wait for a scan, which frees every unprotected one at once
+    for (size_t i = 1; i + 1 < HAZARD_SCAN_THRESHOLD; i++) {
+        hazard_retire(manager, allocate_block());
+    }
+    CHECK(cache->hazard_retired_count == HAZARD_SCAN_THRESHOLD - 1);
+    CHECK(pool->free_count == POOL_BLOCKS - HAZARD_SCAN_THRESHOLD + 1);
+    CHECK(cache->hazard_retired_count + 1 == cache->hazard_next_scan);
+    hazard_retire(manager, allocate_block());
+    CHECK(cache->hazard_retired_count == 1 && cache->hazard_retired[0] == find_block(pinned));
+    CHECK(pool->free_count == POOL_BLOCKS - 1);
+
+    // However many blocks are retired, the list stays bounded and only the protected block stays out
+    for (size_t i = 0; i < RETIREMENTS; i++) {
+        hazard_retire(manager, allocate_block());
+        CHECK(cache->hazard_retired_count <= HAZARD_RETIRED_MAX);
+    }
+    hazard_reclaim(manager);
+    CHECK(cache->hazard_retired_count == 1 && pool->free_count == POOL_BLOCKS - 1);
+    CHECK(atomic_load(&find_block(pinned)->ref_count) > 0);
+
+    // Once the reader lets go, the block goes back too
+    set_state(2);
+    pthread_join(thread, NULL);
+    hazard_reclaim(manager);
+    CHECK(cache->hazard_retired_count == 0 && pool->free_count == POOL_BLOCKS);
+
+    // A block retired by a thread that exits waits on the manager while this thread protects it
+    pinned = allocate_block();
+    atomic_store(&shared, pinned);
+    CHECK(hazard_protect(manager, 1, &shared) == pinned);
+    CHECK(pthread_create(&thread, NULL, retire_and_exit, NULL) == 0);
+    pthread_join(thread, NULL);
+    CHECK(manager->hazard_orphans == find_block(pinned));
+    hazard_reclaim(manager);
+    CHECK(manager->hazard_orphans == find_block(pinned) && pool->free_count == POOL_BLOCKS - 1);
+    hazard_clear(manager, 1);
+    hazard_reclaim(manager);
+    CHECK(manager->hazard_orphans == NULL && pool->free_count == POOL_BLOCKS);
+
+    free_memory_manager(manager);
+    printf("hazard pointers: ok\n");
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Leak report: blocks still referenced are grouped by size and sampled allocation site, largest
+// total first, while blocks waiting on reclamation are left out: retired ones in limbo, on a hazard
+// retired list or orphaned by an exited thread, and those whose logged decrements take them to zero
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 64
+#define HEAP_SIZE 5000 // Past every pool, so it comes from the heap
+#define OUTPUT_SIZE 4096
+
+static MemoryManager* manager;
+
+// Two allocation sites, each a single call in a loop, so neither is inlined or turned into a tail call
+__attribute__((noinline)) static void allocate_at_first_site(void** blocks, size_t count, size_t size) {
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = allocate_memory(manager, size, 16);
+        CHECK(blocks[i] != NULL);
+    }
+}
+
+__attribute__((noinline)) static void allocate_at_second_site(void** blocks, size_t count, size_t size) {
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = allocate_memory(manager, size, 16);
+        CHECK(blocks[i] != NULL);
+    }
+}
+
+// Retire one block each way and exit, leaving both on the manager's orphan lists
+static void* retire_and_exit(void* arg) {
+    void** blocks = (void**)arg;
+    retire_memory(manager, blocks[0]);
+    hazard_retire(manager, blocks[1]);
+    return NULL;
+}
+
+// Print the leak report into a string
+static void read_report(char* output) {
+    FILE* file = tmpfile();
+    CHECK(file != NULL);
+    report_leaks(manager, file);
+    fflush(file);
+    rewind(file);
+    size_t length = fread(output, 1, OUTPUT_SIZE - 1, file);
+    output[length] = '\0';
+    fclose(file);
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0);
+    enable_leak_report(manager, 1); // Sample every allocation site
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    static char output[OUTPUT_SIZE];
+    char expected[256];
+
+    // Blocks waiting on every kind of reclamation are not leaks
+    void* retired[2];
+    allocate_at_first_site(retired, 2, 64);
+    retire_memory(manager, retired[0]);
+    hazard_retire(manager, retired[1]);
+    void* orphans[2];
+    allocate_at_first_site(&orphans[0], 1, 64);
+    allocate_at_first_site(&orphans[1], 1, HEAP_SIZE);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, retire_and_exit, orphans) == 0);
+    pthread_join(thread, NULL);
+    CHECK(manager->orphans == find_block(orphans[0]) && manager->hazard_orphans == find_block(orphans[1]));
+    set_deferred_decrements(manager, 1);
+    void* logged;
+    allocate_at_first_site(&logged, 1, 64);
+    decrement_ref_count(manager, logged);
+    CHECK(atomic_load(&find_block(logged)->ref_count) == 1);
+    read_report(output);
+    CHECK(strstr(output, "Leak report: no blocks still referenced.") != NULL);
+
+    // Blocks still referenced once the logs are applied are grouped by size and site
+    void* first[3];
+    allocate_at_first_site(first, 3, 64);
+    CHECK(find_block(first[0])->pool != NULL);
+    increment_ref_count(manager, first[0]);
+    increment_ref_count(manager, first[0]);
+    decrement_ref_count(manager, first[0]); // Logged, so the report counts it as applied
+    void* second[2];
+    allocate_at_second_site(second, 2, 64);
+    void* heap;
+    allocate_at_second_site(&heap, 1, HEAP_SIZE);
+    CHECK(find_block(heap)->pool == NULL);
+    const void* first_site = find_block(first[0])->site;
+    const void* second_site = find_block(second[0])->site;
+    const void* heap_site = find_block(heap)->site;
+    CHECK(first_site != NULL && second_site != NULL && heap_site != NULL && first_site != second_site);
+
+    read_report(output);
+    snprintf(expected, sizeof(expected), "Leak report: 6 blocks still referenced, %d bytes total", 5 * 64 + HEAP_SIZE);
+    CHECK(strstr(output, expected) != NULL);
+    snprintf(expected, sizeof(expected), "  1 x %d bytes, ref_count 1..1, allocated at %p\n", HEAP_SIZE, heap_site);
+    char* heap_line = strstr(output, expected);
+    snprintf(expected, sizeof(expected), "  3 x 64 bytes, ref_count 1..2, allocated at %p\n", first_site);
+    char* first_line = strstr(output, expected);
+    snprintf(expected, sizeof(expected), "  2 x 64 bytes, ref_count 1..1, allocated at %p\n", second_site);
+    char* second_line = strstr(output, expected);
+    CHECK(heap_line != NULL && first_line != NULL && second_line != NULL);
+    CHECK(heap_line < first_line && first_line < second_line); // Largest total first
+
+    // Once reclamation catches up, the same blocks are reported
+    flush_deferred_decrements(manager);
+    epoch_reclaim(manager);
+    epoch_reclaim(manager);
+    hazard_reclaim(manager);
+    CHECK(manager->orphans == NULL && manager->hazard_orphans == NULL);
+    CHECK(atomic_load(&find_block(first[0])->ref_count) == 2);
+    char settled[OUTPUT_SIZE];
+    strcpy(settled, output);
+    read_report(output);
+    CHECK(strcmp(output, settled) == 0);
+
+    manager->report_leaks_on_free = 0; // These leaks are deliberate
+    free_memory_manager(manager);
+    printf("leak report: ok\n");
+    return 0;
+}
@@ -0,0 +1,61 @@
+// THREAD_MODE_LOCKED and a thread cache cap of 0: every pool allocation and free goes straight to
+// the pool, so its free count is exact after each call and no thread bin ever holds a block
+#include "../mem_manager.c"
+#include "check.h"
+
+#define BLOCKS 32
+#define CYCLES 10
+#define HELD 5
+
+// Run alloc/free cycles on one pool and check the free count after every call
+static void check_uncached(MemoryManager* manager) {
+    create_memory_pool(manager, 64, BLOCKS, 16);
+    MemPool* pool = manager->arenas[0]->pool_table[manager->arenas[0]->pool_count - 1];
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+        void* ptr = allocate_from_pool(manager, 64, 16);
+        CHECK(ptr != NULL && find_block(ptr)->pool == pool);
+        CHECK(pool->free_count == BLOCKS - 1);
+        deallocate_memory(manager, ptr);
+        CHECK(pool->free_count == BLOCKS);
+    }
+
+    void* held[HELD];
+    for (int i = 0; i < HELD; i++) {
+        held[i] = allocate_from_pool(manager, 64, 16);
+        CHECK(held[i] != NULL);
+    }
+    CHECK(pool->free_count == BLOCKS - HELD);
+    for (int i = 0; i < HELD; i++) {
+        deallocate_memory(manager, held[i]);
+    }
+    CHECK(pool->free_count == BLOCKS);
+
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    CHECK(cache != NULL && cache->bins[pool->class_index].count == 0 && cache->cached_bytes == 0);
+    free_memory_manager(manager);
+}
+
+int main(void) {
+    MemoryManagerConfig config;
+    init_memory_manager_config(&config);
+    config.threads = THREAD_MODE_LOCKED;
+    check_uncached(create_memory_manager_ex(&config));
+
+    MemoryManager* manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0);
+    check_uncached(manager);
+
+    // With the default cap the same frees stay in the thread's bin
+    manager = create_memory_manager();
+    create_memory_pool(manager, 64, BLOCKS, 16);
+    MemPool* pool = manager->arenas[0]->pool_table[manager->arenas[0]->pool_count - 1];
+    void* ptr = allocate_from_pool(manager, 64, 16);
+    deallocate_memory(manager, ptr);
+    CHECK(pool->free_count < BLOCKS);
+    flush_thread_cache(manager);
+    CHECK(pool->free_count == BLOCKS);
+    free_memory_manager(manager);
+
+    printf("locked mode: ok\n");
+    return 0;
+}
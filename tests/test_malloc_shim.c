@@ -0,0 +1,100 @@
+// malloc shim smoke test, run with libamm_preload.so in LD_PRELOAD: the malloc family is served by the
+// manager, keeps its contracts, and a child forked while other threads allocate can keep allocating
+#define _GNU_SOURCE // For malloc_usable_size
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "check.h"
+
+#define SHIM_TAG_SALT ((uintptr_t)0x9e3779b97f4a7c15ULL) // As in malloc_shim.c
+#define WORKERS 4
+#define FORKS 50
+#define CHILD_TIMEOUT 10 // Seconds before a deadlocked child is killed
+
+static volatile int stopping;
+
+// Check that a pointer carries the shim's tag, so the manager rather than glibc served it; the tag
+// sits in front of the allocation, out of the bounds the compiler knows for it
+__attribute__((noinline)) static int from_shim(void* ptr) {
+    uintptr_t address = (uintptr_t)ptr;
+    uintptr_t tag;
+    memcpy(&tag, (const void*)(address - sizeof(tag)), sizeof(tag));
+    return tag == (address ^ SHIM_TAG_SALT);
+}
+
+// Allocate and free through the shim until told to stop
+static void* churn(void* arg) {
+    (void)arg;
+    for (size_t i = 0; !stopping; i++) {
+        void* ptr = malloc(16 + (i * 37) % 4000);
+        CHECK(ptr != NULL);
+        free(ptr);
+    }
+    return NULL;
+}
+
+int main(void) {
+    char* text = (char*)malloc(100);
+    CHECK(text != NULL && from_shim(text));
+    CHECK(malloc_usable_size(text) >= 100);
+    strcpy(text, "smoke");
+
+    text = (char*)realloc(text, 100000);
+    CHECK(text != NULL && from_shim(text) && strcmp(text, "smoke") == 0);
+    char* copy = strdup(text);
+    CHECK(copy != NULL && strcmp(copy, "smoke") == 0);
+    free(copy);
+    free(text);
+
+    unsigned char* zeroed = (unsigned char*)calloc(1000, 3);
+    CHECK(zeroed != NULL && from_shim(zeroed));
+    for (size_t i = 0; i < 3000; i++) {
+        CHECK(zeroed[i] == 0);
+    }
+    free(zeroed);
+    volatile size_t huge = SIZE_MAX / 2; // Hidden from the compiler's overflow warning
+    CHECK(calloc(huge, 4) == NULL);
+
+    void* aligned = NULL;
+    CHECK(posix_memalign(&aligned, 256, 1000) == 0 && (uintptr_t)aligned % 256 == 0 && from_shim(aligned));
+    free(aligned);
+    aligned = aligned_alloc(4096, 4096);
+    CHECK(aligned != NULL && (uintptr_t)aligned % 4096 == 0);
+    free(aligned);
+    CHECK(posix_memalign(&aligned, 24, 100) != 0);
+    free(NULL);
+
+    // A forked child keeps allocating, as a server forking for a background save does
+    pthread_t workers[WORKERS];
+    for (int i = 0; i < WORKERS; i++) {
+        CHECK(pthread_create(&workers[i], NULL, churn, NULL) == 0);
+    }
+    for (int i = 0; i < FORKS; i++) {
+        pid_t child = fork();
+        CHECK(child >= 0);
+        if (child == 0) {
+            alarm(CHILD_TIMEOUT);
+            for (size_t j = 0; j < 1000; j++) {
+                void* ptr = malloc(16 + (j * 53) % 8000);
+                if (ptr == NULL || !from_shim(ptr)) {
+                    _exit(EXIT_FAILURE);
+                }
+                free(ptr);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        int status;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+    stopping = 1;
+    for (int i = 0; i < WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    printf("malloc shim: ok\n");
+    return 0;
+}
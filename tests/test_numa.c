@@ -0,0 +1,104 @@
+// NUMA arenas: a single-node host still gets node 0 and can make node arenas by hand; frees from a
+// thread on another node queue on the pool's remote list with a CAS splice, concurrently and in
+// batches, without touching the free count; the owner takes them back when its pool runs dry
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 256
+#define THREADS 8
+#define REMOTE_PER_THREAD 16
+
+static MemoryManager* manager;
+
+// Pool of one size in one arena
+static MemPool* arena_pool(int arena) {
+    MemArena* owner = manager->arenas[arena];
+    return owner->pool_table[owner->pool_count - 1];
+}
+
+static size_t remote_count(MemPool* pool) {
+    size_t count = 0;
+    for (MemBlock* block = atomic_load(&pool->remote_frees); block != NULL; block = block->next) {
+        count++;
+    }
+    return count;
+}
+
+// Free blocks from a thread on another node, all at once
+static void* free_remotely(void* arg) {
+    void** blocks = (void**)arg;
+    bind_thread_to_arena(manager, 0);
+    for (size_t i = 0; i < REMOTE_PER_THREAD; i++) {
+        deallocate_memory(manager, blocks[i]);
+    }
+    return NULL;
+}
+
+int main(void) {
+    // Whatever the host, arena 0 is node 0, and an arena can be placed on any node by hand
+    manager = create_memory_manager();
+    CHECK(enable_numa_arenas(manager) >= 1 && manager->arenas[0]->node == 0);
+    int remote_arena = create_node_arena(manager, NUMA_MAX_NODES - 1);
+    CHECK(remote_arena > 0 && manager->arenas[remote_arena]->node == NUMA_MAX_NODES - 1);
+    CHECK(create_node_arena(manager, NUMA_MAX_NODES) == -1);
+    set_thread_cache_cap(manager, 0); // Frees go straight to the pool, so its counts are exact
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    MemPool* pool = arena_pool(remote_arena);
+    CHECK(pool->slab_size != 0); // Node arenas map their slabs so they can be placed
+
+    // Frees from other nodes' threads are spliced onto the remote list, concurrently, without the pool lock
+    static void* remote[THREADS][REMOTE_PER_THREAD];
+    bind_thread_to_arena(manager, remote_arena);
+    for (int t = 0; t < THREADS; t++) {
+        for (size_t i = 0; i < REMOTE_PER_THREAD; i++) {
+            remote[t][i] = allocate_from_pool(manager, 64, 16);
+            CHECK(remote[t][i] != NULL && find_block(remote[t][i])->pool == pool);
+        }
+    }
+    size_t free_count = pool->free_count;
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        CHECK(pthread_create(&threads[t], NULL, free_remotely, remote[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    CHECK(pool->free_count == free_count && remote_count(pool) == THREADS * REMOTE_PER_THREAD);
+
+    // A batch of deferred decrements reaching zero is spliced in with one push
+    bind_thread_to_arena(manager, remote_arena);
+    void* batch[REMOTE_PER_THREAD];
+    for (size_t i = 0; i < REMOTE_PER_THREAD; i++) {
+        batch[i] = allocate_from_pool(manager, 64, 16);
+        CHECK(batch[i] != NULL);
+    }
+    bind_thread_to_arena(manager, 0);
+    set_deferred_decrements(manager, 1);
+    for (size_t i = 0; i < REMOTE_PER_THREAD; i++) {
+        decrement_ref_count(manager, batch[i]);
+    }
+    flush_deferred_decrements(manager);
+    set_deferred_decrements(manager, 0);
+    CHECK(remote_count(pool) == (THREADS + 1) * REMOTE_PER_THREAD);
+
+    // The owner takes the remote list back once its free list runs dry
+    bind_thread_to_arena(manager, remote_arena);
+    static void* drain[POOL_BLOCKS];
+    size_t drained = 0;
+    while (pool->free_count > 0) {
+        drain[drained] = allocate_from_pool(manager, 64, 16);
+        CHECK(find_block(drain[drained++])->pool == pool);
+    }
+    CHECK(remote_count(pool) == (THREADS + 1) * REMOTE_PER_THREAD);
+    drain[drained] = allocate_from_pool(manager, 64, 16);
+    CHECK(find_block(drain[drained++])->pool == pool);
+    CHECK(remote_count(pool) == 0 && pool->free_count == (THREADS + 1) * REMOTE_PER_THREAD - 1);
+    for (size_t i = 0; i < drained; i++) {
+        deallocate_memory(manager, drain[i]);
+    }
+    CHECK(pool->free_count == POOL_BLOCKS);
+
+    free_memory_manager(manager);
+    printf("NUMA arenas: ok\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+// Typed object pools: init runs once per slot when the pool is created, reset runs on every free, an
+// exhausted pool returns NULL, and a padded slot rounds its header and object up to whole cache lines
+#include "../mem_manager.c"
+#include "check.h"
+
+#define CAPACITY 32
+#define OBJECT_SIZE 48 // With its 16-byte header, exactly one cache line
+#define ROUNDS 5
+
+typedef struct {
+    size_t inits;
+    size_t resets;
+} HookCounts;
+
+static void count_init(void* object, void* context) {
+    ((HookCounts*)context)->inits++;
+    memset(object, 0, OBJECT_SIZE);
+}
+
+static void count_reset(void* object, void* context) {
+    ((HookCounts*)context)->resets++;
+    memset(object, 0, OBJECT_SIZE);
+}
+
+// Every slot starts on a cache line, and its header and object stay within the slot
+static void check_padded_slots(MemPool* pool) {
+    for (size_t i = 0; i < pool->block_count; i++) {
+        uintptr_t ptr = (uintptr_t)pool->blocks[i].ptr;
+        CHECK(ptr % 16 == 0);
+        CHECK((ptr - 16) % CACHE_LINE_SIZE == 0);
+        if (i > 0) {
+            size_t stride = ptr - (uintptr_t)pool->blocks[i - 1].ptr;
+            CHECK(stride % CACHE_LINE_SIZE == 0);
+            CHECK(stride == CACHE_LINE_SIZE); // Padded as one unit, not a line for each
+        }
+    }
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager();
+    HookCounts counts = {0, 0};
+    ObjectPoolConfig config = {
+        .object_size = OBJECT_SIZE,
+        .alignment = 16,
+        .capacity = CAPACITY,
+        .init = count_init,
+        .reset = count_reset,
+        .hook_context = &counts,
+        .pad_to_cache_line = 1,
+    };
+
+    // init runs once for every slot, and only at creation
+    MemPool* pool = create_object_pool(manager, &config);
+    CHECK(pool != NULL && pool->typed);
+    CHECK(counts.inits == CAPACITY && counts.resets == 0);
+    check_padded_slots(pool);
+
+    // The pool hands out every slot once, then returns NULL; plain allocations never reach it
+    void* objects[CAPACITY];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < CAPACITY; i++) {
+            objects[i] = allocate_object(manager, pool);
+            CHECK(objects[i] != NULL && find_block(objects[i])->pool == pool);
+            CHECK(*(unsigned char*)objects[i] == 0);
+            *(unsigned char*)objects[i] = 1;
+        }
+        CHECK(allocate_object(manager, pool) == NULL);
+        void* plain = allocate_memory(manager, OBJECT_SIZE, 16);
+        CHECK(plain != NULL && find_block(plain)->pool != pool);
+        deallocate_memory(manager, plain);
+
+        // reset runs on every free, so the next allocation finds the object initialized again
+        for (size_t i = 0; i < CAPACITY; i++) {
+            deallocate_memory(manager, objects[i]);
+        }
+        CHECK(counts.resets == (size_t)(round + 1) * CAPACITY);
+    }
+    CHECK(counts.inits == CAPACITY);
+
+    free_memory_manager(manager);
+    printf("object pools: ok\n");
+    return 0;
+}
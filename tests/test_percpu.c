@@ -0,0 +1,140 @@
+// Per-CPU caches, both as restartable sequences and under the per-CPU lock: a refill moves half the
+// slots from the pool to the current CPU, a full CPU hands half its slots back, blocks are never
+// handed out twice while threads churn, and switching back to per-thread caches drains every CPU
+#include "../mem_manager.c"
+#include <sched.h>
+#include "check.h"
+
+#define POOL_BLOCKS 4096
+#define THREADS 8
+#define HELD 100 // Blocks each thread holds at once
+#define ROUNDS 200
+
+static MemoryManager* manager;
+static MemPool* pool;
+
+// Blocks cached by every CPU for the pool
+static size_t cached_on_cpus(void) {
+    size_t cached = 0;
+    for (size_t cpu = 0; cpu < manager->cpu_count; cpu++) {
+        cached += pool->arena->cpu_caches[cpu].classes[pool->class_index].current;
+    }
+    return cached;
+}
+
+static size_t cached_on(int cpu) {
+    return pool->arena->cpu_caches[cpu].classes[pool->class_index].current;
+}
+
+// Allocate and free blocks, marking each with the thread so a block handed out twice is caught
+static void* churn(void* arg) {
+    uintptr_t id = (uintptr_t)arg;
+    void* held[HELD];
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t count = 1 + (id * 31 + (size_t)round * 7) % HELD;
+        for (size_t i = 0; i < count; i++) {
+            held[i] = allocate_from_pool(manager, 64, 16);
+            CHECK(held[i] != NULL && find_block(held[i])->pool == pool);
+            *(uintptr_t*)held[i] = id;
+        }
+        for (size_t i = 0; i < count; i++) {
+            CHECK(*(uintptr_t*)held[i] == id);
+            deallocate_memory(manager, held[i]);
+        }
+    }
+    return NULL;
+}
+
+static void check_per_cpu(int use_rseq) {
+    manager = create_memory_manager();
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    pool = manager->arenas[0]->pool_table[manager->arenas[0]->pool_count - 1];
+    CHECK(set_cache_mode(manager, CACHE_PER_CPU) == 0);
+    if (!use_rseq) {
+        manager->use_rseq = 0;
+    }
+    CHECK(cache_uses_rseq(manager) == use_rseq);
+
+    // Stay on one CPU, so the refill and overflow counts are exact
+    int cpu = sched_getcpu();
+    CHECK(cpu >= 0 && (size_t)cpu < manager->cpu_count);
+    cpu_set_t one_cpu;
+    CPU_ZERO(&one_cpu);
+    CPU_SET(cpu, &one_cpu);
+    CHECK(sched_setaffinity(0, sizeof(one_cpu), &one_cpu) == 0);
+
+    // The first allocation refills the current CPU with half its slots and keeps one block
+    void* first = allocate_from_pool(manager, 64, 16);
+    CHECK(first != NULL && find_block(first)->pool == pool);
+    CHECK(pool->free_count == POOL_BLOCKS - PERCPU_CACHE_SLOTS / 2 - 1);
+    CHECK(cached_on(cpu) == PERCPU_CACHE_SLOTS / 2 && cached_on_cpus() == PERCPU_CACHE_SLOTS / 2);
+    deallocate_memory(manager, first);
+    CHECK(cached_on(cpu) == PERCPU_CACHE_SLOTS / 2 + 1);
+
+    // A free that finds the CPU full sends that block and half the slots back to the pool
+    static void* held[PERCPU_CACHE_SLOTS * 2];
+    for (size_t i = 0; i < PERCPU_CACHE_SLOTS * 2; i++) {
+        held[i] = allocate_from_pool(manager, 64, 16);
+        CHECK(held[i] != NULL);
+    }
+    size_t freed = 0;
+    while (cached_on(cpu) < PERCPU_CACHE_SLOTS) {
+        CHECK(freed < PERCPU_CACHE_SLOTS * 2);
+        deallocate_memory(manager, held[freed++]);
+    }
+    size_t free_count = pool->free_count;
+    deallocate_memory(manager, held[freed++]);
+    CHECK(cached_on(cpu) == PERCPU_CACHE_SLOTS / 2);
+    CHECK(pool->free_count == free_count + PERCPU_CACHE_SLOTS / 2 + 1);
+    while (freed < PERCPU_CACHE_SLOTS * 2) {
+        deallocate_memory(manager, held[freed++]);
+    }
+    CHECK(pool->free_count + cached_on_cpus() == POOL_BLOCKS);
+
+    // The locked path files a CPU number past the caches under CPU 0
+    if (!use_rseq && cpu != 0) {
+        size_t cpu_count = manager->cpu_count;
+        manager->cpu_count = (size_t)cpu;
+        CHECK(cached_on(0) == 0);
+        void* ptr = allocate_from_pool(manager, 64, 16);
+        CHECK(ptr != NULL && cached_on(0) == PERCPU_CACHE_SLOTS / 2);
+        deallocate_memory(manager, ptr);
+        CHECK(cached_on(0) == PERCPU_CACHE_SLOTS / 2 + 1);
+        manager->cpu_count = cpu_count;
+    }
+
+    // Threads on every CPU churn without ever sharing a block
+    cpu_set_t all_cpus;
+    CPU_ZERO(&all_cpus);
+    for (size_t i = 0; i < manager->cpu_count && i < CPU_SETSIZE; i++) {
+        CPU_SET(i, &all_cpus);
+    }
+    sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+    pthread_t threads[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, churn, (void*)(i + 1)) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(pool->free_count + cached_on_cpus() == POOL_BLOCKS);
+
+    // Back to per-thread caches, every CPU's blocks return to the pool
+    CHECK(set_cache_mode(manager, CACHE_PER_THREAD) == 0);
+    CHECK(pool->free_count == POOL_BLOCKS);
+    free_memory_manager(manager);
+}
+
+int main(void) {
+    MemoryManager* probe = create_memory_manager();
+    CHECK(set_cache_mode(probe, CACHE_PER_CPU) == 0);
+    int rseq = cache_uses_rseq(probe);
+    free_memory_manager(probe);
+
+    check_per_cpu(0);
+    if (rseq) {
+        check_per_cpu(1);
+    }
+    printf("per-CPU caches (%s): ok\n", rseq ? "rseq and locked" : "locked only");
+    return 0;
+}
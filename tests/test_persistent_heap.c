@@ -0,0 +1,111 @@
+// Crash consistency of persistent heaps: a child churns linked allocations and frees until it is
+// SIGKILLed at a random point, then the parent reopens the heap and checks it block by block.
+// Interior pointers are never taken for blocks by persistent_free.
+// The library source is included so the checks can read the heap's on-disk layout.
+#include "../mem_manager.c"
+#include <sys/wait.h>
+#include "persistent_check.h"
+
+#define ROUNDS 200
+#define MAX_KILL_DELAY_US 2000
+#define MAX_REQUEST 3000
+
+// Allocate and free linked blocks until killed; signals ready once the heap is open
+static void churn(const char* path, int ready, unsigned seed) {
+    PersistentHeap* heap = open_persistent_heap(path, 0);
+    if (heap == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    uint64_t* slots = (uint64_t*)persistent_pointer(heap, persistent_root(heap));
+    char byte = 1;
+    if (write(ready, &byte, 1) != 1) {
+        _exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        uint64_t* slot = &slots[rand_r(&seed) % SLOTS];
+        if (*slot == 0) {
+            persistent_allocate(heap, 1 + rand_r(&seed) % MAX_REQUEST, slot);
+        } else {
+            persistent_free(heap, persistent_pointer(heap, *slot), slot);
+        }
+    }
+}
+
+int main(void) {
+    const char* dir = getenv("TMPDIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/amm_persistent_test_%ld.heap", dir != NULL ? dir : "/tmp", (long)getpid());
+    unlink(path);
+
+    // Root block of link words, allocated before any crash
+    PersistentHeap* heap = open_persistent_heap(path, HEAP_SIZE);
+    CHECK(heap != NULL);
+    void* root = persistent_allocate(heap, SLOTS * sizeof(uint64_t), NULL);
+    CHECK(root != NULL);
+    memset(root, 0, SLOTS * sizeof(uint64_t));
+    persistent_set_root(heap, persistent_offset(heap, root));
+
+    // Requests past the largest size class fail instead of indexing past the free lists
+    size_t size = heap->size;
+    heap->size = SIZE_MAX;
+    CHECK(persistent_allocate(heap, (size_t)1 << (PERSISTENT_CLASSES - 1), NULL) == NULL);
+    CHECK(persistent_allocate(heap, SIZE_MAX - 1, NULL) == NULL);
+    heap->size = size;
+
+    // An interior pointer is not freed, even behind bytes that look like an allocated block's header
+    uint64_t* slots = (uint64_t*)root;
+    char* block = (char*)persistent_allocate(heap, 200, &slots[0]);
+    CHECK(block != NULL);
+    PersistentBlock* fake = (PersistentBlock*)(block + 64 - sizeof(PersistentBlock));
+    fake->size_class = PERSISTENT_MIN_CLASS;
+    fake->state = PERSISTENT_ALLOCATED;
+    fake->next = 0;
+    uint64_t top = persistent_header(heap)->top;
+    persistent_free(heap, block + 64, NULL);
+    persistent_free(heap, block + 1, NULL);
+    CHECK(persistent_header(heap)->free_lists[PERSISTENT_MIN_CLASS] == 0);
+    void* small = persistent_allocate(heap, 16, NULL);
+    CHECK(small != NULL && small != block + 64);
+    CHECK(persistent_header(heap)->top > top);
+    persistent_free(heap, small, NULL);
+    persistent_free(heap, block, &slots[0]);
+    CHECK(slots[0] == 0);
+    check_heap(heap);
+    close_persistent_heap(heap);
+
+    unsigned seed = (unsigned)getpid();
+    for (int round = 0; round < ROUNDS; round++) {
+        int ready[2];
+        CHECK(pipe(ready) == 0);
+        pid_t child = fork();
+        CHECK(child >= 0);
+        if (child == 0) {
+            close(ready[0]);
+            churn(path, ready[1], seed + (unsigned)round);
+        }
+        close(ready[1]);
+        char byte;
+        CHECK(read(ready[0], &byte, 1) == 1);
+        close(ready[0]);
+        usleep(rand_r(&seed) % MAX_KILL_DELAY_US);
+        kill(child, SIGKILL);
+        int status;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+        heap = open_persistent_heap(path, 0);
+        CHECK(heap != NULL);
+        CHECK(persistent_heap_recovered(heap));
+        check_heap(heap);
+        close_persistent_heap(heap);
+    }
+
+    // A clean close needs no recovery
+    heap = open_persistent_heap(path, 0);
+    CHECK(heap != NULL);
+    CHECK(!persistent_heap_recovered(heap));
+    close_persistent_heap(heap);
+    unlink(path);
+    printf("persistent heap: %d crashes recovered\n", ROUNDS);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// mm::ref_ptr: copies share the block's ref_count, moves leave it alone, the last owner runs the
+// destructor and frees the block exactly once, even with owners dropped on many threads
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "mem_manager.hpp"
+#include "check.h"
+
+#define THREADS 8
+#define ROUNDS 20
+#define COPIES 100 // Copies each thread makes and drops per round
+
+static std::atomic<int> live_objects{0};
+static std::atomic<int> destroyed{0};
+
+struct Tracked {
+    explicit Tracked(int value) : value(value) {
+        live_objects++;
+    }
+    ~Tracked() {
+        live_objects--;
+        destroyed++;
+    }
+    int value;
+};
+
+struct Throwing {
+    Throwing() {
+        throw std::runtime_error("constructor failed");
+    }
+};
+
+static size_t blocks_in_use(MemoryManager* manager) {
+    MemStats stats;
+    get_memory_stats(manager, &stats);
+    return stats.blocks_in_use;
+}
+
+int main() {
+    MemoryManager* manager = create_memory_manager();
+    size_t baseline = blocks_in_use(manager);
+
+    {
+        mm::ref_ptr<Tracked> first = mm::make_ref<Tracked>(manager, 7);
+        CHECK(first && first->value == 7 && first.use_count() == 1);
+        CHECK(blocks_in_use(manager) == baseline + 1);
+
+        mm::ref_ptr<Tracked> copy = first;
+        CHECK(copy == first && first.use_count() == 2);
+        mm::ref_ptr<Tracked> moved = std::move(copy);
+        CHECK(!copy && moved.use_count() == 2);
+
+        // The plain C counting works on the same block
+        increment_ref_count(manager, first.get());
+        CHECK(first.use_count() == 3);
+        decrement_ref_count(manager, first.get());
+        CHECK(first.use_count() == 2);
+
+        moved.reset();
+        CHECK(first.use_count() == 1 && live_objects == 1);
+        mm::ref_ptr<Tracked> other = mm::make_ref<Tracked>(manager, 8);
+        first = other;
+        CHECK(destroyed == 1 && first->value == 8 && other.use_count() == 2);
+    }
+    CHECK(live_objects == 0 && destroyed == 2);
+    CHECK(blocks_in_use(manager) == baseline);
+
+    // A throwing constructor leaves no block behind
+    bool threw = false;
+    try {
+        mm::make_ref<Throwing>(manager);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw && blocks_in_use(manager) == baseline);
+
+    // Copies made and dropped on many threads destroy each object exactly once
+    destroyed = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        mm::ref_ptr<Tracked> shared = mm::make_ref<Tracked>(manager, round);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([copy = shared]() mutable {
+                for (int i = 0; i < COPIES; i++) {
+                    mm::ref_ptr<Tracked> local = copy;
+                    CHECK(local.use_count() >= 2);
+                }
+                copy.reset();
+            });
+        }
+        shared.reset();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        CHECK(destroyed == round + 1);
+    }
+    CHECK(live_objects == 0 && blocks_in_use(manager) == baseline);
+
+    free_memory_manager(manager);
+    printf("ref_ptr: ok\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Shared heaps across processes: workers are SIGKILLed while they churn allocations, one of them
+// while it holds the heap lock, and the survivors must recover the heap and keep using it.
+// A heap found corrupt by recovery must fail every later call instead of being marked consistent.
+#include "../mem_manager.c"
+#include <sys/wait.h>
+#include "persistent_check.h"
+
+#define WORKERS 3
+#define KILLS 100
+#define MAX_KILL_DELAY_US 2000
+#define MAX_REQUEST 3000
+
+// Allocate and free blocks linked from the worker's share of the root slots until killed
+static void churn(const char* name, int worker, int ready) {
+    PersistentHeap* heap = open_shared_heap(name, 0);
+    if (heap == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    uint64_t* slots = (uint64_t*)persistent_pointer(heap, persistent_root(heap)) + worker * (SLOTS / WORKERS);
+    unsigned seed = (unsigned)getpid();
+    char byte = 1;
+    if (write(ready, &byte, 1) != 1) {
+        _exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        uint64_t* slot = &slots[rand_r(&seed) % (SLOTS / WORKERS)];
+        if (*slot == 0) {
+            persistent_allocate(heap, 1 + rand_r(&seed) % MAX_REQUEST, slot);
+        } else {
+            persistent_free(heap, persistent_pointer(heap, *slot), slot);
+        }
+    }
+}
+
+// Take the heap lock, optionally corrupt the log, then wait to be killed holding it
+static void die_holding_lock(const char* name, int corrupt, int ready) {
+    PersistentHeap* heap = open_shared_heap(name, 0);
+    if (heap == NULL || lock_persistent_heap(heap) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if (corrupt) {
+        PersistentLog* log = &persistent_header(heap)->log;
+        log->block = heap->size; // Past the end of the heap
+        log->op = PERSISTENT_ALLOCATED;
+        log->valid = 1;
+    }
+    char byte = 1;
+    if (write(ready, &byte, 1) != 1) {
+        _exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        pause();
+    }
+}
+
+// Fork a process running one of the functions above and wait until it is ready
+static pid_t spawn(const char* name, int worker, int holder, int corrupt) {
+    int ready[2];
+    CHECK(pipe(ready) == 0);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        close(ready[0]);
+        if (holder) {
+            die_holding_lock(name, corrupt, ready[1]);
+        }
+        churn(name, worker, ready[1]);
+    }
+    close(ready[1]);
+    char byte;
+    CHECK(read(ready[0], &byte, 1) == 1);
+    close(ready[0]);
+    return child;
+}
+
+static void kill_child(pid_t child) {
+    int status;
+    kill(child, SIGKILL);
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+}
+
+// Create a shared heap with a root block of link words
+static PersistentHeap* create_heap(const char* name) {
+    unlink_shared_heap(name);
+    PersistentHeap* heap = open_shared_heap(name, HEAP_SIZE);
+    CHECK(heap != NULL);
+    void* root = persistent_allocate(heap, SLOTS * sizeof(uint64_t), NULL);
+    CHECK(root != NULL);
+    memset(root, 0, SLOTS * sizeof(uint64_t));
+    persistent_set_root(heap, persistent_offset(heap, root));
+    return heap;
+}
+
+// Check the heap under its lock, which first recovers it if its last holder died
+static void check_locked_heap(PersistentHeap* heap) {
+    CHECK(lock_persistent_heap(heap) == 0);
+    check_heap(heap);
+    unlock_persistent_heap(heap);
+}
+
+int main(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/amm_shared_test_%ld", (long)getpid());
+    PersistentHeap* heap = create_heap(name);
+
+    // A process killed holding the lock: the survivor takes the lock and carries on
+    pid_t holder = spawn(name, 0, 1, 0);
+    kill_child(holder);
+    uint64_t* slots = (uint64_t*)persistent_pointer(heap, persistent_root(heap));
+    CHECK(persistent_allocate(heap, 100, &slots[0]) != NULL);
+    persistent_free(heap, persistent_pointer(heap, slots[0]), &slots[0]);
+    check_locked_heap(heap);
+
+    // Workers killed at random points, mostly while the others keep allocating from the same heap
+    pid_t workers[WORKERS];
+    for (int w = 0; w < WORKERS; w++) {
+        workers[w] = spawn(name, w, 0, 0);
+    }
+    unsigned seed = (unsigned)getpid();
+    for (int k = 0; k < KILLS; k++) {
+        usleep(rand_r(&seed) % MAX_KILL_DELAY_US);
+        int w = (int)(rand_r(&seed) % WORKERS);
+        kill_child(workers[w]);
+        workers[w] = spawn(name, w, 0, 0);
+    }
+    for (int w = 0; w < WORKERS; w++) {
+        kill_child(workers[w]);
+    }
+    check_locked_heap(heap);
+    CHECK(persistent_allocate(heap, 100, &slots[SLOTS - 1]) != NULL);
+    check_locked_heap(heap);
+    close_persistent_heap(heap);
+    unlink_shared_heap(name);
+
+    // A holder that dies leaving a log recovery rejects makes the heap unusable for everyone
+    heap = create_heap(name);
+    slots = (uint64_t*)persistent_pointer(heap, persistent_root(heap));
+    holder = spawn(name, 0, 1, 1);
+    kill_child(holder);
+    errno = 0;
+    CHECK(persistent_allocate(heap, 100, &slots[0]) == NULL);
+    CHECK(errno == EIO);
+    CHECK(persistent_allocate(heap, 100, &slots[0]) == NULL);
+    CHECK(errno == ENOTRECOVERABLE);
+    CHECK(slots[0] == 0);
+    close_persistent_heap(heap);
+    unlink_shared_heap(name);
+
+    printf("shared heap: %d workers killed, lock holder recovered\n", KILLS);
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Pool selection: a request goes to the smallest pool that fits, a user pool serves its sizes even
+// when generated size classes cover them, and an exhausted pool hands over to the next larger one
+#include "../mem_manager.c"
+#include "check.h"
+
+#define USER_BLOCKS 8
+#define LARGE_USER_SIZE 4096 // Above the largest generated class
+
+static MemPool* pool_of(void* ptr) {
+    CHECK(ptr != NULL);
+    return find_block(ptr)->pool;
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager();
+    set_thread_cache_cap(manager, 0); // Every allocation takes from its pool, so exhaustion is exact
+    MemArena* arena = manager->arenas[0];
+    create_memory_pool(manager, 64, USER_BLOCKS, 16);
+    MemPool* user = arena->pool_table[arena->pool_count - 1];
+    create_memory_pool(manager, LARGE_USER_SIZE, USER_BLOCKS, 16);
+    MemPool* large_user = arena->pool_table[arena->pool_count - 1];
+
+    // The user pool serves its own size and everything it is the smallest fit for
+    void* held[USER_BLOCKS];
+    for (size_t i = 0; i < USER_BLOCKS; i++) {
+        held[i] = allocate_memory(manager, i % 2 == 0 ? 64 : 60, 16);
+        CHECK(pool_of(held[i]) == user);
+    }
+    CHECK(user->free_count == 0);
+    // Once it is empty the next larger pool takes over
+    void* spill = allocate_from_pool(manager, 64, 16);
+    CHECK(pool_of(spill) != user && pool_of(spill)->block_size >= 64);
+    deallocate_memory(manager, spill);
+    for (size_t i = 0; i < USER_BLOCKS; i++) {
+        deallocate_memory(manager, held[i]);
+    }
+    CHECK(user->free_count == USER_BLOCKS);
+
+#ifdef AMM_STATIC_SIZE_CLASSES
+    // Sizes past every user pool within the classes' range take the table lookup
+    size_t class_index = amm_size_class[(100 + AMM_STATIC_CLASS_ALIGNMENT - 1) >> AMM_STATIC_CLASS_GRANULE_SHIFT];
+    void* classed = allocate_memory(manager, 100, 16);
+    CHECK(pool_of(classed) == arena->pool_table[class_index] && pool_of(classed)->block_size == amm_class_size[class_index]);
+    deallocate_memory(manager, classed);
+
+    // An exhausted largest class continues at the next pool in size order, not at the list head
+    size_t last = AMM_STATIC_CLASS_COUNT - 1;
+    static void* class_blocks[1 << 12];
+    CHECK(amm_class_blocks[last] <= sizeof(class_blocks) / sizeof(class_blocks[0]));
+    for (size_t i = 0; i < amm_class_blocks[last]; i++) {
+        class_blocks[i] = allocate_memory(manager, AMM_STATIC_CLASS_MAX_SIZE, 16);
+        CHECK(pool_of(class_blocks[i]) == arena->pool_table[last]);
+    }
+    spill = allocate_memory(manager, AMM_STATIC_CLASS_MAX_SIZE, 16);
+    CHECK(pool_of(spill) == large_user);
+    deallocate_memory(manager, spill);
+    for (size_t i = 0; i < amm_class_blocks[last]; i++) {
+        deallocate_memory(manager, class_blocks[i]);
+    }
+#else
+    spill = allocate_memory(manager, LARGE_USER_SIZE - 100, 16);
+    CHECK(pool_of(spill) == large_user);
+    deallocate_memory(manager, spill);
+#endif
+
+    free_memory_manager(manager);
+    printf("size classes: ok\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Heap snapshots: the binary stream decodes to the stats, every pool and every live block; the JSON
+// stream lists the same blocks; and blocks live for a whole snapshot are listed even when other
+// blocks are freed between calls
+#include "../mem_manager.c"
+#include "check.h"
+
+#define POOL_BLOCKS 32
+#define POOLED 20
+#define HEAP_BLOCKS 200 // Well past SNAPSHOT_RECORDS_PER_LOCK, so the manager lock is dropped mid-stage
+#define HEAP_SIZE 5000 // Above the largest generated size class, so these blocks come from the heap
+#define OUTPUT_SIZE (1 << 20)
+
+// Binary record lengths: magic, version and tag, then 8 stats fields; tag and 5 fields; tag, 5 fields and the pooled flag
+#define STATS_RECORD (6 + 8 * 8)
+#define POOL_RECORD (1 + 5 * 8)
+#define BLOCK_RECORD (1 + 5 * 8 + 1)
+
+static unsigned char output[OUTPUT_SIZE];
+
+// Write a whole snapshot into output, one minimal buffer per call; between calls, free one block
+// of the churn array when given. Returns the snapshot's length.
+static size_t take_snapshot(MemoryManager* manager, SnapshotFormat format, void** churn, size_t churn_count) {
+    SnapshotCursor cursor;
+    begin_heap_snapshot(&cursor, format);
+    size_t length = 0;
+    size_t freed = 0;
+    while (!heap_snapshot_done(&cursor)) {
+        CHECK(length + SNAPSHOT_MIN_BUFFER <= OUTPUT_SIZE);
+        length += write_heap_snapshot(manager, &cursor, output + length, SNAPSHOT_MIN_BUFFER);
+        if (freed < churn_count) {
+            deallocate_memory(manager, churn[freed++]);
+        }
+    }
+    while (freed < churn_count) {
+        deallocate_memory(manager, churn[freed++]);
+    }
+    return length;
+}
+
+static uint64_t get_u64(const unsigned char* record) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | record[i];
+    }
+    return value;
+}
+
+// Count how often ptr appears among the binary snapshot's block records
+static size_t count_listed(const unsigned char* blocks, size_t block_count, const void* ptr) {
+    size_t listed = 0;
+    for (size_t i = 0; i < block_count; i++) {
+        listed += get_u64(blocks + i * BLOCK_RECORD + 1) == (uintptr_t)ptr;
+    }
+    return listed;
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager();
+    create_memory_pool(manager, 64, POOL_BLOCKS, 16);
+    static void* pooled[POOLED];
+    static void* heap[HEAP_BLOCKS];
+    for (size_t i = 0; i < POOLED; i++) {
+        pooled[i] = allocate_from_pool(manager, 48, 16);
+        CHECK(pooled[i] != NULL);
+    }
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        heap[i] = allocate_memory(manager, HEAP_SIZE + i, 16);
+        CHECK(heap[i] != NULL);
+    }
+    increment_ref_count(manager, heap[0]);
+    MemStats stats;
+    get_memory_stats(manager, &stats);
+    size_t pool_count = 0;
+    for (size_t a = 0; a < manager->arena_count; a++) {
+        pool_count += manager->arenas[a]->pool_count;
+    }
+
+    // Binary: stats header, one record per pool, one per block, then the end tag
+    size_t length = take_snapshot(manager, SNAPSHOT_BINARY, NULL, 0);
+    CHECK(length > STATS_RECORD && memcmp(output, "AMMS", 4) == 0 && output[4] == 2 && output[5] == 'S');
+    CHECK(get_u64(output + 6) == stats.allocations);
+    CHECK(get_u64(output + 6 + 4 * 8) == stats.blocks_in_use && stats.blocks_in_use == POOLED + HEAP_BLOCKS);
+    CHECK(get_u64(output + 6 + 5 * 8) == stats.bytes_in_use);
+    size_t offset = STATS_RECORD;
+    size_t pools = 0;
+    while (output[offset] == 'P') {
+        CHECK(get_u64(output + offset + 1) < manager->arena_count);
+        pools++;
+        offset += POOL_RECORD;
+    }
+    CHECK(pools == pool_count);
+    const unsigned char* blocks = output + offset;
+    size_t block_count = 0;
+    while (output[offset] == 'B') {
+        block_count++;
+        offset += BLOCK_RECORD;
+    }
+    CHECK(output[offset] == 'E' && offset + 1 == length);
+    CHECK(block_count == POOLED + HEAP_BLOCKS);
+    for (size_t i = 0; i < POOLED; i++) {
+        CHECK(count_listed(blocks, block_count, pooled[i]) == 1);
+    }
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        CHECK(count_listed(blocks, block_count, heap[i]) == 1);
+    }
+    // Fields of one heap block and one pool block
+    for (size_t i = 0; i < block_count; i++) {
+        const unsigned char* record = blocks + i * BLOCK_RECORD;
+        if (get_u64(record + 1) == (uintptr_t)heap[0]) {
+            CHECK(get_u64(record + 9) == HEAP_SIZE && get_u64(record + 17) == 2 && record[BLOCK_RECORD - 1] == 0);
+        } else if (get_u64(record + 1) == (uintptr_t)pooled[0]) {
+            CHECK(get_u64(record + 9) == 48 && get_u64(record + 17) == 1 && record[BLOCK_RECORD - 1] == 1);
+        }
+    }
+
+    // JSON lists the same blocks
+    length = take_snapshot(manager, SNAPSHOT_JSON, NULL, 0);
+    output[length] = '\0';
+    CHECK(strncmp((char*)output, "{\"stats\":{", 10) == 0 && strcmp((char*)output + length - 2, "]}") == 0);
+    char expected[128];
+    for (size_t i = 0; i < HEAP_BLOCKS; i += 50) {
+        snprintf(expected, sizeof(expected), "{\"address\":\"%p\",\"size\":%zu,", heap[i], HEAP_SIZE + i);
+        CHECK(strstr((char*)output, expected) != NULL);
+    }
+    snprintf(expected, sizeof(expected), "\"address\":\"%p\",\"size\":48,\"ref_count\":1,\"pooled\":true", pooled[0]);
+    CHECK(strstr((char*)output, expected) != NULL);
+
+    // Freeing half the heap blocks while the snapshot runs never hides one of the other half
+    static void* churn[HEAP_BLOCKS / 2];
+    for (size_t i = 0; i < HEAP_BLOCKS / 2; i++) {
+        churn[i] = heap[2 * i + 1];
+    }
+    length = take_snapshot(manager, SNAPSHOT_BINARY, churn, HEAP_BLOCKS / 2);
+    offset = STATS_RECORD + pools * POOL_RECORD;
+    blocks = output + offset;
+    block_count = 0;
+    while (output[offset] == 'B') {
+        block_count++;
+        offset += BLOCK_RECORD;
+    }
+    CHECK(output[offset] == 'E');
+    for (size_t i = 0; i < HEAP_BLOCKS; i += 2) {
+        CHECK(count_listed(blocks, block_count, heap[i]) >= 1);
+    }
+    for (size_t i = 0; i < POOLED; i++) {
+        CHECK(count_listed(blocks, block_count, pooled[i]) == 1);
+    }
+
+    free_memory_manager(manager);
+    printf("snapshot: ok\n");
+    return 0;
+}
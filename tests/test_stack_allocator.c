@@ -0,0 +1,128 @@
+// Stack allocators: LIFO frees, nested push/pop markers, alignment and capacity, and the debug
+// mode's detection of out-of-order frees and pops
+#include "../mem_manager.c"
+#include <sys/wait.h>
+#include "check.h"
+
+#define CAPACITY 4096
+
+// Check that every byte of a range holds the debug poison
+static int poisoned(const void* ptr, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)ptr;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != STACK_DEBUG_POISON) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run a misuse in a child process and check that debug mode aborts it
+static void expect_abort(MemoryManager* manager, void (*misuse)(StackAllocator* stack)) {
+    fflush(NULL);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO); // Keep the misuse report out of the test log
+        misuse(create_stack_allocator(manager, CAPACITY, 1));
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void free_out_of_order(StackAllocator* stack) {
+    void* a = stack_allocate(stack, 32, 0);
+    stack_allocate(stack, 32, 0);
+    stack_free(stack, a); // b is still above it
+}
+
+static void free_twice(StackAllocator* stack) {
+    stack_allocate(stack, 32, 0);
+    void* b = stack_allocate(stack, 32, 0);
+    stack_free(stack, b);
+    stack_free(stack, b);
+}
+
+static void pop_inner_after_outer(StackAllocator* stack) {
+    StackMarker outer = stack_push(stack);
+    stack_allocate(stack, 64, 0);
+    StackMarker inner = stack_push(stack);
+    stack_allocate(stack, 64, 0);
+    stack_pop(stack, outer);
+    stack_pop(stack, inner); // Above the top outer left
+}
+
+static void pop_after_free_below_marker(StackAllocator* stack) {
+    void* a = stack_allocate(stack, 64, 0);
+    StackMarker marker = stack_push(stack);
+    stack_free(stack, a);
+    stack_pop(stack, marker);
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager();
+    StackAllocator* stack = create_stack_allocator(manager, CAPACITY, 1);
+
+    // Frees in reverse order give each byte back
+    char* a = (char*)stack_allocate(stack, 24, 0);
+    size_t after_a = stack_used(stack);
+    char* b = (char*)stack_allocate(stack, 100, 64);
+    char* c = (char*)stack_allocate(stack, 8, 0);
+    CHECK(a != NULL && b != NULL && c != NULL);
+    CHECK((uintptr_t)a % STACK_ALIGNMENT == 0 && (uintptr_t)b % 64 == 0 && (uintptr_t)c % STACK_ALIGNMENT == 0);
+    CHECK(a + 24 <= b - sizeof(StackHeader) && b + 100 <= c - sizeof(StackHeader));
+    stack_free(stack, c);
+    stack_free(stack, b);
+    CHECK(stack_used(stack) == after_a);
+    CHECK(poisoned(b, 100) && poisoned(c, 8));
+    stack_free(stack, a);
+    CHECK(stack_used(stack) == 0);
+    CHECK(stack->live == 0);
+
+    // Nested markers: popping the inner one keeps the outer frame, popping the outer one empties it
+    StackMarker outer = stack_push(stack);
+    char* outer_block = (char*)stack_allocate(stack, 200, 0);
+    memset(outer_block, 'o', 200);
+    size_t outer_used = stack_used(stack);
+    StackMarker inner = stack_push(stack);
+    char* inner_block = (char*)stack_allocate(stack, 300, 0);
+    CHECK(stack_allocate(stack, 16, 0) != NULL);
+    stack_pop(stack, inner);
+    CHECK(stack_used(stack) == outer_used);
+    CHECK(stack->live == 1);
+    CHECK(poisoned(inner_block, 300));
+    CHECK(outer_block[0] == 'o' && outer_block[199] == 'o');
+    CHECK(stack_allocate(stack, 300, 0) == inner_block); // The popped space is reused
+    StackMarker reinner = stack_push(stack);
+    stack_pop(stack, reinner); // An empty frame changes nothing
+    CHECK(stack->live == 2);
+    stack_pop(stack, outer);
+    CHECK(stack_used(stack) == 0);
+    CHECK(stack->live == 0);
+
+    // Alignments beyond the block's own, and requests that do not fit
+    void* page = stack_allocate(stack, 16, 4096);
+    CHECK(page == NULL || (uintptr_t)page % 4096 == 0);
+    stack_free(stack, page);
+    CHECK(stack_allocate(stack, CAPACITY, 0) == NULL);
+    CHECK(stack_allocate(stack, SIZE_MAX, 0) == NULL);
+    void* all = stack_allocate(stack, CAPACITY - sizeof(StackHeader), 0);
+    CHECK(all != NULL);
+    CHECK(stack_allocate(stack, 1, 0) == NULL);
+    stack_free(stack, all);
+    CHECK(stack_used(stack) == 0);
+    destroy_stack_allocator(stack);
+
+    // Debug mode stops misuse instead of corrupting the stack
+    expect_abort(manager, free_out_of_order);
+    expect_abort(manager, free_twice);
+    expect_abort(manager, pop_inner_after_outer);
+    expect_abort(manager, pop_after_free_below_marker);
+
+    free_memory_manager(manager);
+    printf("stack allocator: ok\n");
+    return 0;
+}
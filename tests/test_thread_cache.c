@@ -0,0 +1,129 @@
+// Adaptive thread caches: a bin's limit grows while allocations keep missing, an idle bin is halved
+// and emptied by the periodic scan, and the bytes cached by all threads stay within the global cap
+#include "../mem_manager.c"
+#include "check.h"
+
+#define BUSY_BLOCKS 8192
+#define OTHER_BLOCKS 4096
+#define CAP_BLOCK 1024
+#define CAP_BYTES ((size_t)64 << 10)
+#define CAP_POOL_BLOCKS 4096
+#define THREADS 8
+#define CAP_HELD 200
+
+static MemoryManager* manager;
+static MemPool* cap_pool;
+static pthread_barrier_t cached_barrier;
+static pthread_barrier_t exit_barrier;
+
+static MemPool* last_pool(void) {
+    MemArena* arena = manager->arenas[0];
+    return arena->pool_table[arena->pool_count - 1];
+}
+
+// Fill this thread's cache as far as the cap allows, then wait while the main thread counts
+static void* fill_cache(void* arg) {
+    (void)arg;
+    bind_thread_to_arena(manager, 0);
+    void* held[CAP_HELD];
+    for (size_t i = 0; i < CAP_HELD; i++) {
+        held[i] = allocate_from_pool(manager, CAP_BLOCK, 16);
+        CHECK(held[i] != NULL && find_block(held[i])->pool == cap_pool);
+    }
+    for (size_t i = 0; i < CAP_HELD; i++) {
+        deallocate_memory(manager, held[i]);
+    }
+    pthread_barrier_wait(&cached_barrier);
+    pthread_barrier_wait(&exit_barrier);
+    return NULL;
+}
+
+int main(void) {
+    manager = create_memory_manager();
+    create_memory_pool(manager, 64, BUSY_BLOCKS, 16);
+    MemPool* busy = last_pool();
+    create_memory_pool(manager, 32, OTHER_BLOCKS, 16);
+    MemPool* other = last_pool();
+    bind_thread_to_arena(manager, 0);
+    ThreadCache* cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    ThreadCacheBin* busy_bin = &cache->bins[busy->class_index];
+
+    // Allocating without freeing misses once per refill, so the limit grows
+    static void* held[BUSY_BLOCKS];
+    CHECK(busy_bin->limit == THREAD_CACHE_INITIAL_LIMIT);
+    for (size_t i = 0; i < BUSY_BLOCKS / 2; i++) {
+        held[i] = allocate_from_pool(manager, 64, 16);
+        CHECK(held[i] != NULL && find_block(held[i])->pool == busy);
+    }
+    CHECK(busy_bin->limit > THREAD_CACHE_INITIAL_LIMIT && busy_bin->limit <= THREAD_CACHE_MAX_LIMIT);
+    for (size_t i = 0; i < BUSY_BLOCKS / 2; i++) {
+        deallocate_memory(manager, held[i]);
+    }
+    CHECK(busy_bin->count > 0 && busy_bin->count <= busy_bin->limit);
+    CHECK(busy->free_count + busy_bin->count == BUSY_BLOCKS);
+    size_t busy_limit = busy_bin->limit;
+
+    // Traffic on another pool drives the idle scans, which halve the unused bin and empty it
+    size_t start_tick = cache->tick;
+    for (int round = 0; round < 10000 && cache->tick - start_tick <= 2 * THREAD_CACHE_GC_INTERVAL; round++) {
+        for (size_t i = 0; i < 100; i++) {
+            held[i] = allocate_from_pool(manager, 32, 16);
+            CHECK(held[i] != NULL && find_block(held[i])->pool == other);
+        }
+        for (size_t i = 0; i < 100; i++) {
+            deallocate_memory(manager, held[i]);
+        }
+    }
+    CHECK(cache->tick - start_tick > 2 * THREAD_CACHE_GC_INTERVAL);
+    CHECK(busy_bin->count == 0 && busy->free_count == BUSY_BLOCKS);
+    CHECK(busy_bin->limit == busy_limit / 2);
+    free_memory_manager(manager);
+
+    // One thread never caches past the cap
+    manager = create_memory_manager();
+    set_thread_cache_cap(manager, CAP_BYTES);
+    create_memory_pool(manager, CAP_BLOCK, CAP_POOL_BLOCKS, 16);
+    cap_pool = last_pool();
+    bind_thread_to_arena(manager, 0);
+    cache = (ThreadCache*)pthread_getspecific(manager->cache_key);
+    for (size_t i = 0; i < CAP_HELD; i++) {
+        held[i] = allocate_from_pool(manager, CAP_BLOCK, 16);
+        CHECK(held[i] != NULL);
+    }
+    for (size_t i = 0; i < CAP_HELD; i++) {
+        deallocate_memory(manager, held[i]);
+        CHECK(cache->cached_bytes <= CAP_BYTES);
+    }
+    CHECK(cache->cached_bytes > 0);
+    flush_thread_cache(manager);
+
+    // Threads caching at once pass the cap by at most their unpublished growth
+    pthread_barrier_init(&cached_barrier, NULL, THREADS + 1);
+    pthread_barrier_init(&exit_barrier, NULL, THREADS + 1);
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, fill_cache, NULL) == 0);
+    }
+    pthread_barrier_wait(&cached_barrier);
+    size_t cached = 0;
+    size_t cached_blocks = 0;
+    pthread_mutex_lock(&manager->lock);
+    for (ThreadCache* thread_cache = manager->caches; thread_cache != NULL; thread_cache = thread_cache->next) {
+        cached += thread_cache->cached_bytes;
+        cached_blocks += thread_cache->bins[cap_pool->class_index].count;
+    }
+    pthread_mutex_unlock(&manager->lock);
+    CHECK(cached <= CAP_BYTES + THREADS * THREAD_CACHE_SYNC_BYTES);
+    CHECK(cap_pool->free_count + cached_blocks == CAP_POOL_BLOCKS);
+    pthread_barrier_wait(&exit_barrier);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(cap_pool->free_count == CAP_POOL_BLOCKS);
+    pthread_barrier_destroy(&cached_barrier);
+    pthread_barrier_destroy(&exit_barrier);
+
+    free_memory_manager(manager);
+    printf("thread cache: ok\n");
+    return 0;
+}
@@ -0,0 +1,185 @@
+// TLSF heaps: the bitmaps match the free lists, a freed block merges with free neighbours on both
+// sides at once, and every region is one free block again once all its allocations are freed
+#include "../mem_manager.c"
+#include "check.h"
+
+#define STRESS_BLOCKS 2000
+#define STRESS_ROUNDS 10
+#define STRESS_MAX (256 << 10) // 2000 blocks of up to 256 KiB need several regions
+#define HEAP_BLOCKS 200
+
+// First block of a region
+static TlsfBlock* first_block(TlsfRegion* region) {
+    return (TlsfBlock*)((char*)region + TLSF_REGION_HEADER);
+}
+
+// Check every list against the bitmaps, returning the number of free blocks listed
+static size_t count_listed(TlsfHeap* heap) {
+    size_t listed = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        CHECK(((heap->fl_bitmap >> fl) & 1) == (heap->sl_bitmap[fl] != 0));
+        for (int sl = 0; sl < (1 << TLSF_SL_LOG2); sl++) {
+            TlsfBlock* head = heap->free_lists[fl][sl];
+            CHECK(((heap->sl_bitmap[fl] >> sl) & 1) == (head != NULL));
+            TlsfBlock* previous = NULL;
+            for (TlsfBlock* block = head; block != NULL; block = block->next_free) {
+                int block_fl;
+                int block_sl;
+                CHECK(block->size & TLSF_FREE);
+                tlsf_mapping(block->size & ~TLSF_FLAGS, &block_fl, &block_sl);
+                CHECK(block_fl == fl && block_sl == sl);
+                CHECK(block->prev_free == previous);
+                previous = block;
+                listed++;
+            }
+        }
+    }
+    CHECK(heap->fl_bitmap >> TLSF_FL_COUNT == 0);
+    return listed;
+}
+
+// Walk every region block by block: flags and boundary tags agree, no two free blocks touch, and
+// the free blocks found are exactly the listed ones; returns the number of blocks in use
+static size_t check_heap(TlsfHeap* heap) {
+    size_t free_blocks = 0;
+    size_t used_blocks = 0;
+    for (TlsfRegion* region = heap->regions; region != NULL; region = region->next) {
+        TlsfBlock* block = first_block(region);
+        CHECK((block->size & TLSF_PREV_FREE) == 0);
+        int previous_free = 0;
+        while ((block->size & ~TLSF_FLAGS) != 0) {
+            CHECK((uintptr_t)block + TLSF_HEADER_SIZE < (uintptr_t)region + region->length);
+            TlsfBlock* next = tlsf_next_block(block);
+            int is_free = (block->size & TLSF_FREE) != 0;
+            CHECK(!(is_free && previous_free));
+            CHECK(((next->size & TLSF_PREV_FREE) != 0) == is_free);
+            CHECK(!is_free || next->prev_phys == block);
+            free_blocks += (size_t)is_free;
+            used_blocks += (size_t)!is_free;
+            previous_free = is_free;
+            block = next;
+        }
+        // The end sentinel closes the region
+        CHECK((char*)block + TLSF_HEADER_SIZE == (char*)region + region->length);
+    }
+    CHECK(count_listed(heap) == free_blocks);
+    return used_blocks;
+}
+
+// Check that nothing is allocated: each region holds one free block spanning all of it
+static void check_coalesced(TlsfHeap* heap) {
+    CHECK(check_heap(heap) == 0);
+    for (TlsfRegion* region = heap->regions; region != NULL; region = region->next) {
+        TlsfBlock* block = first_block(region);
+        CHECK(block->size & TLSF_FREE);
+        CHECK((block->size & ~TLSF_FLAGS) == region->length - TLSF_REGION_HEADER - 2 * TLSF_HEADER_SIZE);
+    }
+}
+
+static size_t region_count(TlsfHeap* heap) {
+    size_t count = 0;
+    for (TlsfRegion* region = heap->regions; region != NULL; region = region->next) {
+        count++;
+    }
+    return count;
+}
+
+int main(void) {
+    MemoryManager* manager = create_memory_manager_backend(HEAP_BACKEND_TLSF);
+    MemArena* arena = manager->arenas[0];
+
+    // Consecutive allocations split the region's block from the front
+    char* first = (char*)tlsf_allocate(arena, 100);
+    TlsfHeap* heap = atomic_load(&arena->tlsf);
+    CHECK(first == (char*)first_block(heap->regions) + TLSF_HEADER_SIZE);
+    char* middle = (char*)tlsf_allocate(arena, 1000);
+    char* last = (char*)tlsf_allocate(arena, 5000);
+    CHECK(middle == first + 112 + TLSF_HEADER_SIZE);
+    CHECK(last == middle + 1008 + TLSF_HEADER_SIZE);
+    CHECK(check_heap(heap) == 3 && count_listed(heap) == 1);
+
+    // Freeing the outer two leaves two free blocks; the middle one merges with both at once
+    tlsf_free(arena, first);
+    tlsf_free(arena, last);
+    CHECK(check_heap(heap) == 1 && count_listed(heap) == 2);
+    tlsf_free(arena, middle);
+    check_coalesced(heap);
+    CHECK(count_listed(heap) == 1);
+
+    // A freed block is found again by a request that maps to its list or below
+    char* reused = (char*)tlsf_allocate(arena, 200);
+    char* pinned = (char*)tlsf_allocate(arena, 64);
+    tlsf_free(arena, reused);
+    CHECK(tlsf_allocate(arena, 150) == reused);
+    tlsf_free(arena, reused);
+    tlsf_free(arena, pinned);
+    check_coalesced(heap);
+
+    // Random sizes freed in random order always coalesce back to one block per region
+    static char* blocks[STRESS_BLOCKS];
+    unsigned seed = 1;
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            size_t bytes = 1 + rand_r(&seed) % STRESS_MAX;
+            blocks[i] = (char*)tlsf_allocate(arena, bytes);
+            CHECK(blocks[i] != NULL && (uintptr_t)blocks[i] % TLSF_ALIGNMENT == 0);
+            TlsfBlock* block = (TlsfBlock*)(blocks[i] - TLSF_HEADER_SIZE);
+            CHECK((block->size & ~TLSF_FLAGS) >= bytes && (block->size & TLSF_FREE) == 0);
+            blocks[i][0] = (char)i; // Overlapping blocks would overwrite each other's marks
+            blocks[i][bytes - 1] = (char)i;
+        }
+        CHECK(check_heap(heap) == STRESS_BLOCKS);
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            CHECK(blocks[i][0] == (char)i);
+        }
+        for (size_t i = STRESS_BLOCKS; i > 1; i--) {
+            size_t j = rand_r(&seed) % i;
+            char* swap = blocks[i - 1];
+            blocks[i - 1] = blocks[j];
+            blocks[j] = swap;
+        }
+        for (size_t i = 0; i < STRESS_BLOCKS; i++) {
+            tlsf_free(arena, blocks[i]);
+            if (i % 500 == 0) {
+                check_heap(heap);
+            }
+        }
+        check_coalesced(heap);
+    }
+    CHECK(region_count(heap) > 1);
+
+    // A request larger than a region maps a region of its own
+    size_t regions = region_count(heap);
+    char* huge = (char*)tlsf_allocate(arena, TLSF_REGION_SIZE);
+    CHECK(huge != NULL && region_count(heap) == regions + 1);
+    tlsf_free(arena, huge);
+    check_coalesced(heap);
+
+    // Heap blocks go through the TLSF heap and give it back when freed
+    static void* heap_blocks[HEAP_BLOCKS];
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        size_t size = 4096 + rand_r(&seed) % (MMAP_THRESHOLD_DEFAULT - 4096); // Past any pool
+        heap_blocks[i] = allocate_memory(manager, size, 16);
+        CHECK(heap_blocks[i] != NULL && find_block(heap_blocks[i])->map_size == 0);
+    }
+    CHECK(check_heap(heap) == HEAP_BLOCKS);
+    for (size_t i = 0; i < HEAP_BLOCKS; i++) {
+        deallocate_memory(manager, heap_blocks[i]);
+    }
+    check_coalesced(heap);
+
+    // An empty pool hands over to the heap rather than to larger pools
+    create_memory_pool(manager, 64, 1, 16);
+    create_memory_pool(manager, 256, 4, 16);
+    void* pooled = allocate_memory(manager, 64, 16);
+    void* spilled = allocate_memory(manager, 64, 16);
+    CHECK(find_block(pooled)->pool != NULL && find_block(pooled)->pool->block_size == 64);
+    CHECK(find_block(spilled)->pool == NULL && check_heap(heap) == 1);
+    deallocate_memory(manager, spilled);
+    deallocate_memory(manager, pooled);
+    check_coalesced(heap);
+
+    free_memory_manager(manager);
+    printf("tlsf: ok\n");
+    return 0;
+}
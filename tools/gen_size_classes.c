@@ -0,0 +1,250 @@
+// Generate the static size-class table compiled in with AMM_STATIC_SIZE_CLASSES
+//
+// Usage: gen_size_classes [--trace FILE] [--max-classes N] OUTPUT
+//
+// Without a trace the table uses fixed spacing up to DEFAULT_MAX_SIZE. A trace holds one
+// allocation per line, as "size" or "size count"; the classes are then placed to minimize the
+// bytes lost to rounding up the traced sizes, and frequent classes get larger slabs.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define GRANULE_SHIFT 4
+#define GRANULE ((size_t)1 << GRANULE_SHIFT) // Class sizes are multiples of this, which is also their alignment
+#define MAX_CLASS_SIZE 4096 // Largest size a class may have; bigger allocations go to the heap
+#define MAX_GRANULES (MAX_CLASS_SIZE / GRANULE)
+#define DEFAULT_MAX_SIZE 2048
+#define DEFAULT_MAX_CLASSES 32
+#define CLASS_LIMIT 64 // MAX_SIZE_CLASSES
+#define SLAB_BYTES ((size_t)64 << 10) // Slab size of a class that is rare or untraced
+#define TRACE_BLOCK_BUDGET 65536 // Blocks shared out between classes by traced frequency
+#define MAX_CLASS_BLOCKS ((size_t)1 << 20)
+#define BATCH_BYTES 8192 // Bytes a thread cache refill should move
+#define MIN_BATCH 4
+#define MAX_BATCH 64
+
+typedef struct {
+    size_t size;
+    size_t blocks;
+    size_t batch;
+} SizeClass;
+
+// Fixed spacing: four classes per doubling, 16-byte steps at the bottom
+static size_t default_classes(SizeClass* classes) {
+    size_t count = 0;
+    for (size_t size = GRANULE; size <= DEFAULT_MAX_SIZE;) {
+        classes[count++].size = size;
+        size_t power = 1;
+        while (power * 2 <= size) {
+            power *= 2;
+        }
+        size += size < 128 ? GRANULE : power / 4;
+    }
+    for (size_t i = 0; i < count; i++) {
+        classes[i].blocks = SLAB_BYTES / classes[i].size;
+    }
+    return count;
+}
+
+// Read a trace into allocation counts per granule; returns the largest granule seen, or 0
+static size_t read_trace(const char* path, double* counts) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t largest = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* end;
+        unsigned long long size = strtoull(line, &end, 10);
+        if (end == line) {
+            continue; // Blank or comment line
+        }
+        double count = 1;
+        char* rest = end;
+        unsigned long long repeat = strtoull(rest, &end, 10);
+        if (end != rest) {
+            count = (double)repeat;
+        }
+        if (size > MAX_CLASS_SIZE) {
+            continue;
+        }
+        size_t granule = size == 0 ? 1 : (size_t)((size + GRANULE - 1) >> GRANULE_SHIFT);
+        counts[granule] += count;
+        if (granule > largest) {
+            largest = granule;
+        }
+    }
+    fclose(file);
+    return largest;
+}
+
+// Place at most max_classes classes over the traced granules, minimizing rounding waste
+static size_t trace_classes(const double* counts, size_t largest, size_t max_classes, SizeClass* classes) {
+    // Optimal class tops always sit on traced sizes
+    size_t points[MAX_GRANULES + 1];
+    size_t point_count = 0;
+    for (size_t g = 1; g <= largest; g++) {
+        if (counts[g] > 0) {
+            points[point_count++] = g;
+        }
+    }
+    if (max_classes > point_count) {
+        max_classes = point_count;
+    }
+
+    // waste[i][j]: bytes lost when points i..j all round up to point j
+    static double waste[MAX_GRANULES + 1][MAX_GRANULES + 1];
+    for (size_t j = 0; j < point_count; j++) {
+        double sum = 0;
+        for (size_t i = j + 1; i-- > 0;) {
+            sum += counts[points[i]] * (double)(points[j] - points[i]) * GRANULE;
+            waste[i][j] = sum;
+        }
+    }
+
+    // cost[k][j]: least waste covering points 0..j with k + 1 classes, the last one topping at j
+    static double cost[CLASS_LIMIT][MAX_GRANULES + 1];
+    static size_t previous[CLASS_LIMIT][MAX_GRANULES + 1];
+    for (size_t j = 0; j < point_count; j++) {
+        cost[0][j] = waste[0][j];
+    }
+    for (size_t k = 1; k < max_classes; k++) {
+        for (size_t j = 0; j < point_count; j++) {
+            cost[k][j] = cost[k - 1][j];
+            previous[k][j] = SIZE_MAX; // No extra class helps
+            for (size_t i = 0; i < j; i++) {
+                double total = cost[k - 1][i] + waste[i + 1][j];
+                if (total < cost[k][j]) {
+                    cost[k][j] = total;
+                    previous[k][j] = i;
+                }
+            }
+        }
+    }
+
+    // Walk the choices back from the largest traced size
+    size_t tops[CLASS_LIMIT];
+    size_t count = 0;
+    size_t j = point_count - 1;
+    for (size_t k = max_classes; k-- > 0;) {
+        if (k == 0 || previous[k][j] != SIZE_MAX) {
+            tops[count++] = j;
+            if (k == 0) {
+                break;
+            }
+            j = previous[k][j];
+        }
+    }
+
+    double total = 0;
+    for (size_t g = 1; g <= largest; g++) {
+        total += counts[g];
+    }
+    size_t first = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t top = points[tops[count - 1 - i]];
+        double share = 0;
+        for (size_t g = first; g <= top; g++) {
+            share += counts[g];
+        }
+        first = top + 1;
+
+        SizeClass* class = &classes[i];
+        class->size = top * GRANULE;
+        class->blocks = SLAB_BYTES / class->size;
+        size_t traced = (size_t)(share / total * TRACE_BLOCK_BUDGET);
+        if (traced > class->blocks) {
+            class->blocks = traced < MAX_CLASS_BLOCKS ? traced : MAX_CLASS_BLOCKS;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    const char* trace = NULL;
+    const char* output = NULL;
+    size_t max_classes = DEFAULT_MAX_CLASSES;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--max-classes") == 0 && i + 1 < argc) {
+            max_classes = (size_t)strtoul(argv[++i], NULL, 10);
+        } else {
+            output = argv[i];
+        }
+    }
+    if (output == NULL || max_classes == 0 || max_classes > CLASS_LIMIT) {
+        fprintf(stderr, "usage: %s [--trace FILE] [--max-classes 1-%d] OUTPUT\n", argv[0], CLASS_LIMIT);
+        return EXIT_FAILURE;
+    }
+
+    SizeClass classes[CLASS_LIMIT * 2];
+    size_t count = 0;
+    if (trace != NULL) {
+        static double counts[MAX_GRANULES + 1];
+        size_t largest = read_trace(trace, counts);
+        if (largest > 0) {
+            count = trace_classes(counts, largest, max_classes, classes);
+        } else {
+            fprintf(stderr, "%s: no allocations up to %d bytes, using the default classes\n", trace, MAX_CLASS_SIZE);
+        }
+    }
+    if (count == 0) {
+        count = default_classes(classes);
+        if (count > max_classes) {
+            count = max_classes;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t batch = BATCH_BYTES / classes[i].size;
+        classes[i].batch = batch < MIN_BATCH ? MIN_BATCH : (batch > MAX_BATCH ? MAX_BATCH : batch);
+    }
+
+    FILE* out = fopen(output, "w");
+    if (out == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    size_t max_size = classes[count - 1].size;
+    fprintf(out, "// Generated by gen_size_classes%s%s; do not edit\n", trace != NULL ? " from " : "", trace != NULL ? trace : "");
+    fprintf(out, "#ifndef AMM_SIZE_CLASSES_H\n#define AMM_SIZE_CLASSES_H\n\n#include <stdint.h>\n\n");
+    fprintf(out, "#define AMM_STATIC_CLASS_COUNT %zu\n", count);
+    fprintf(out, "#define AMM_STATIC_CLASS_GRANULE_SHIFT %d\n", GRANULE_SHIFT);
+    fprintf(out, "#define AMM_STATIC_CLASS_ALIGNMENT %zu\n", GRANULE);
+    fprintf(out, "#define AMM_STATIC_CLASS_MAX_SIZE %zu\n\n", max_size);
+
+    fprintf(out, "// Block size, blocks per slab and thread cache refill batch of each class\n");
+    fprintf(out, "static const uint32_t amm_class_size[AMM_STATIC_CLASS_COUNT] = {");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%zu", i == 0 ? "" : ", ", classes[i].size);
+    }
+    fprintf(out, "};\nstatic const uint32_t amm_class_blocks[AMM_STATIC_CLASS_COUNT] = {");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%zu", i == 0 ? "" : ", ", classes[i].blocks);
+    }
+    fprintf(out, "};\nstatic const uint16_t amm_class_batch[AMM_STATIC_CLASS_COUNT] = {");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%zu", i == 0 ? "" : ", ", classes[i].batch);
+    }
+
+    // Class of every size, indexed by (size + granule - 1) >> shift
+    fprintf(out, "};\n\n// Class index by size in granules, rounded up\n");
+    fprintf(out, "static const uint8_t amm_size_class[(AMM_STATIC_CLASS_MAX_SIZE >> AMM_STATIC_CLASS_GRANULE_SHIFT) + 1] = {");
+    size_t class = 0;
+    for (size_t g = 0; g <= max_size / GRANULE; g++) {
+        while (classes[class].size < g * GRANULE) {
+            class++;
+        }
+        fprintf(out, "%s%s%zu", g == 0 ? "" : ",", g % 32 == 0 ? "\n    " : " ", class);
+    }
+    fprintf(out, "\n};\n\n#endif // AMM_SIZE_CLASSES_H\n");
+    if (fclose(out) != 0) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}